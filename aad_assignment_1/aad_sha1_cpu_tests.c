@@ -11,6 +11,8 @@
 #include "aad_data_types.h"
 #include "aad_utilities.h"
 #include "aad_sha1_cpu.h"
+#include "aad_sha1_batch.h"
+#include "aad_sha1_stream.h"
 
 //
 // test the reference implementation
@@ -110,6 +112,254 @@ static void test_sha1(int n_tests,int n_measurements)
 }
 
 
+//
+// test the batch interface (array of structures in and out, kernel selected at run time)
+//
+
+static void test_sha1_batch(int n_tests,int n_measurements)
+{
+# define N_BATCH  1024
+  static u32_t data[N_BATCH][14];
+  static u32_t hash[N_BATCH][5];
+  u32_t reference[5];
+  double hashes_per_second;
+  int n,i,m,count;
+  u32_t sum;
+
+  // test (all batch sizes from 0 to 40, so that every tail case is exercised, and then full batches)
+  for(n = 0;n < n_tests;n++)
+  {
+    count = (n <= 40) ? n : N_BATCH;
+    for(m = 0;m < count;m++)
+    {
+      for(i = 0;i < 55;i++)
+        ((u08_t *)&data[m][0])[i ^ 3] = random_byte();
+      ((u08_t *)&data[m][0])[55 ^ 3] = 0x80;
+    }
+    sha1_batch((const u32_t (*)[14])data,(size_t)count,hash);
+    for(m = 0;m < count;m++)
+    {
+      sha1(&data[m][0],&reference[0]);
+      for(i = 0;i < 5;i++)
+        if(hash[m][i] != reference[i])
+        {
+          fprintf(stderr,"sha1_batch() failure for n=%d, count=%d, message %d, word %d (kernel %s)\n",n,count,m,i,sha1_batch_kernel_name());
+          exit(1);
+        }
+    }
+  }
+  // measure
+  time_measurement();
+  sum = 0u;
+  for(n = 0;n < n_measurements;n += N_BATCH)
+  {
+    data[0][0]++;
+    sha1_batch((const u32_t (*)[14])data,(size_t)N_BATCH,hash);
+    sum += hash[0][4];
+  }
+  time_measurement();
+  if(sum == 0u)
+    fprintf(stderr,"sha1_batch(): what a coincidence, sum=0\n");
+  hashes_per_second = (double)n / cpu_time_delta();
+  // report
+  printf("sha1_batch() passed (%d test%s, %s kernel, %.0f secure hashes per second)\n",n_tests,(n_tests == 1) ? "" : "s",sha1_batch_kernel_name(),hashes_per_second);
+# undef N_BATCH
+}
+
+
+//
+// test the counter kernels (16 coins that differ only in the counter words, kernel chosen by the caller)
+//
+
+static void test_sha1_counter(int n_tests,int n_measurements)
+{
+  struct { const char *name; int supported; sha1_counter_kernel_t kernel; } kernels[5];
+  u32_t tmpl[14],coin[14],reference[SHA1_COUNTER_BLOCK],hash[5],first_word,expected,mask;
+  u64_t counter;
+  double hashes_per_second;
+  int n_kernels,n,i,k,lane,widest;
+
+  n_kernels = 0;
+  kernels[n_kernels].name = "scalar";
+  kernels[n_kernels].supported = 1;
+  kernels[n_kernels++].kernel = sha1_counter16_scalar;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  kernels[n_kernels].name = "sse2";
+  kernels[n_kernels].supported = 1;
+  kernels[n_kernels++].kernel = sha1_counter16_sse2;
+  kernels[n_kernels].name = "avx";
+  kernels[n_kernels].supported = __builtin_cpu_supports("avx");
+  kernels[n_kernels++].kernel = sha1_counter16_avx;
+  kernels[n_kernels].name = "avx2";
+  kernels[n_kernels].supported = __builtin_cpu_supports("avx2");
+  kernels[n_kernels++].kernel = sha1_counter16_avx2;
+  kernels[n_kernels].name = "avx512f";
+  kernels[n_kernels].supported = __builtin_cpu_supports("avx512f");
+  kernels[n_kernels++].kernel = sha1_counter16_avx512f;
+#endif
+  // test (random templates and counters; the first word of one lane, so that every lane gets checked)
+  for(n = 0;n < n_tests;n++)
+  {
+    for(i = 0;i < 55;i++)
+      ((u08_t *)&tmpl[0])[i ^ 3] = random_byte();
+    ((u08_t *)&tmpl[0])[55 ^ 3] = 0x80;
+    counter = 0;
+    for(i = 0;i < 8;i++)
+      counter = (counter << 8) | (u64_t)random_byte();
+    counter &= ~(u64_t)(SHA1_COUNTER_BLOCK - 1);
+    for(i = 0;i < 14;i++)
+      coin[i] = tmpl[i];
+    coin[4] = (u32_t)(counter >> 32);
+    for(lane = 0;lane < SHA1_COUNTER_BLOCK;lane++)
+    {
+      coin[3] = (u32_t)counter + (u32_t)lane;
+      sha1(coin,hash);
+      reference[lane] = hash[0];
+    }
+    first_word = reference[n % SHA1_COUNTER_BLOCK];
+    expected = 0u;
+    for(lane = 0;lane < SHA1_COUNTER_BLOCK;lane++)
+      if(reference[lane] == first_word)
+        expected |= 1u << lane;
+    for(k = 0;k < n_kernels;k++)
+      if(kernels[k].supported && (mask = kernels[k].kernel(tmpl,counter,first_word)) != expected)
+      {
+        fprintf(stderr,"sha1_counter16_%s() failure for n=%d (mask 0x%04X, expected 0x%04X)\n",kernels[k].name,n,mask,expected);
+        exit(1);
+      }
+  }
+  // measure (the widest supported kernel)
+  widest = 0;
+  for(k = 0;k < n_kernels;k++)
+    if(kernels[k].supported)
+      widest = k;
+  time_measurement();
+  mask = 0u;
+  for(n = 0;n < n_measurements;n += SHA1_COUNTER_BLOCK)
+    mask ^= kernels[widest].kernel(tmpl,(u64_t)n,0xAAD20250u);
+  time_measurement();
+  if(mask != 0u)
+    fprintf(stderr,"sha1_counter16_%s(): what a coincidence, a DETI coin signature\n",kernels[widest].name);
+  hashes_per_second = (double)n / cpu_time_delta();
+  // report
+  printf("sha1_counter16() passed (%d test%s, ",n_tests,(n_tests == 1) ? "" : "s");
+  for(k = 0;k < n_kernels;k++)
+    if(kernels[k].supported)
+      printf("%s ",kernels[k].name);
+  printf("kernels, %s: %.0f secure hashes per second)\n",kernels[widest].name,hashes_per_second);
+}
+
+
+//
+// test the implementation for messages of arbitrary length (RFC 3174 test vectors, streaming and multi-buffer)
+//
+
+static void test_sha1_stream(int n_tests,int n_measurements)
+{
+  static const char *rfc_data[4] =
+  {
+    "abc",
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+    "a",
+    "0123456701234567012345670123456701234567012345670123456701234567"
+  };
+  static const long rfc_repeat[4] = { 1l,1l,1000000l,10l };
+  static const char *rfc_result[4] =
+  {
+    "a9993e364706816aba3e25717850c26c9cd0d89d",
+    "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+    "34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+    "dea356a2cddd90c7a7ecedc5ebb563934f460452"
+  };
+# define N_MESSAGES  67
+# define MAX_SIZE    300
+  static u08_t messages[N_MESSAGES][MAX_SIZE];
+  static u08_t digests[N_MESSAGES][20],reference[20];
+  const u08_t *pointers[N_MESSAGES];
+  size_t sizes[N_MESSAGES];
+  static union { u08_t c[14 * 4]; u32_t i[14]; } data;
+  u32_t hash[5];
+  sha1_stream_t ctx;
+  char computed[41];
+  double bytes_per_second;
+  long r;
+  int n,i,m;
+
+  // RFC 3174 test vectors
+  for(n = 0;n < 4;n++)
+  {
+    sha1_stream_init(&ctx);
+    for(r = 0l;r < rfc_repeat[n];r++)
+      sha1_stream_update(&ctx,rfc_data[n],strlen(rfc_data[n]));
+    sha1_stream_final(&ctx,reference);
+    for(i = 0;i < 20;i++)
+      sprintf(&computed[2 * i],"%02x",(int)reference[i]);
+    if(strcmp(computed,rfc_result[n]) != 0)
+    {
+      fprintf(stderr,"sha1_stream() failure for RFC 3174 test %d:\n  expected %s\n  computed %s\n",n + 1,rfc_result[n],computed);
+      exit(1);
+    }
+  }
+  // random messages: multi-buffer and byte-by-byte streaming against one-shot streaming, and 55-byte messages against sha1()
+  for(n = 0;n < n_tests;n++)
+  {
+    for(m = 0;m < N_MESSAGES;m++)
+    {
+      sizes[m] = (m == 0) ? (size_t)0 : (size_t)(random_byte() + 256 * (random_byte() & 1)) % (MAX_SIZE + 1);
+      for(i = 0;i < (int)sizes[m];i++)
+        messages[m][i] = random_byte();
+      pointers[m] = &messages[m][0];
+    }
+    sha1_multi(pointers,sizes,(size_t)N_MESSAGES,digests);
+    for(m = 0;m < N_MESSAGES;m++)
+    {
+      sha1_digest(pointers[m],sizes[m],reference);
+      if(memcmp(digests[m],reference,(size_t)20) != 0)
+      {
+        fprintf(stderr,"sha1_multi() failure for n=%d, message %d (%zu bytes)\n",n,m,sizes[m]);
+        exit(1);
+      }
+    }
+    sha1_stream_init(&ctx);
+    for(i = 0;i < (int)sizes[N_MESSAGES - 1];i++)
+      sha1_stream_update(&ctx,&messages[N_MESSAGES - 1][i],(size_t)1);
+    sha1_stream_final(&ctx,reference);
+    if(memcmp(digests[N_MESSAGES - 1],reference,(size_t)20) != 0)
+    {
+      fprintf(stderr,"sha1_stream_update() failure for n=%d (byte by byte)\n",n);
+      exit(1);
+    }
+    for(i = 0;i < 55;i++)
+      data.c[i ^ 3] = messages[1][i];
+    data.c[55 ^ 3] = 0x80;
+    sha1(&data.i[0],&hash[0]);
+    sha1_digest(&messages[1][0],(size_t)55,reference);
+    for(i = 0;i < 5;i++)
+      if(hash[i] != sha1_load_be(&reference[4 * i]))
+      {
+        fprintf(stderr,"sha1_digest() and sha1() disagree for n=%d\n",n);
+        exit(1);
+      }
+  }
+  // measure (multi-buffer, messages of MAX_SIZE bytes)
+  for(m = 0;m < N_MESSAGES;m++)
+    sizes[m] = (size_t)MAX_SIZE;
+  time_measurement();
+  for(n = 0;n < n_measurements;n += N_MESSAGES * (MAX_SIZE / 64))
+  {
+    messages[0][0]++;
+    sha1_multi(pointers,sizes,(size_t)N_MESSAGES,digests);
+  }
+  time_measurement();
+  bytes_per_second = (double)n / (double)(MAX_SIZE / 64) * (double)MAX_SIZE / cpu_time_delta();
+  // report
+  printf("sha1_stream() and sha1_multi() passed (RFC 3174 + %d test%s, %s kernel, %.0f MB per second)\n",n_tests,(n_tests == 1) ? "" : "s",sha1_batch_kernel_name(),bytes_per_second * 1.0e-6);
+# undef N_MESSAGES
+# undef MAX_SIZE
+}
+
+
 //
 // test the avx implementation
 //
@@ -400,6 +650,9 @@ int main(void)
   int n_measurements = 10000000;
 
   test_sha1(n_tests,n_measurements);
+  test_sha1_batch(n_tests,n_measurements);
+  test_sha1_counter(n_tests,n_measurements);
+  test_sha1_stream(n_tests,n_measurements);
 #if defined(__AVX__)
   test_sha1_avx(n_tests,n_measurements);
 #endif
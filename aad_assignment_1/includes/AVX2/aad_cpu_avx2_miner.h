@@ -13,6 +13,7 @@
 #include "../aad_vault.h"
 #include "../aad_utilities.h"
 #include "../aad_coin_types.h"
+#include "../aad_shm_nonce.h"
 
 static volatile int stop_signal = 0;
 static volatile int coins_found = 0;
@@ -114,7 +115,9 @@ static inline void check_and_save_coins_avx2(v8si coin[14], v8si hash[5], const
 static inline void mine_cpu_avx2_coins(const coin_config_t *config) {
     v8si coin[14] __attribute__((aligned(32)));
     v8si hash[5] __attribute__((aligned(32)));
-    u64_t counter = 0;
+    shm_nonce_t shm;
+    u64_t counter, counter_end;
+    u64_t attempts = 0;
     time_t start, last_print;
     double elapsed;
 
@@ -131,33 +134,43 @@ static inline void mine_cpu_avx2_coins(const coin_config_t *config) {
         printf("[*] Starting DETI coin mining (AVX2)...\n\n");
     }
 
+    // counters come from the shared allocator with DETI_SHM, otherwise from 0 as before
+    shm_nonce_attach(&shm, config);
+    shm_nonce_print(&shm);
+    shm_nonce_refill(&shm, &counter, &counter_end);
+
     while (!stop_signal) {
         update_counters_avx2(coin, counter, config);
         sha1_avx2(coin, hash);
         check_and_save_coins_avx2(coin, hash, config);
 
         counter += 8;
+        attempts += 8;
+        if (__builtin_expect(counter == counter_end, 0)) {
+            shm_nonce_refill(&shm, &counter, &counter_end);
+        }
 
-        if (__builtin_expect((counter & 0xFFFFFF) == 0, 0)) {
+        if (__builtin_expect((attempts & 0xFFFFFF) == 0, 0)) {
             time_t now = time(NULL);
             if (difftime(now, last_print) >= 5.0) {
                 elapsed = difftime(now, start);
                 printf("[%.0fs] %luM @ %.2fM/s | Coins:%d\n",
-                       elapsed, counter/1000000UL,
-                       (elapsed > 0 ? counter/elapsed/1e6 : 0),
+                       elapsed, attempts/1000000UL,
+                       (elapsed > 0 ? attempts/elapsed/1e6 : 0),
                        coins_found);
                 last_print = now;
             }
         }
     }
 
+    shm_nonce_detach(&shm);
     elapsed = difftime(time(NULL), start);
     printf("\n╔════════════════════════════════════════════════════════════╗\n");
     printf("║                      FINAL STATISTICS                      ║\n");
     printf("╠════════════════════════════════════════════════════════════╣\n");
-    printf("║ Total attempts:  %-37lu ║\n", counter);
+    printf("║ Total attempts:  %-37lu ║\n", attempts);
     printf("║ Time:            %.2f seconds%-26s║\n", elapsed, "");
-    printf("║ Average rate:    %.2f M/s%-30s║\n", counter/elapsed/1e6, "");
+    printf("║ Average rate:    %.2f M/s%-30s║\n", attempts/elapsed/1e6, "");
     printf("║ Coins found:     %-37d ║\n", coins_found);
     printf("╚════════════════════════════════════════════════════════════╝\n");
 }
@@ -0,0 +1,347 @@
+#ifndef AAD_HYBRID_MINER_H
+#define AAD_HYBRID_MINER_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <omp.h>
+#include "../SIMD_OpenMP/AVX2/aad_cpu_avx2_openMP_miner.h"
+#include "../OpenCL/aad_sha1_opencl.h"
+#include "../aad_shm_nonce.h"
+
+//
+// one process, two kinds of miners: an OpenCL device and native AVX2 threads
+//
+// OpenMP thread 0 is the OpenCL host thread, threads 1..N mine with sha1_avx2; all of them take
+// counter ranges from one nonce scheduler (the device gets large chunks because the scheduler
+// sizes chunks by measured rate) and share the vault writer (the omp critical around save_coin)
+//
+// the host thread keeps HYBRID_IN_FLIGHT launches queued and sleeps on a condition variable that
+// an OpenCL event callback signals, so it does not spin inside a blocking clEnqueueReadBuffer and
+// its core stays (almost) free; the native thread count leaves that core to it; with launches
+// queued back to back the time between two scheduler requests is not the device's speed, so the
+// host thread reports the rate of each finished launch (nonce_scheduler_report_rate)
+//
+// coins use the same layout on both sides: counter in words 3-4 and the time stamp in word 5 (the
+// vault sorts and filters coins by it); the nonce scheduler already keeps the counters of the
+// device and of the threads disjoint; the device stamp is taken at each launch with its '\n'
+// bytes cleared, so a launch never hashes coins that hybrid_launch_collect would reject
+//
+
+#define HYBRID_KERNEL_FILE        "OpenCL/aad_sha1_opencl_kernel.cl"
+#define HYBRID_KERNEL_NAME        "mine_deti_coins_range"
+#define HYBRID_COINS_BUFFER_SIZE  1024u
+#define HYBRID_LOCAL_WORK_SIZE    256u
+#define HYBRID_IN_FLIGHT          2
+
+typedef struct {
+    cl_mem buffer;
+    u32_t host[HYBRID_COINS_BUFFER_SIZE];
+    cl_event done;
+    u64_t first;
+    u32_t count;
+    double submitted;       // when the launch was queued
+    double finished;        // when its read completed (set by the event callback)
+    int busy;
+    int complete;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} hybrid_launch_t;
+
+static void CL_CALLBACK hybrid_launch_complete(cl_event event, cl_int status, void *arg) {
+    hybrid_launch_t *launch = (hybrid_launch_t *)arg;
+    (void)event;
+    (void)status;
+
+    pthread_mutex_lock(&launch->lock);
+    launch->finished = nonce_now();
+    launch->complete = 1;
+    pthread_cond_signal(&launch->cond);
+    pthread_mutex_unlock(&launch->lock);
+}
+
+// time stamp of the device coins: a '\n' byte would invalidate every coin of the launch
+static inline u32_t hybrid_time_stamp(void) {
+    u32_t stamp = (u32_t)time(NULL);
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        if (((stamp >> shift) & 0xFFu) == (u32_t)'\n') {
+            stamp ^= 1u << shift;
+        }
+    }
+    return stamp;
+}
+
+static inline int hybrid_launch_submit(opencl_context_t *ctx, hybrid_launch_t *launch, u64_t first, u64_t end) {
+    size_t global = (size_t)(end - first);
+    size_t local = HYBRID_LOCAL_WORK_SIZE;
+    cl_ulong first_arg = (cl_ulong)first;
+    u32_t stamp = hybrid_time_stamp();
+    cl_int err;
+
+    launch->first = first;
+    launch->count = (u32_t)(end - first);
+    global = (global + local - 1) / local * local;
+    launch->host[0] = 1u;
+    launch->complete = 0;
+
+    err = clEnqueueWriteBuffer(ctx->queue, launch->buffer, CL_FALSE, 0, sizeof(u32_t), &launch->host[0], 0, NULL, NULL);
+    err |= clSetKernelArg(ctx->kernel, 0, sizeof(cl_mem), &launch->buffer);
+    err |= clSetKernelArg(ctx->kernel, 1, sizeof(u32_t), &stamp);
+    err |= clSetKernelArg(ctx->kernel, 2, sizeof(cl_ulong), &first_arg);
+    err |= clSetKernelArg(ctx->kernel, 3, sizeof(u32_t), &launch->count);
+    err |= clEnqueueNDRangeKernel(ctx->queue, ctx->kernel, 1, NULL, &global, &local, 0, NULL, NULL);
+    err |= clEnqueueReadBuffer(ctx->queue, launch->buffer, CL_FALSE, 0, HYBRID_COINS_BUFFER_SIZE * sizeof(u32_t),
+                               launch->host, 0, NULL, &launch->done);
+    if (err != CL_SUCCESS) {
+        return -1;
+    }
+    if (clSetEventCallback(launch->done, CL_COMPLETE, hybrid_launch_complete, launch) != CL_SUCCESS) {
+        clReleaseEvent(launch->done);
+        return -1;
+    }
+    clFlush(ctx->queue);
+    launch->submitted = nonce_now();
+    launch->busy = 1;
+    return 0;
+}
+
+static inline void hybrid_launch_wait(hybrid_launch_t *launch) {
+    pthread_mutex_lock(&launch->lock);
+    while (!launch->complete) {
+        pthread_cond_wait(&launch->cond, &launch->lock);
+    }
+    pthread_mutex_unlock(&launch->lock);
+    clReleaseEvent(launch->done);
+    launch->busy = 0;
+}
+
+// checks the coins a launch reported (rehashed on the host) and saves the valid ones
+static inline void hybrid_launch_collect(hybrid_launch_t *launch, const thread_stats_t *stats, thread_counters_t *counters) {
+    u32_t next_free_idx = launch->host[0];
+
+    if (next_free_idx <= 1u) {
+        return;
+    }
+    if (next_free_idx > HYBRID_COINS_BUFFER_SIZE) {
+        next_free_idx = HYBRID_COINS_BUFFER_SIZE;
+    }
+    for (u32_t offset = 1u; offset + 14u <= next_free_idx; offset += 14u) {
+        u32_t *coin = &launch->host[offset];
+        u32_t hash[5];
+        u08_t *base_coin = (u08_t *)coin;
+        int valid = 1;
+
+        sha1(coin, hash);
+        if (hash[0] != 0xAAD20250u) {
+            continue;
+        }
+        thread_stats_add_share(counters);
+        for (int i = 12; i < 54; i++) {
+            if (base_coin[i ^ 3] == '\n') {
+                valid = 0;
+                break;
+            }
+        }
+        if (valid) {
+            thread_stats_add_coin(counters);
+
+            #pragma omp critical
+            {
+                printf("\n[*] COIN #%lu (OpenCL)\n", thread_stats_total_coins(stats));
+                save_coin(coin);
+            }
+        }
+    }
+}
+
+static inline int hybrid_launches_busy(const hybrid_launch_t launches[HYBRID_IN_FLIGHT]) {
+    for (int k = 0; k < HYBRID_IN_FLIGHT; k++) {
+        if (launches[k].busy) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// releases the first n launches (buffer, lock and condition variable)
+static inline void hybrid_launches_free(hybrid_launch_t launches[HYBRID_IN_FLIGHT], int n) {
+    for (int k = 0; k < n; k++) {
+        clReleaseMemObject(launches[k].buffer);
+        pthread_mutex_destroy(&launches[k].lock);
+        pthread_cond_destroy(&launches[k].cond);
+    }
+}
+
+// OpenCL host loop (OpenMP thread 0)
+static inline void hybrid_device_loop(opencl_context_t *ctx, hybrid_launch_t launches[HYBRID_IN_FLIGHT],
+                                      nonce_scheduler_t *scheduler, thread_stats_t *stats) {
+    thread_counters_t *counters = &stats->threads[0];
+    u64_t hashes = 0;
+    double last_finished = 0.0;
+    int running = 1;
+
+    nonce_scheduler_report_rate(scheduler, 0, 0, 0.0);  // no rate yet, but keep the first chunks small
+    while (running || hybrid_launches_busy(launches)) {
+        for (int k = 0; k < HYBRID_IN_FLIGHT; k++) {
+            hybrid_launch_t *launch = &launches[k];
+            u64_t first, end;
+
+            if (launch->busy) {
+                hybrid_launch_wait(launch);
+                hybrid_launch_collect(launch, stats, counters);
+                hashes += launch->count;
+                thread_stats_set_hashes(counters, hashes);
+                // the device worked on this launch from its submission or the end of the previous one
+                double began = (launch->submitted > last_finished) ? launch->submitted : last_finished;
+                nonce_scheduler_report_rate(scheduler, 0, launch->count, launch->finished - began);
+                last_finished = launch->finished;
+            }
+            if (!running || stop_signal || !nonce_scheduler_next(scheduler, 0, &first, &end)) {
+                running = 0;
+                continue;
+            }
+            if (hybrid_launch_submit(ctx, launch, first, end) != 0) {
+                fprintf(stderr, "OpenCL launch failed; the native threads continue alone\n");
+                running = 0;
+            }
+        }
+    }
+}
+
+static inline void mine_hybrid_coins(opencl_context_t *ctx, int native_threads) {
+    coin_config_t config = coin_config_init(COIN_TYPE_DETI, NULL);
+    cpu_placement_t placement;
+    cpu_placement_init(&placement);
+    cgroup_cpu_t cgroup;
+    cgroup_cpu_init(&cgroup);
+    cl_device_type device_type = CL_DEVICE_TYPE_GPU;
+    clGetDeviceInfo(ctx->device, CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+
+    // the host thread gets one CPU; a CPU device (pocl) also runs its work-items on the host cores,
+    // so it gets half of the rest
+    int cpus = cgroup_cpu_size_threads(&cgroup, cpu_placement_threads(&placement, omp_get_max_threads()));
+    if (native_threads < 0) {
+        native_threads = cpus - 1;
+        if (device_type & CL_DEVICE_TYPE_CPU) {
+            native_threads /= 2;
+        }
+    }
+    if (native_threads < 0) {
+        native_threads = 0;
+    }
+    int num_threads = native_threads + 1;
+
+    printf("[*] Starting DETI coin mining (OpenCL + %d AVX2 threads)...\n", native_threads);
+    printf("   Device: %s / %s%s\n", ctx->platform_name, ctx->device_name,
+           (device_type & CL_DEVICE_TYPE_CPU) ? " (CPU device)" : "");
+    cpu_placement_print(&placement, num_threads);
+    cgroup_cpu_print(&cgroup);
+    shm_nonce_t shm;
+    shm_nonce_attach(&shm, &config);
+    shm_nonce_print(&shm);
+    printf("============================================================\n");
+
+    hybrid_launch_t launches[HYBRID_IN_FLIGHT];
+    memset(launches, 0, sizeof(launches));
+    for (int k = 0; k < HYBRID_IN_FLIGHT; k++) {
+        cl_int err;
+        launches[k].buffer = clCreateBuffer(ctx->context, CL_MEM_READ_WRITE, HYBRID_COINS_BUFFER_SIZE * sizeof(u32_t), NULL, &err);
+        if (err != CL_SUCCESS) {
+            fprintf(stderr, "Error creating buffer\n");
+            hybrid_launches_free(launches, k);
+            cpu_placement_free(&placement);
+            shm_nonce_detach(&shm);
+            return;
+        }
+        pthread_mutex_init(&launches[k].lock, NULL);
+        pthread_cond_init(&launches[k].cond, NULL);
+    }
+
+    thread_stats_t stats;
+    nonce_scheduler_t scheduler;
+    if (thread_stats_init(&stats, num_threads) != 0) {
+        fprintf(stderr, "Error: cannot allocate the per-thread mining state\n");
+        hybrid_launches_free(launches, HYBRID_IN_FLIGHT);
+        cpu_placement_free(&placement);
+        shm_nonce_detach(&shm);
+        return;
+    }
+    if (nonce_scheduler_init(&scheduler, num_threads, shm_nonce_refill, &shm, NONCE_REFILL_ANY, &stop_signal) != 0) {
+        fprintf(stderr, "Error: cannot allocate the per-thread mining state\n");
+        thread_stats_free(&stats);
+        hybrid_launches_free(launches, HYBRID_IN_FLIGHT);
+        cpu_placement_free(&placement);
+        shm_nonce_detach(&shm);
+        return;
+    }
+    thread_stats_watch_cgroup(&stats, &cgroup);
+    thread_stats_start_reporter(&stats);
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        int thread_id = omp_get_thread_num();
+        cpu_placement_pin(&placement, thread_id);
+
+        if (thread_id == 0) {
+            hybrid_device_loop(ctx, launches, &scheduler, &stats);
+        } else {
+            v8si coin[14] __attribute__((aligned(32)));
+            v8si hash[5] __attribute__((aligned(32)));
+            u64_t local_counter = 0;
+            u64_t counter = 0, counter_end = 0;
+            thread_counters_t *counters = &stats.threads[thread_id];
+
+            init_coin_data_avx2(coin, &config);
+            while (!stop_signal) {
+                if (counter >= counter_end) {
+                    thread_stats_park(&stats, thread_id, &stop_signal);
+                    if (!nonce_scheduler_next(&scheduler, thread_id, &counter, &counter_end)) {
+                        break;
+                    }
+                }
+                update_counters_avx2(coin, counter, &config);
+                sha1_avx2(coin, hash);
+                check_and_save_coins_avx2(coin, hash, &config, &stats, counters);
+                counter += 8;
+                local_counter += 8;
+                if (__builtin_expect((local_counter & 0xFFFFF) == 0, 0)) {
+                    thread_stats_set_hashes(counters, local_counter);
+                }
+            }
+            thread_stats_set_hashes(counters, local_counter);
+        }
+    }
+
+    thread_stats_stop_reporter(&stats);
+    nonce_scheduler_free(&scheduler);
+    shm_nonce_detach(&shm);
+
+    thread_totals_t totals;
+    thread_stats_totals(&stats, &totals);
+    double elapsed = thread_stats_elapsed(&stats);
+    u64_t device_hashes = stats.threads[0].hashes;
+    u64_t native_hashes = totals.hashes - device_hashes;
+
+    printf("\n╔════════════════════════════════════════════════════════════╗\n");
+    printf("║              HYBRID OPENCL + AVX2 FINAL STATISTICS         ║\n");
+    printf("╠════════════════════════════════════════════════════════════╣\n");
+    printf("║ Device:          %-37.37s ║\n", ctx->device_name);
+    printf("║ Native threads:  %-37d ║\n", native_threads);
+    printf("║ Total attempts:  %-37lu ║\n", totals.hashes);
+    printf("║ Time:            %.2f seconds%-26s║\n", elapsed, "");
+    printf("║ Average rate:    %.2f M/s%-30s║\n", totals.hashes / elapsed / 1e6, "");
+    printf("║ OpenCL rate:     %.2f M/s%-30s║\n", device_hashes / elapsed / 1e6, "");
+    printf("║ AVX2 rate:       %.2f M/s%-30s║\n", native_hashes / elapsed / 1e6, "");
+    printf("║ Coins found:     %-37lu ║\n", totals.coins);
+    printf("║ Shares:          %-37lu ║\n", totals.shares);
+    printf("╚════════════════════════════════════════════════════════════╝\n");
+
+    thread_stats_free(&stats);
+    cpu_placement_free(&placement);
+    hybrid_launches_free(launches, HYBRID_IN_FLIGHT);
+}
+
+#endif
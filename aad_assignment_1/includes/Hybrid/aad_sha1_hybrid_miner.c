@@ -0,0 +1,46 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "aad_hybrid_miner.h"
+
+void handle_sigint(int sig) {
+    (void)sig;
+    printf("\n[Stopping OpenCL and native threads...]\n");
+    stop_signal = 1;
+}
+
+int main(int argc, char *argv[]) {
+    opencl_context_t ctx;
+
+    if (argc < 3) {
+        printf("Usage: %s <platform_id> <device_id> [native_threads]\n", argv[0]);
+        printf("  native_threads: AVX2 threads next to the OpenCL host thread (default: one per free CPU)\n\n");
+        list_opencl_devices_of_type(CL_DEVICE_TYPE_ALL);
+        return 0;
+    }
+    int platform_id = atoi(argv[1]);
+    int device_id = atoi(argv[2]);
+    int native_threads = (argc >= 4) ? atoi(argv[3]) : -1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    if (initialize_opencl_of_type(&ctx, platform_id, device_id, CL_DEVICE_TYPE_ALL) != 0) {
+        return 1;
+    }
+    char *kernel_source = load_kernel_source(HYBRID_KERNEL_FILE);
+    if (kernel_source == NULL) {
+        cleanup_opencl(&ctx);
+        return 1;
+    }
+    if (load_opencl_kernel(&ctx, kernel_source, HYBRID_KERNEL_NAME, "-cl-fast-relaxed-math -cl-mad-enable") != 0) {
+        free(kernel_source);
+        cleanup_opencl(&ctx);
+        return 1;
+    }
+    free(kernel_source);
+
+    signal(SIGINT, handle_sigint);
+    mine_hybrid_coins(&ctx, native_threads);
+    save_coin(NULL);
+    cleanup_opencl(&ctx);
+    return 0;
+}
@@ -0,0 +1,386 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "deti_miner.h"
+#include "../aad_data_types.h"
+#include "../aad_sha1_batch.h"
+#include "../aad_coin_types.h"
+#include "../aad_cgroup.h"
+#include "../aad_nonce_scheduler.h"
+#include "../aad_thread_stats.h"
+#include "../aad_vault_dedup.h"
+
+//
+// implementation of the embeddable miner
+//
+// the kernels are the counter kernels of aad_sha1_batch.h: each hashes one block of DETI_BLOCK
+// consecutive nonces and returns the mask of the lanes whose first hash word is the signature;
+// those candidates are rebuilt and rechecked with the scalar sha1, so the kernels need no
+// coin-saving code of their own
+//
+// the nonce scheduler hands out multiples of NONCE_ALIGN (16) and the low counter word never
+// carries inside a block, so the kernels only broadcast the template and add the lane index
+//
+// the library is compiled for the x86-64 baseline (it may run on any machine its caller runs on);
+// every vector kernel has its own target attribute and is only used when __builtin_cpu_supports
+// reports its instruction set
+//
+
+#define DETI_BLOCK          SHA1_COUNTER_BLOCK
+#define DETI_SIGNATURE      0xAAD20250u
+#define DETI_PUBLISH_MASK   0xFFFFFu     // publish the hash count every 2^20 hashes
+
+struct deti_miner {
+    deti_miner_config_t config;
+    char custom_text[28];
+    deti_backend_t backend;
+    sha1_counter_kernel_t kernel;
+    u32_t tmpl[14];                 // coin template (counter words are overwritten by the kernels)
+    int n_threads;
+
+    volatile int stop;
+    pthread_t *workers;
+    nonce_scheduler_t scheduler;
+    nonce_cursor_t cursor;
+
+    pthread_mutex_t state_lock;     // running, stats, stats_valid and stopped_elapsed (deti_miner_stats)
+    int running;
+    thread_stats_t stats;
+    int stats_valid;
+    double stopped_elapsed;         // elapsed time of the last run (after deti_miner_stop)
+
+    pthread_mutex_t coin_lock;      // vault writer, duplicate filter and on_coin
+    vault_dedup_set_t seen;
+    int seen_loaded;
+    u64_t vault_errors;             // coins of this run not appended to the vault (atomic)
+};
+
+//
+// kernels
+//
+
+// kernel of a backend (NULL when it is not compiled in or the CPU lacks it)
+static sha1_counter_kernel_t deti_backend_kernel(deti_backend_t backend) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+#endif
+    switch (backend) {
+    case DETI_BACKEND_CPU:
+        return sha1_counter16_scalar;
+#if defined(__x86_64__)
+    case DETI_BACKEND_AVX:
+        return __builtin_cpu_supports("avx") ? sha1_counter16_avx : NULL;
+    case DETI_BACKEND_AVX2:
+        return __builtin_cpu_supports("avx2") ? sha1_counter16_avx2 : NULL;
+    case DETI_BACKEND_AVX512:
+        return __builtin_cpu_supports("avx512f") ? sha1_counter16_avx512f : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+const char *deti_miner_backend_name(deti_backend_t backend) {
+    switch (backend) {
+    case DETI_BACKEND_AUTO:   return "auto";
+    case DETI_BACKEND_CPU:    return "cpu";
+    case DETI_BACKEND_AVX:    return "avx";
+    case DETI_BACKEND_AVX2:   return "avx2";
+    case DETI_BACKEND_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+//
+// coins
+//
+
+// rebuilds and checks the coin of one candidate nonce; called by the mining thread that found it
+static void deti_miner_candidate(deti_miner_t *m, int tid, u64_t counter) {
+    thread_counters_t *counters = &m->stats.threads[tid];
+    u32_t coin[14], hash[5];
+    const u08_t *bytes = (const u08_t *)coin;
+    deti_coin_t found;
+
+    memcpy(coin, m->tmpl, sizeof(coin));
+    coin[3] = (u32_t)counter;
+    coin[4] = (u32_t)(counter >> 32);
+    sha1(coin, hash);
+    if (hash[0] != DETI_SIGNATURE) {
+        return;
+    }
+    thread_stats_add_share(counters);
+    for (int i = 12; i < 54; i++) {
+        if (bytes[i ^ 3] == '\n') {
+            return;
+        }
+    }
+
+    for (int i = 0; i < 55; i++) {
+        found.message[i] = bytes[i ^ 3];
+    }
+    found.power = 0;
+    while (found.power < 128 && ((hash[1 + found.power / 32] >> (31 - found.power % 32)) & 1u) == 0) {
+        found.power++;
+    }
+    found.counter = counter;
+    found.thread = tid;
+
+    pthread_mutex_lock(&m->coin_lock);
+    if (vault_dedup_insert(&m->seen, vault_coin_fingerprint(coin)) != 0) {
+        if (m->config.vault_file != NULL) {
+            FILE *fp = fopen(m->config.vault_file, "a");
+            int ok = (fp != NULL);
+            if (fp != NULL) {
+                ok = fprintf(fp, "V%02d:", (found.power > 99) ? 99 : found.power) > 0 && ok;
+                ok = fwrite(found.message, 1, sizeof(found.message), fp) == sizeof(found.message) && ok;
+                ok = fclose(fp) == 0 && ok;
+            }
+            if (!ok) {
+                __atomic_add_fetch(&m->vault_errors, 1, __ATOMIC_RELAXED);
+            }
+        }
+        thread_stats_add_coin(counters);
+        if (m->config.on_coin != NULL) {
+            m->config.on_coin(m->config.user, &found);
+        }
+    }
+    pthread_mutex_unlock(&m->coin_lock);
+}
+
+//
+// mining threads
+//
+
+typedef struct {
+    deti_miner_t *miner;
+    int tid;
+} deti_worker_arg_t;
+
+static void *deti_miner_worker(void *arg) {
+    deti_miner_t *m = ((deti_worker_arg_t *)arg)->miner;
+    int tid = ((deti_worker_arg_t *)arg)->tid;
+    thread_counters_t *counters = &m->stats.threads[tid];
+    u64_t counter = 0, counter_end = 0;
+    u64_t hashes = 0;
+
+    free(arg);
+    while (!m->stop) {
+        if (counter >= counter_end && !nonce_scheduler_next(&m->scheduler, tid, &counter, &counter_end)) {
+            break;
+        }
+        u32_t mask = m->kernel(m->tmpl, counter, DETI_SIGNATURE);
+        if (__builtin_expect(mask != 0u, 0)) {
+            for (int lane = 0; lane < DETI_BLOCK; lane++) {
+                if (mask & (1u << lane)) {
+                    deti_miner_candidate(m, tid, counter + (u64_t)lane);
+                }
+            }
+        }
+        counter += DETI_BLOCK;
+        hashes += DETI_BLOCK;
+        if (__builtin_expect((hashes & DETI_PUBLISH_MASK) == 0, 0)) {
+            thread_stats_set_hashes(counters, hashes);
+        }
+    }
+    thread_stats_set_hashes(counters, hashes);
+    return NULL;
+}
+
+//
+// public API
+//
+
+// default salt: the creation time mixed with the process id and the number of the instance, so
+// that instances created in the same second, in one process or in several, mine different coins
+static u32_t deti_miner_default_salt(void) {
+    static u32_t instances = 0u;
+    u32_t instance = __atomic_fetch_add(&instances, 1u, __ATOMIC_RELAXED);
+
+    return (u32_t)time(NULL) ^ ((u32_t)getpid() * 0x9E3779B9u) ^ (instance * 0x85EBCA6Bu);
+}
+
+deti_miner_config_t deti_miner_default_config(void) {
+    deti_miner_config_t config;
+
+    memset(&config, 0, sizeof(config));
+    config.backend = DETI_BACKEND_AUTO;
+    return config;
+}
+
+deti_miner_t *deti_miner_create(const deti_miner_config_t *config) {
+    static const deti_backend_t widest_first[] = {DETI_BACKEND_AVX512, DETI_BACKEND_AVX2, DETI_BACKEND_AVX, DETI_BACKEND_CPU};
+    deti_miner_t *m;
+    int salt_word = 5;
+
+    if (config == NULL || config->threads < 0) {
+        return NULL;
+    }
+    if (config->custom_text != NULL && !validate_custom_text(config->custom_text)) {
+        return NULL;
+    }
+    if ((m = (deti_miner_t *)calloc(1, sizeof(*m))) == NULL) {
+        return NULL;
+    }
+    m->config = *config;
+    m->backend = config->backend;
+    if (m->backend == DETI_BACKEND_AUTO) {
+        for (size_t i = 0; i < sizeof(widest_first) / sizeof(widest_first[0]) && m->kernel == NULL; i++) {
+            m->backend = widest_first[i];
+            m->kernel = deti_backend_kernel(m->backend);
+        }
+    } else {
+        m->kernel = deti_backend_kernel(m->backend);
+    }
+    if (m->kernel == NULL) {
+        free(m);
+        return NULL;
+    }
+
+    // same layout as the standalone miners: "DETI coin 2 ", counter, custom text, salt, '\n'
+    m->tmpl[0] = 0x44455449u;
+    m->tmpl[1] = 0x20636F69u;
+    m->tmpl[2] = 0x6E203220u;
+    if (config->custom_text != NULL) {
+        strcpy(m->custom_text, config->custom_text);
+        m->config.custom_text = m->custom_text;
+        salt_word = encode_custom_text(m->tmpl, m->custom_text, 5);
+    }
+    if (salt_word < 13) {
+        // the salt becomes part of every coin, so none of its bytes may be a '\n'
+        u32_t salt = (config->salt != 0u) ? config->salt : deti_miner_default_salt();
+        for (int shift = 0; shift < 32; shift += 8) {
+            if (((salt >> shift) & 0xFFu) == (u32_t)'\n') {
+                salt ^= 1u << shift;
+            }
+        }
+        m->tmpl[salt_word] = salt;
+    }
+    m->tmpl[13] = 0x00000A80u;
+    m->cursor.next = nonce_align_down(config->first_counter);
+    m->cursor.step = NONCE_MAX_CHUNK;
+
+    if (config->threads > 0) {
+        m->n_threads = config->threads;
+    } else {
+        cgroup_cpu_t cgroup;
+        cgroup_cpu_init(&cgroup);
+        m->n_threads = cgroup_cpu_size_threads(&cgroup, cgroup.cpuset_cpus);
+    }
+    pthread_mutex_init(&m->coin_lock, NULL);
+    pthread_mutex_init(&m->state_lock, NULL);
+    return m;
+}
+
+int deti_miner_start(deti_miner_t *m) {
+    if (m == NULL || m->running) {
+        return -1;
+    }
+    if (!m->seen_loaded && m->config.vault_file != NULL) {
+        (void)vault_dedup_load_file(&m->seen, m->config.vault_file, NULL); // a missing vault is fine
+    }
+    m->seen_loaded = 1;
+
+    // deti_miner_stats may be reading the statistics of the previous run
+    pthread_mutex_lock(&m->state_lock);
+    if (m->stats_valid) {
+        thread_stats_free(&m->stats);
+        m->stats_valid = 0;
+    }
+    m->workers = (pthread_t *)calloc((size_t)m->n_threads, sizeof(pthread_t));
+    if (m->workers == NULL || thread_stats_init(&m->stats, m->n_threads) != 0) {
+        pthread_mutex_unlock(&m->state_lock);
+        free(m->workers);
+        m->workers = NULL;
+        return -1;
+    }
+    m->stats_valid = 1;
+    __atomic_store_n(&m->vault_errors, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&m->state_lock);
+    m->stop = 0;
+    if (nonce_scheduler_init(&m->scheduler, m->n_threads, nonce_cursor_refill, &m->cursor, NONCE_REFILL_ANY, &m->stop) != 0) {
+        free(m->workers);
+        m->workers = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < m->n_threads; i++) {
+        deti_worker_arg_t *arg = (deti_worker_arg_t *)malloc(sizeof(*arg));
+        if (arg != NULL) {
+            arg->miner = m;
+            arg->tid = i;
+        }
+        if (arg == NULL || pthread_create(&m->workers[i], NULL, deti_miner_worker, arg) != 0) {
+            free(arg);
+            m->stop = 1;
+            for (int j = 0; j < i; j++) {
+                pthread_join(m->workers[j], NULL);
+            }
+            nonce_scheduler_free(&m->scheduler);
+            free(m->workers);
+            m->workers = NULL;
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&m->state_lock);
+    m->running = 1;
+    pthread_mutex_unlock(&m->state_lock);
+    return 0;
+}
+
+void deti_miner_stop(deti_miner_t *m) {
+    if (m == NULL || !m->running) {
+        return;
+    }
+    m->stop = 1;
+    for (int i = 0; i < m->n_threads; i++) {
+        pthread_join(m->workers[i], NULL);
+    }
+    pthread_mutex_lock(&m->state_lock);
+    m->stopped_elapsed = thread_stats_elapsed(&m->stats);
+    m->running = 0;
+    pthread_mutex_unlock(&m->state_lock);
+    nonce_scheduler_free(&m->scheduler);
+    free(m->workers);
+    m->workers = NULL;
+}
+
+void deti_miner_stats(deti_miner_t *m, deti_miner_stats_t *stats) {
+    thread_totals_t totals;
+
+    memset(stats, 0, sizeof(*stats));
+    if (m == NULL) {
+        return;
+    }
+    stats->threads = m->n_threads;
+    stats->backend = m->backend;
+    pthread_mutex_lock(&m->state_lock);
+    stats->running = m->running;
+    if (m->stats_valid) {
+        thread_stats_totals(&m->stats, &totals);
+        stats->hashes = totals.hashes;
+        stats->coins = totals.coins;
+        stats->shares = totals.shares;
+        stats->vault_errors = __atomic_load_n(&m->vault_errors, __ATOMIC_RELAXED);
+        stats->elapsed = m->running ? thread_stats_elapsed(&m->stats) : m->stopped_elapsed;
+        stats->rate = (stats->elapsed > 0.0) ? (double)stats->hashes / stats->elapsed : 0.0;
+    }
+    pthread_mutex_unlock(&m->state_lock);
+}
+
+void deti_miner_destroy(deti_miner_t *m) {
+    if (m == NULL) {
+        return;
+    }
+    deti_miner_stop(m);
+    if (m->stats_valid) {
+        thread_stats_free(&m->stats);
+    }
+    vault_dedup_free(&m->seen);
+    pthread_mutex_destroy(&m->coin_lock);
+    pthread_mutex_destroy(&m->state_lock);
+    free(m);
+}
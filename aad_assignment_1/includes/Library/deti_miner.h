@@ -0,0 +1,106 @@
+#ifndef DETI_MINER_H
+#define DETI_MINER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// embeddable DETI coin miner (libdeti_miner.a / libdeti_miner.so)
+//
+// all state lives in the deti_miner_t instance: several miners may run in one process, each with
+// its own threads, nonce range, statistics, duplicate filter and (optional) vault file
+//
+//   deti_miner_config_t config = deti_miner_default_config();
+//   config.on_coin = my_callback;
+//   deti_miner_t *miner = deti_miner_create(&config);
+//   deti_miner_start(miner);            // returns at once, mining runs on its own threads
+//   ...
+//   deti_miner_stats(miner, &stats);    // any thread, any time before deti_miner_destroy
+//   deti_miner_stop(miner);             // joins the mining threads
+//   deti_miner_destroy(miner);
+//
+// create, start, stop and destroy of one instance must not run concurrently with each other (call
+// them from the thread that controls the miner); deti_miner_stats may run concurrently with them
+//
+// the library prints nothing; errors are reported through the return values; Library/
+// deti_miner_example.c drives two instances through the whole API (make run-library-example)
+//
+
+#if defined(__GNUC__)
+#define DETI_MINER_API __attribute__((visibility("default")))
+#else
+#define DETI_MINER_API
+#endif
+
+typedef enum {
+    DETI_BACKEND_AUTO = 0,      // widest kernel compiled in and supported by this CPU
+    DETI_BACKEND_CPU,           // scalar
+    DETI_BACKEND_AVX,           // 4 lanes
+    DETI_BACKEND_AVX2,          // 8 lanes
+    DETI_BACKEND_AVX512         // 16 lanes
+} deti_backend_t;
+
+typedef struct {
+    uint8_t message[55];        // the coin, as stored in the vault (byte 54 is '\n')
+    int power;                  // leading zero bits of the last 128 hash bits
+    uint64_t counter;           // nonce that produced it
+    int thread;                 // mining thread that found it
+} deti_coin_t;
+
+// called from a mining thread (one call at a time per instance); must not call deti_miner_stop
+typedef void (*deti_coin_callback_t)(void *user, const deti_coin_t *coin);
+
+typedef struct {
+    deti_backend_t backend;
+    int threads;                // 0 = one per CPU allowed by the cpuset and the cgroup CPU quota
+    const char *custom_text;    // NULL = plain DETI coins, otherwise 1..27 characters, no '\n'
+    uint64_t first_counter;     // first nonce (rounded down to a multiple of 16)
+    uint32_t salt;              // word after the text (0 = time of deti_miner_create, process id
+                                // and instance number); a '\n' byte of it is changed, as a coin
+                                // may hold no '\n' before byte 54
+    const char *vault_file;     // vault to append the coins to (NULL = callback only)
+    deti_coin_callback_t on_coin;
+    void *user;                 // passed to on_coin
+} deti_miner_config_t;
+
+typedef struct {
+    uint64_t hashes;
+    uint64_t coins;
+    uint64_t shares;            // hashes with the DETI signature (coins plus rejected ones)
+    uint64_t vault_errors;      // coins that could not be appended to vault_file (open or write failed)
+    double elapsed;             // seconds of the current (or last) run
+    double rate;                // hashes per second
+    int threads;
+    deti_backend_t backend;     // backend actually used
+    int running;
+} deti_miner_stats_t;
+
+typedef struct deti_miner deti_miner_t;
+
+DETI_MINER_API deti_miner_config_t deti_miner_default_config(void);
+
+// returns NULL when the configuration is invalid (bad text, backend not available) or on ENOMEM
+DETI_MINER_API deti_miner_t *deti_miner_create(const deti_miner_config_t *config);
+
+// 0 on success, -1 when already running or the threads cannot be started; a restarted miner
+// continues after the last nonce range of the previous run, its statistics start from zero
+DETI_MINER_API int deti_miner_start(deti_miner_t *miner);
+
+// stops and joins the mining threads (no-op when not running)
+DETI_MINER_API void deti_miner_stop(deti_miner_t *miner);
+
+DETI_MINER_API void deti_miner_stats(deti_miner_t *miner, deti_miner_stats_t *stats);
+
+// stops the miner if needed and frees it
+DETI_MINER_API void deti_miner_destroy(deti_miner_t *miner);
+
+DETI_MINER_API const char *deti_miner_backend_name(deti_backend_t backend);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "deti_miner.h"
+
+//
+// example (and smoke test) of the embeddable miner library
+//
+// two instances mine side by side (the widest backend with plain coins, the scalar one with a
+// custom text and a salt made of '\n' bytes), a monitor thread polls deti_miner_stats of both while
+// the main thread starts, stops and restarts them; exits with 1 when something does not add up
+//
+// usage: deti_miner_example [seconds per run]
+//
+
+static volatile int monitor_done = 0;
+
+static void on_coin(void *user, const deti_coin_t *coin) {
+    printf("[%s] coin (power %d, thread %d): %.54s\n", (const char *)user, coin->power, coin->thread,
+           (const char *)coin->message);
+}
+
+static void sleep_seconds(double seconds) {
+    struct timespec nap;
+
+    nap.tv_sec = (time_t)seconds;
+    nap.tv_nsec = (long)((seconds - (double)nap.tv_sec) * 1e9);
+    nanosleep(&nap, NULL);
+}
+
+// polls the statistics of both miners while they are started and stopped by the main thread
+static void *monitor(void *arg) {
+    deti_miner_t **miners = (deti_miner_t **)arg;
+    deti_miner_stats_t stats;
+
+    while (!monitor_done) {
+        for (int i = 0; i < 2; i++) {
+            deti_miner_stats(miners[i], &stats);
+        }
+        sleep_seconds(0.001);
+    }
+    return NULL;
+}
+
+static int report(const char *name, deti_miner_t *miner) {
+    deti_miner_stats_t stats;
+
+    deti_miner_stats(miner, &stats);
+    printf("%-6s %-6s %2d threads  %6.2f s  %8.2f M/s  %llu coins  %llu shares\n", name,
+           deti_miner_backend_name(stats.backend), stats.threads, stats.elapsed, stats.rate / 1e6,
+           (unsigned long long)stats.coins, (unsigned long long)stats.shares);
+    return (stats.running || stats.hashes == 0 || stats.elapsed <= 0.0) ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 3.0;
+    deti_miner_config_t config;
+    deti_miner_t *miners[2];
+    pthread_t monitor_thread;
+    int errors = 0;
+
+    if (seconds <= 0.0) {
+        seconds = 3.0;
+    }
+
+    config = deti_miner_default_config();
+    config.threads = 2;
+    config.on_coin = on_coin;
+    config.user = "plain";
+    miners[0] = deti_miner_create(&config);
+
+    config = deti_miner_default_config();
+    config.backend = DETI_BACKEND_CPU;
+    config.threads = 1;
+    config.custom_text = "library example";
+    config.salt = 0x0A0A0A0Au;
+    config.first_counter = 1ULL << 40;
+    config.on_coin = on_coin;
+    config.user = "custom";
+    miners[1] = deti_miner_create(&config);
+
+    config.custom_text = "bad\ntext";
+    if (miners[0] == NULL || miners[1] == NULL || deti_miner_create(&config) != NULL) {
+        fprintf(stderr, "deti_miner_create: unexpected result\n");
+        return 1;
+    }
+
+    pthread_create(&monitor_thread, NULL, monitor, miners);
+    for (int run = 1; run <= 2; run++) {
+        for (int i = 0; i < 2; i++) {
+            if (deti_miner_start(miners[i]) != 0 || deti_miner_start(miners[i]) != -1) {
+                fprintf(stderr, "deti_miner_start: unexpected result\n");
+                errors++;
+            }
+        }
+        sleep_seconds(seconds);
+        for (int i = 0; i < 2; i++) {
+            deti_miner_stop(miners[i]);
+        }
+        printf("run %d\n", run);
+        errors += report("plain", miners[0]);
+        errors += report("custom", miners[1]);
+    }
+    monitor_done = 1;
+    pthread_join(monitor_thread, NULL);
+
+    deti_miner_destroy(miners[0]);
+    deti_miner_destroy(miners[1]);
+    printf("%s\n", (errors == 0) ? "OK" : "FAILED");
+    return (errors == 0) ? 0 : 1;
+}
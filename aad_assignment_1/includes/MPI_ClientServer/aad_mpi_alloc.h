@@ -0,0 +1,188 @@
+#ifndef AAD_MPI_ALLOC_H
+#define AAD_MPI_ALLOC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aad_mpi_common.h"
+
+//
+// nonce range allocation modes
+//
+//   master --- a worker sends TAG_REQUEST_WORK and rank 0 answers with a range (TAG_WORK_ASSIGN)
+//   rma    --- rank 0 exposes the global 64-bit counter cursor in an MPI window and every worker
+//              claims its ranges itself with MPI_Fetch_and_op(MPI_SUM) under a passive-target
+//              lock (MPI_Win_lock_all for the whole run, MPI_Win_flush per claim); rank 0 takes no
+//              part in the claims themselves: it records them when the claimer reports them, pushes
+//              the free entries of its table to the claimers, and handles coins and statistics (its
+//              own hashing threads claim from the window in the same way)
+//
+// in rma mode each worker sizes its ranges from its own measured rate (same target and bounds as
+// the master uses in master mode)
+//
+
+typedef enum {
+    MPI_ALLOC_MASTER = 0,
+    MPI_ALLOC_RMA
+} mpi_alloc_mode_t;
+
+typedef struct {
+    mpi_alloc_mode_t mode;
+    MPI_Win win;
+    u64_t *cursor;              // rank 0: the window memory
+} mpi_alloc_t;
+
+static inline const char *mpi_alloc_mode_name(mpi_alloc_mode_t mode)
+{
+    return (mode == MPI_ALLOC_RMA) ? "rma (MPI_Fetch_and_op on a rank 0 window)" : "master (request/assign messages)";
+}
+
+// --alloc=master|rma on the command line, otherwise DETI_MPI_ALLOC, otherwise master
+static inline int mpi_alloc_parse(const char *text, mpi_alloc_mode_t *mode)
+{
+    if (strcmp(text, "master") == 0) {
+        *mode = MPI_ALLOC_MASTER;
+        return 0;
+    }
+    if (strcmp(text, "rma") == 0) {
+        *mode = MPI_ALLOC_RMA;
+        return 0;
+    }
+    return -1;
+}
+
+// collective over MPI_COMM_WORLD (every rank calls it, also in master mode); the cursor starts at
+// first (rank 0's value counts: a resumed checkpoint)
+static inline void mpi_alloc_init(mpi_alloc_t *a, mpi_alloc_mode_t mode, int rank, u64_t first)
+{
+    memset(a, 0, sizeof(*a));
+    a->mode = mode;
+    a->win = MPI_WIN_NULL;
+    if (mode != MPI_ALLOC_RMA)
+        return;
+    MPI_Win_allocate((rank == MPI_MASTER_RANK) ? (MPI_Aint)sizeof(u64_t) : 0, (int)sizeof(u64_t), MPI_INFO_NULL,
+                     MPI_COMM_WORLD, &a->cursor, &a->win);
+    if (rank == MPI_MASTER_RANK) {
+        MPI_Win_lock(MPI_LOCK_EXCLUSIVE, MPI_MASTER_RANK, 0, a->win);
+        *a->cursor = first;
+        MPI_Win_unlock(MPI_MASTER_RANK, a->win);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);    // the cursor is initialized before the first claim
+    MPI_Win_lock_all(0, a->win);
+}
+
+// collective
+static inline void mpi_alloc_free(mpi_alloc_t *a)
+{
+    if (a->mode != MPI_ALLOC_RMA)
+        return;
+    MPI_Win_unlock_all(a->win);
+    MPI_Win_free(&a->win);
+}
+
+// rma mode (any rank, rank 0 included): claims [*start, *start + size)
+static inline void mpi_alloc_claim(mpi_alloc_t *a, u64_t size, u64_t *start)
+{
+    MPI_Fetch_and_op(&size, start, MPI_UINT64_T, MPI_MASTER_RANK, 0, MPI_SUM, a->win);
+    MPI_Win_flush(MPI_MASTER_RANK, a->win);
+}
+
+// rank 0, rma mode: the counters handed out so far
+static inline u64_t mpi_alloc_cursor(mpi_alloc_t *a)
+{
+    u64_t value = 0, dummy = 0;
+
+    MPI_Fetch_and_op(&dummy, &value, MPI_UINT64_T, MPI_MASTER_RANK, 0, MPI_NO_OP, a->win);
+    MPI_Win_flush(MPI_MASTER_RANK, a->win);
+    return value;
+}
+
+// range size for a worker that hashes rate counters per second (0 = not measured yet)
+static inline u64_t mpi_alloc_chunk_size(double rate, double seconds)
+{
+    double size = (rate > 0.0) ? rate * seconds : (double)WORK_CHUNK_SIZE;
+
+    if (size < (double)WORK_CHUNK_MIN)
+        size = (double)WORK_CHUNK_MIN;
+    if (size > (double)WORK_CHUNK_MAX)
+        size = (double)WORK_CHUNK_MAX;
+    return (u64_t)size & ~(WORK_CHUNK_ALIGN - 1ULL);
+}
+
+//
+// allocation benchmark (mpi_miner --bench-alloc [claims]): every worker claims the given number
+// of ranges back to back, first with request/assign messages, then with MPI_Fetch_and_op; rank 0
+// prints the aggregate claim rate and the mean claim latency of both protocols
+//
+
+#define MPI_ALLOC_BENCH_CLAIMS 2000
+
+static inline void mpi_alloc_bench_report(const char *name, int num_workers, int claims, double seconds)
+{
+    double total = (double)num_workers * (double)claims;
+    printf("%-8s workers %4d | %10.0f claims/s | %8.2f us per claim\n",
+           name, num_workers, total / seconds, 1e6 * seconds / (double)claims);
+}
+
+static inline void mpi_alloc_bench(int rank, int num_workers, int claims)
+{
+    work_range_t work;
+    double t0, t1;
+    u64_t next = 0;
+
+    // request/assign: rank 0 answers with the same event loop primitives as run_master
+    MPI_Barrier(MPI_COMM_WORLD);
+    t0 = mpi_now();
+    if (rank == MPI_MASTER_RANK) {
+        MPI_Request request;
+        MPI_Status status;
+        int indices[1], worker;
+        long served = 0, expected = (long)num_workers * (long)claims;
+
+        MPI_Recv_init(&worker, 1, MPI_INT, MPI_ANY_SOURCE, TAG_REQUEST_WORK, MPI_COMM_WORLD, &request);
+        MPI_Start(&request);
+        while (served < expected) {
+            if (mpi_wait_some(1, &request, indices, &status, 1.0) == 0)
+                continue;
+            work.start_counter = next;
+            work.end_counter = next + WORK_CHUNK_MIN;
+            next += WORK_CHUNK_MIN;
+            MPI_Send(&work, sizeof(work_range_t), MPI_BYTE, status.MPI_SOURCE, TAG_WORK_ASSIGN, MPI_COMM_WORLD);
+            if (++served < expected)
+                MPI_Start(&request);
+        }
+        MPI_Request_free(&request);
+    } else {
+        for (int i = 0; i < claims; i++) {
+            MPI_Send(&rank, 1, MPI_INT, MPI_MASTER_RANK, TAG_REQUEST_WORK, MPI_COMM_WORLD);
+            MPI_Recv(&work, sizeof(work_range_t), MPI_BYTE, MPI_MASTER_RANK, TAG_WORK_ASSIGN, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+        }
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    t1 = mpi_now();
+    if (rank == MPI_MASTER_RANK)
+        mpi_alloc_bench_report("master", num_workers, claims, t1 - t0);
+
+    // one-sided: rank 0 only waits in the barrier
+    mpi_alloc_t alloc;
+    mpi_alloc_init(&alloc, MPI_ALLOC_RMA, rank, 0);
+    MPI_Barrier(MPI_COMM_WORLD);
+    t0 = mpi_now();
+    if (rank != MPI_MASTER_RANK) {
+        u64_t start;
+        for (int i = 0; i < claims; i++)
+            mpi_alloc_claim(&alloc, WORK_CHUNK_MIN, &start);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    t1 = mpi_now();
+    if (rank == MPI_MASTER_RANK) {
+        mpi_alloc_bench_report("rma", num_workers, claims, t1 - t0);
+        u64_t cursor = mpi_alloc_cursor(&alloc);
+        if (cursor != (u64_t)num_workers * (u64_t)claims * WORK_CHUNK_MIN)
+            printf("rma: cursor mismatch (%lu)\n", cursor);
+    }
+    mpi_alloc_free(&alloc);
+}
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef AAD_MPI_CHECKPOINT_H
+#define AAD_MPI_CHECKPOINT_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "aad_mpi_common.h"
+
+//
+// outstanding ranges and checkpoint/restart of the master
+//
+// the master records every range it hands out (to a worker or to its own threads) in a table,
+// together with its owner; a range leaves the table when its owner reports it fully hashed, and
+// when a worker stops, the unfinished pieces of its ranges (which its done messages list) stay in
+// the table as free entries (owner -1); free entries are handed out again before any fresh
+// counters, and so are the ranges of a worker that stops reporting for too long (see
+// master_check_lost)
+//
+// every MPI_CHECKPOINT_PERIOD seconds and at the end of the run the master writes next_counter and
+// the whole table to the checkpoint file (a temporary file, fsync, rename: a crash leaves either
+// the old or the new checkpoint); the next run resumes from it: counters below next_counter that
+// are not in the table are done, and every range in it is free again; the salt and the custom text
+// of the coin template (aad_mpi_kernel.h) are saved too, so the resumed counters map to the same
+// coins (a file without a salt is resumed with a new one)
+//
+// file format (text):
+//   DETI-MPI-CHECKPOINT 1
+//   next_counter <n>
+//   salt <s>
+//   custom <text>              (custom coins only)
+//   range <start> <end>
+//   ...
+//
+
+#define MPI_CHECKPOINT_FILE     "deti_mpi_checkpoint.txt"
+#define MPI_CHECKPOINT_PERIOD   30.0
+#define MPI_RANGE_FREE          (-1)
+
+typedef struct {
+    work_range_t range;
+    int owner;                  // rank hashing it (MPI_RANGE_FREE = waiting to be handed out again)
+    int has_left;               // its owner has reported unfinished pieces inside it
+} mpi_range_entry_t;
+
+typedef struct {
+    mpi_range_entry_t *entries;
+    int count;
+    int capacity;
+} mpi_range_table_t;
+
+typedef struct {
+    const char *path;           // NULL = no checkpoints
+    u64_t next_counter;         // resumed value (0 on a fresh start)
+    mpi_range_table_t ranges;   // resumed table, then the master's live one
+    int resumed;
+    int has_salt;
+    u32_t salt;                 // of the coin template (saved when has_salt is set)
+    char custom_text[28];       // of the coin template ("" = plain DETI coins)
+    u64_t writes;
+} mpi_checkpoint_t;
+
+static inline int mpi_ranges_add(mpi_range_table_t *t, const work_range_t *range, int owner)
+{
+    if (range->end_counter <= range->start_counter)
+        return 0;
+    if (t->count == t->capacity) {
+        int capacity = (t->capacity > 0) ? 2 * t->capacity : 64;
+        mpi_range_entry_t *entries = (mpi_range_entry_t *)realloc(t->entries, (size_t)capacity * sizeof(*entries));
+        if (entries == NULL)
+            return -1;
+        t->entries = entries;
+        t->capacity = capacity;
+    }
+    t->entries[t->count].range = *range;
+    t->entries[t->count].owner = owner;
+    t->entries[t->count].has_left = 0;
+    t->count++;
+    return 0;
+}
+
+static inline void mpi_ranges_remove(mpi_range_table_t *t, int i)
+{
+    t->entries[i] = t->entries[--t->count];
+}
+
+static inline void mpi_ranges_free(mpi_range_table_t *t)
+{
+    free(t->entries);
+    memset(t, 0, sizeof(*t));
+}
+
+// the entry of owner that starts at start (-1 if none)
+static inline int mpi_ranges_find(const mpi_range_table_t *t, int owner, u64_t start)
+{
+    for (int i = 0; i < t->count; i++)
+        if (t->entries[i].owner == owner && t->entries[i].range.start_counter == start)
+            return i;
+    return -1;
+}
+
+// the entry of owner that contains [start,end) (-1 if none)
+static inline int mpi_ranges_containing(const mpi_range_table_t *t, int owner, u64_t start, u64_t end)
+{
+    for (int i = 0; i < t->count; i++)
+        if (t->entries[i].owner == owner && t->entries[i].range.start_counter <= start &&
+            end <= t->entries[i].range.end_counter)
+            return i;
+    return -1;
+}
+
+// takes up to size counters from the front of the lowest free entry; returns 0 if there is none
+static inline int mpi_ranges_take_free(mpi_range_table_t *t, u64_t size, work_range_t *work)
+{
+    int best = -1;
+
+    for (int i = 0; i < t->count; i++)
+        if (t->entries[i].owner == MPI_RANGE_FREE &&
+            (best < 0 || t->entries[i].range.start_counter < t->entries[best].range.start_counter))
+            best = i;
+    if (best < 0)
+        return 0;
+    work_range_t *free_range = &t->entries[best].range;
+    work->start_counter = free_range->start_counter;
+    if (free_range->end_counter - free_range->start_counter <= size) {
+        work->end_counter = free_range->end_counter;
+        mpi_ranges_remove(t, best);
+    } else {
+        work->end_counter = free_range->start_counter + size;
+        free_range->start_counter = work->end_counter;
+    }
+    return 1;
+}
+
+// gives every range of owner back (whole), e.g. those of a lost worker; returns the counters freed
+static inline u64_t mpi_ranges_release(mpi_range_table_t *t, int owner)
+{
+    u64_t freed = 0;
+
+    for (int i = 0; i < t->count; i++) {
+        if (t->entries[i].owner != owner)
+            continue;
+        t->entries[i].owner = MPI_RANGE_FREE;
+        t->entries[i].has_left = 0;
+        freed += t->entries[i].range.end_counter - t->entries[i].range.start_counter;
+    }
+    return freed;
+}
+
+// counters held by owner
+static inline u64_t mpi_ranges_owned(const mpi_range_table_t *t, int owner)
+{
+    u64_t total = 0;
+
+    for (int i = 0; i < t->count; i++)
+        if (t->entries[i].owner == owner)
+            total += t->entries[i].range.end_counter - t->entries[i].range.start_counter;
+    return total;
+}
+
+static inline int mpi_ranges_compare(const void *a, const void *b)
+{
+    const mpi_range_entry_t *x = (const mpi_range_entry_t *)a, *y = (const mpi_range_entry_t *)b;
+
+    if (x->owner != y->owner)
+        return (x->owner < y->owner) ? -1 : 1;
+    if (x->range.start_counter != y->range.start_counter)
+        return (x->range.start_counter < y->range.start_counter) ? -1 : 1;
+    return 0;
+}
+
+// joins adjacent free entries (the pieces a worker leaves at a stop are mostly contiguous)
+static inline void mpi_ranges_merge_free(mpi_range_table_t *t)
+{
+    int n = 0;
+
+    qsort(t->entries, (size_t)t->count, sizeof(mpi_range_entry_t), mpi_ranges_compare);
+    for (int i = 0; i < t->count; i++) {
+        if (n > 0 && t->entries[i].owner == MPI_RANGE_FREE && t->entries[n - 1].owner == MPI_RANGE_FREE &&
+            t->entries[n - 1].range.end_counter == t->entries[i].range.start_counter)
+            t->entries[n - 1].range.end_counter = t->entries[i].range.end_counter;
+        else
+            t->entries[n++] = t->entries[i];
+    }
+    t->count = n;
+}
+
+//
+// the final report of owner: pieces[] are the counters of its ranges it did not hash; they become
+// free entries and replace the ranges that contain them; with last set, the ranges of owner that
+// have no piece (never received, e.g. a prefetch withdrawn at the stop) are freed whole
+//
+static inline int mpi_ranges_leftovers(mpi_range_table_t *t, int owner, const work_range_t *pieces, int n_pieces,
+                                       int last)
+{
+    for (int k = 0; k < n_pieces; k++) {
+        int i = mpi_ranges_containing(t, owner, pieces[k].start_counter, pieces[k].end_counter);
+        if (i >= 0)
+            t->entries[i].has_left = 1;
+        if (mpi_ranges_add(t, &pieces[k], MPI_RANGE_FREE) != 0)
+            return -1;
+    }
+    if (!last)
+        return 0;
+    for (int i = 0; i < t->count; ) {
+        if (t->entries[i].owner != owner) {
+            i++;
+        } else if (t->entries[i].has_left) {
+            mpi_ranges_remove(t, i);
+        } else {
+            t->entries[i].owner = MPI_RANGE_FREE;
+            i++;
+        }
+    }
+    mpi_ranges_merge_free(t);
+    return 0;
+}
+
+static inline int mpi_checkpoint_save(mpi_checkpoint_t *c, u64_t next_counter, const mpi_range_table_t *t)
+{
+    char tmp_path[4096];
+    FILE *fp;
+
+    if (c->path == NULL)
+        return 0;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", c->path);
+    if ((fp = fopen(tmp_path, "w")) == NULL) {
+        fprintf(stderr, "checkpoint: cannot create \"%s\" (%s)\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "DETI-MPI-CHECKPOINT 1\nnext_counter %lu\n", next_counter);
+    if (c->has_salt)
+        fprintf(fp, "salt %u\n", c->salt);
+    if (c->custom_text[0] != '\0')
+        fprintf(fp, "custom %s\n", c->custom_text);
+    for (int i = 0; i < t->count; i++) {
+        // counters from next_counter on are redone anyway (rma claims reported out of order)
+        if (t->entries[i].range.start_counter >= next_counter)
+            continue;
+        fprintf(fp, "range %lu %lu\n", t->entries[i].range.start_counter, t->entries[i].range.end_counter);
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || ferror(fp)) {
+        fprintf(stderr, "checkpoint: error while writing \"%s\"\n", tmp_path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    if (rename(tmp_path, c->path) != 0) {
+        fprintf(stderr, "checkpoint: cannot rename \"%s\" (%s)\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    c->writes++;
+    return 0;
+}
+
+// 0 on success (a missing file is a fresh start), -1 on a damaged file
+static inline int mpi_checkpoint_load(mpi_checkpoint_t *c, const char *path)
+{
+    char line[256];
+    int version = 0, have_counter = 0;
+    FILE *fp;
+
+    memset(c, 0, sizeof(*c));
+    c->path = path;
+    if (path == NULL || (fp = fopen(path, "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        work_range_t range;
+        if (sscanf(line, "DETI-MPI-CHECKPOINT %d", &version) == 1)
+            continue;
+        if (sscanf(line, "next_counter %lu", &c->next_counter) == 1) {
+            have_counter = 1;
+        } else if (sscanf(line, "salt %u", &c->salt) == 1) {
+            c->has_salt = 1;
+        } else if (strncmp(line, "custom ", 7) == 0) {
+            size_t length = strcspn(line + 7, "\n");
+            if (length >= sizeof(c->custom_text)) {
+                version = 0;
+                break;
+            }
+            memcpy(c->custom_text, line + 7, length);
+        } else if (sscanf(line, "range %lu %lu", &range.start_counter, &range.end_counter) == 2) {
+            if (mpi_ranges_add(&c->ranges, &range, MPI_RANGE_FREE) != 0) {
+                version = 0;
+                break;
+            }
+        } else if (line[0] != '\n') {
+            version = 0;
+            break;
+        }
+    }
+    fclose(fp);
+    if (version != 1 || !have_counter) {
+        fprintf(stderr, "checkpoint: \"%s\" is not a valid checkpoint\n", path);
+        mpi_ranges_free(&c->ranges);
+        return -1;
+    }
+    c->resumed = 1;
+    return 0;
+}
+
+#endif
@@ -3,7 +3,9 @@
 #define AAD_MPI_COMMON_H
 
 #include <mpi.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 typedef uint8_t  u08_t;
 typedef uint32_t u32_t;
@@ -12,29 +14,104 @@ typedef uint64_t u64_t;
 #define MPI_MASTER_RANK 0
 
 #define TAG_WORK_ASSIGN   1
-#define TAG_COIN_FOUND    2
 #define TAG_REQUEST_WORK  3
-#define TAG_STATS_UPDATE  4
+#define TAG_COIN_REPORT   4
 #define TAG_STOP          5
 #define TAG_WORKER_DONE   6
 
-#define WORK_CHUNK_SIZE   100000000ULL
+#define WORK_CHUNK_SIZE   100000000ULL    // first range of a worker (its rate is not known yet)
+#define WORK_CHUNK_MIN    (1ULL << 22)
+#define WORK_CHUNK_MAX    (1ULL << 38)
+#define WORK_CHUNK_ALIGN  (1ULL << 16)
+#define WORK_TARGET_SECONDS 2.0         // an assigned range should take this long
 #define COIN_DATA_SIZE    14
+#define MPI_COIN_BATCH    64            // coins carried by one worker report
+#define MPI_RANGE_BATCH   32            // finished ranges / unfinished pieces carried by one report
+
+// mpi_wait_some(): busy polling right after a message, then sleeps that double up to this limit
+#define MPI_WAIT_SPIN_SECONDS   0.0002
+#define MPI_WAIT_MIN_SLEEP_NS   1000L
+#define MPI_WAIT_MAX_SLEEP_NS   200000L
 
 typedef struct {
     u64_t start_counter;
     u64_t end_counter;
 } work_range_t;
 
-typedef struct {
-    u32_t coin_data[COIN_DATA_SIZE];
-    int worker_rank;
-} coin_message_t;
-
+//
+// worker report: statistics plus the coins found since the previous report
+//
+// coins are not sent one by one; a worker queues them and they travel with its next work request,
+// its done message or, when a batch is full or a coin has waited MPI_STATS_PERIOD, a coin report
+// (only the first n_coins entries are sent, see stats_message_size); a worker that finishes with
+// more than MPI_COIN_BATCH coins queued sends several done messages, all but the last one with
+// more set; the periodic statistics themselves are aggregated by aad_mpi_stats.h
+//
+// a report also lists the ranges the worker has fully hashed since the previous one (by their
+// first counter), in rma mode the ranges it has claimed from the window since the previous one
+// and, in done messages, the unfinished pieces of its ranges, for the master's outstanding-ranges
+// table (aad_mpi_checkpoint.h)
+//
 typedef struct {
     u64_t hashes_done;
     int coins_found;
     int worker_rank;
+    int n_coins;
+    int more;                   // more coins or pieces follow in the next report
+    int n_done;
+    int n_left;
+    int n_claimed;
+    u64_t done[MPI_RANGE_BATCH];        // first counter of each range fully hashed
+    work_range_t left[MPI_RANGE_BATCH]; // done messages: counters the worker will not hash
+    work_range_t claimed[MPI_RANGE_BATCH]; // rma mode: ranges claimed from the window
+    u32_t coins[MPI_COIN_BATCH][COIN_DATA_SIZE];
 } stats_message_t;
 
+static inline int stats_message_size(const stats_message_t *msg)
+{
+    return (int)(offsetof(stats_message_t, coins) + (size_t)msg->n_coins * sizeof(msg->coins[0]));
+}
+
+static inline double mpi_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+//
+// MPI_Waitsome with a timeout: returns the number of completed requests (0 on timeout)
+//
+// a blocking MPI_Waitsome has no timeout and, in Open MPI, spins on a core while it waits; this
+// version tests the requests, polls without sleeping for MPI_WAIT_SPIN_SECONDS after the last
+// completion (a burst of requests is served in microseconds) and then sleeps between tests with
+// an exponential back-off, so an idle rank uses almost no CPU
+//
+static inline int mpi_wait_some(int n, MPI_Request *requests, int *indices, MPI_Status *statuses, double timeout)
+{
+    static double last_completion = 0.0;
+    long sleep_ns = MPI_WAIT_MIN_SLEEP_NS;
+    double deadline = mpi_now() + timeout;
+    int count;
+
+    for (;;) {
+        MPI_Testsome(n, requests, &count, indices, statuses);
+        if (count == MPI_UNDEFINED)
+            return 0;   // no active requests
+        double now = mpi_now();
+        if (count > 0) {
+            last_completion = now;
+            return count;
+        }
+        if (now >= deadline)
+            return 0;
+        if (now - last_completion < MPI_WAIT_SPIN_SECONDS)
+            continue;
+        struct timespec nap = {0, sleep_ns};
+        nanosleep(&nap, NULL);
+        if (sleep_ns < MPI_WAIT_MAX_SLEEP_NS)
+            sleep_ns *= 2;
+    }
+}
+
 #endif
@@ -0,0 +1,360 @@
+#ifndef AAD_MPI_ENGINE_H
+#define AAD_MPI_ENGINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "aad_mpi_common.h"
+#include "../aad_data_types.h"
+#include "../aad_nonce_scheduler.h"
+#include "aad_mpi_kernel.h"
+
+//
+// hashing engine of the MPI miner (used by the workers and by the master's own threads)
+//
+// the hashing threads never call MPI; they talk to the communication thread of their process
+// (OpenMP thread 0, the one that called MPI_Init_thread) without locks:
+//   - coins: one single-producer/single-consumer ring per hashing thread
+//   - ranges: a one-slot mailbox (ready/exhausted flags, release/acquire) that the scheduler's
+//     refill callback empties on whichever hashing thread runs the pool dry
+//   - hashes: an atomic counter updated every 2^20 hashes
+//   - finished ranges: every range posted to the engine has an entry with an atomic count of the
+//     counters not hashed yet; a chunk never straddles two ranges (the pool holds one range at a
+//     time and slots and steals only split it), so a thread subtracts each chunk it completes
+//     from the entry that contains it, and the communication thread reports the entries that
+//     reach zero
+//
+// after a stop, the counters not hashed are exactly the chunk each thread was in, the slots, the
+// pool and the mailbox (mpi_engine_leftovers)
+//
+// the threads hash with the kernel of this rank (aad_mpi_kernel.h), MPI_KERNEL_BLOCK counters per
+// call; a lane the kernel flags is rebuilt from the coin template and checked again with the
+// scalar sha1 before its coin enters the ring
+//
+
+#define MPI_ENGINE_COIN_RING        256         // coins per hashing thread ring (a power of two)
+#define MPI_ENGINE_REFILL_SLEEP_NS  20000L      // a hashing thread waiting for a range polls this often
+
+// entries of the finished-ranges table: a range with counters left lives in the pool, a slot or a
+// thread (at most 2 * n_threads + 1 at a time) or in the mailbox; a fully hashed one stays until
+// the next report of the communication thread takes it (up to MPI_RANGE_BATCH per report, and a
+// report leaves for every range posted: the work request in master mode, the claim report in rma
+// mode), so twice the live bound plus one batch leaves room for a communication thread running late
+#define MPI_ENGINE_RANGES(n_threads)    (2 * (2 * (n_threads) + 2) + MPI_RANGE_BATCH)
+
+typedef struct {
+    u32_t coins[MPI_ENGINE_COIN_RING][COIN_DATA_SIZE];
+    u64_t head;                 // written by the hashing thread
+    u64_t tail;                 // written by the communication thread
+    u64_t dropped;              // coins lost to a full ring (hashing thread)
+} __attribute__((aligned(64))) mpi_coin_ring_t;
+
+typedef struct {
+    u64_t start, end;           // written before used is set
+    u64_t remaining;            // counters not hashed yet (atomic)
+    int used;                   // (atomic) set and cleared by the communication thread
+} mpi_engine_range_t;
+
+typedef struct {
+    nonce_scheduler_t scheduler;
+    mpi_coin_template_t tmpl;   // coin layout (the same on every rank)
+    sha1_counter_kernel_t kernel;
+    mpi_coin_ring_t *rings;
+    int n_threads;
+    mpi_engine_range_t *ranges; // ranges not fully hashed or not reported yet (MPI_ENGINE_RANGES entries)
+    int n_ranges;
+    work_range_t *unfinished;   // per hashing thread: the part of its chunk left at a stop
+    volatile int stop;          // set by the communication thread
+    u64_t hashes;               // atomic
+    int finished;               // hashing threads that returned (atomic)
+    work_range_t next;          // mailbox
+    int ready;                  // next holds a range not handed out yet
+    int exhausted;              // no more ranges will come
+    int starved;                // a hashing thread waits for the mailbox
+} mpi_engine_t;
+
+static inline void mpi_ring_push(mpi_coin_ring_t *r, const u32_t coin[14])
+{
+    u64_t head = r->head;
+
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= MPI_ENGINE_COIN_RING) {
+        r->dropped++;
+        return;
+    }
+    memcpy(r->coins[head % MPI_ENGINE_COIN_RING], coin, COIN_DATA_SIZE * sizeof(u32_t));
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static inline int mpi_ring_pop(mpi_coin_ring_t *r, u32_t coin[14])
+{
+    u64_t tail = r->tail;
+
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+        return 0;
+    memcpy(coin, r->coins[tail % MPI_ENGINE_COIN_RING], COIN_DATA_SIZE * sizeof(u32_t));
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// communication thread: takes one coin from any ring
+static inline int mpi_engine_pop_coin(mpi_engine_t *e, u32_t coin[14])
+{
+    for (int i = 0; i < e->n_threads; i++) {
+        if (mpi_ring_pop(&e->rings[i], coin))
+            return 1;
+    }
+    return 0;
+}
+
+// coins left in the rings
+static inline int mpi_engine_pending(mpi_engine_t *e)
+{
+    for (int i = 0; i < e->n_threads; i++) {
+        if (__atomic_load_n(&e->rings[i].head, __ATOMIC_ACQUIRE) != e->rings[i].tail)
+            return 1;
+    }
+    return 0;
+}
+
+static inline u64_t mpi_engine_dropped(const mpi_engine_t *e)
+{
+    u64_t dropped = 0;
+
+    for (int i = 0; i < e->n_threads; i++)
+        dropped += e->rings[i].dropped;
+    return dropped;
+}
+
+static inline u64_t mpi_engine_hashes(mpi_engine_t *e)
+{
+    return __atomic_load_n(&e->hashes, __ATOMIC_RELAXED);
+}
+
+// all n_hashing threads have left mpi_engine_run
+static inline int mpi_engine_finished(mpi_engine_t *e, int n_hashing)
+{
+    return __atomic_load_n(&e->finished, __ATOMIC_ACQUIRE) >= n_hashing;
+}
+
+// mailbox, communication thread side
+static inline int mpi_engine_wants_range(mpi_engine_t *e)
+{
+    return !__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE) && !e->exhausted;
+}
+
+static inline int mpi_engine_starved(mpi_engine_t *e)
+{
+    return __atomic_load_n(&e->starved, __ATOMIC_RELAXED);
+}
+
+// communication thread: a range enters the engine; -1 when the table is full (see MPI_ENGINE_RANGES:
+// the range would never be reported finished, so the callers treat it as a fatal error)
+static inline int mpi_engine_track(mpi_engine_t *e, const work_range_t *range)
+{
+    for (int i = 0; i < e->n_ranges; i++) {
+        mpi_engine_range_t *r = &e->ranges[i];
+        if (__atomic_load_n(&r->used, __ATOMIC_RELAXED))
+            continue;
+        r->start = range->start_counter;
+        r->end = range->end_counter;
+        __atomic_store_n(&r->remaining, range->end_counter - range->start_counter, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->used, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+    return -1;
+}
+
+// hashing thread: [start,end) has been hashed
+static inline void mpi_engine_chunk_done(mpi_engine_t *e, u64_t start, u64_t end)
+{
+    for (int i = 0; i < e->n_ranges; i++) {
+        mpi_engine_range_t *r = &e->ranges[i];
+        if (__atomic_load_n(&r->used, __ATOMIC_ACQUIRE) && r->start <= start && start < r->end) {
+            __atomic_sub_fetch(&r->remaining, end - start, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+// communication thread: takes a fully hashed range out of the table (its first counter)
+static inline int mpi_engine_pop_done(mpi_engine_t *e, u64_t *start)
+{
+    for (int i = 0; i < e->n_ranges; i++) {
+        mpi_engine_range_t *r = &e->ranges[i];
+        if (__atomic_load_n(&r->used, __ATOMIC_RELAXED) && __atomic_load_n(&r->remaining, __ATOMIC_ACQUIRE) == 0) {
+            *start = r->start;
+            __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int mpi_engine_has_done(mpi_engine_t *e)
+{
+    for (int i = 0; i < e->n_ranges; i++)
+        if (__atomic_load_n(&e->ranges[i].used, __ATOMIC_RELAXED) &&
+            __atomic_load_n(&e->ranges[i].remaining, __ATOMIC_ACQUIRE) == 0)
+            return 1;
+    return 0;
+}
+
+// the most pieces mpi_engine_leftovers() returns
+static inline int mpi_engine_leftover_max(const mpi_engine_t *e)
+{
+    return 2 * e->n_threads + 2;
+}
+
+// after the hashing threads have returned: the counters posted to the engine and not hashed
+static inline int mpi_engine_leftovers(mpi_engine_t *e, work_range_t *pieces)
+{
+    nonce_scheduler_t *s = &e->scheduler;
+    int n = 0;
+
+    for (int i = 0; i < e->n_threads; i++) {
+        if (e->unfinished[i].end_counter > e->unfinished[i].start_counter)
+            pieces[n++] = e->unfinished[i];
+        if (s->slots[i].end > s->slots[i].start) {
+            pieces[n].start_counter = s->slots[i].start;
+            pieces[n++].end_counter = s->slots[i].end;
+        }
+    }
+    if (s->pool_end > s->pool_start) {
+        pieces[n].start_counter = s->pool_start;
+        pieces[n++].end_counter = s->pool_end;
+    }
+    if (__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE))
+        pieces[n++] = e->next;
+    return n;
+}
+
+// 0 on success, -1 when the finished-ranges table is full (the range is not posted)
+static inline int mpi_engine_post(mpi_engine_t *e, const work_range_t *range)
+{
+    if (mpi_engine_track(e, range) != 0)
+        return -1;
+    e->next = *range;
+    __atomic_store_n(&e->starved, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline void mpi_engine_exhaust(mpi_engine_t *e)
+{
+    __atomic_store_n(&e->exhausted, 1, __ATOMIC_RELEASE);
+}
+
+// scheduler refill callback (any hashing thread, pool lock held): takes the range from the
+// mailbox, waiting for the communication thread only when it is late
+static int mpi_engine_refill(void *arg, u64_t *start, u64_t *end)
+{
+    mpi_engine_t *e = (mpi_engine_t *)arg;
+
+    while (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&e->exhausted, __ATOMIC_ACQUIRE) || e->stop)
+            return 0;
+        __atomic_store_n(&e->starved, 1, __ATOMIC_RELAXED);
+        struct timespec nap = {0, MPI_ENGINE_REFILL_SLEEP_NS};
+        nanosleep(&nap, NULL);
+    }
+    *start = e->next.start_counter;
+    *end = e->next.end_counter;
+    __atomic_store_n(&e->ready, 0, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// 0 on success; the first range goes straight into the scheduler's pool
+static inline int mpi_engine_init(mpi_engine_t *e, int n_threads, const work_range_t *first,
+                                  const mpi_coin_template_t *tmpl, const mpi_kernel_t *kernel)
+{
+    memset(e, 0, sizeof(*e));
+    e->tmpl = *tmpl;
+    e->kernel = kernel->hash;
+    e->n_threads = n_threads;
+    e->n_ranges = MPI_ENGINE_RANGES(n_threads);
+    e->rings = (mpi_coin_ring_t *)aligned_alloc(64, (size_t)n_threads * sizeof(mpi_coin_ring_t));
+    e->ranges = (mpi_engine_range_t *)calloc((size_t)e->n_ranges, sizeof(mpi_engine_range_t));
+    e->unfinished = (work_range_t *)calloc((size_t)n_threads, sizeof(work_range_t));
+    if (e->rings == NULL || e->ranges == NULL || e->unfinished == NULL ||
+        nonce_scheduler_init(&e->scheduler, n_threads, mpi_engine_refill, e, NONCE_REFILL_ANY, &e->stop) != 0) {
+        free(e->rings);
+        free(e->ranges);
+        free(e->unfinished);
+        return -1;
+    }
+    memset(e->rings, 0, (size_t)n_threads * sizeof(mpi_coin_ring_t));
+    (void)mpi_engine_track(e, first);   // the table is empty
+    nonce_scheduler_seed(&e->scheduler, first->start_counter, first->end_counter);
+    return 0;
+}
+
+static inline void mpi_engine_free(mpi_engine_t *e)
+{
+    nonce_scheduler_free(&e->scheduler);
+    free(e->rings);
+    free(e->ranges);
+    free(e->unfinished);
+    e->rings = NULL;
+    e->ranges = NULL;
+    e->unfinished = NULL;
+}
+
+// hashing thread: the lanes of the block at counter that the kernel flagged
+static inline void mpi_engine_queue_coins(mpi_engine_t *e, mpi_coin_ring_t *ring, u64_t counter, u32_t mask)
+{
+    u32_t coin[COIN_DATA_SIZE] __attribute__((aligned(16)));
+    u32_t hash[5];
+
+    for (int lane = 0; lane < MPI_KERNEL_BLOCK; lane++) {
+        if ((mask & (1u << lane)) == 0)
+            continue;
+        mpi_coin_build(&e->tmpl, counter + (u64_t)lane, coin);
+        sha1(coin, hash);
+        if (hash[0] == MPI_COIN_SIGNATURE && mpi_coin_valid(coin))
+            mpi_ring_push(ring, coin);
+    }
+}
+
+// body of hashing thread hash_id (0 <= hash_id < n_threads); returns when the ranges are
+// exhausted or stop is set
+static inline void mpi_engine_run(mpi_engine_t *e, int hash_id)
+{
+    mpi_coin_ring_t *ring = &e->rings[hash_id];
+    sha1_counter_kernel_t kernel = e->kernel;
+    u32_t tmpl[COIN_DATA_SIZE] __attribute__((aligned(64)));
+    u64_t counter = 0, counter_end = 0, chunk_start = 0;
+    u64_t local_hashes = 0;
+
+    memcpy(tmpl, e->tmpl.words, sizeof(tmpl));
+
+    while (!e->stop) {
+        if (counter >= counter_end) {
+            if (counter_end > chunk_start)
+                mpi_engine_chunk_done(e, chunk_start, counter_end);
+            chunk_start = counter_end;
+            if (!nonce_scheduler_next(&e->scheduler, hash_id, &counter, &counter_end))
+                break;
+            chunk_start = counter;
+        }
+
+        u32_t mask = kernel(tmpl, counter, MPI_COIN_SIGNATURE);
+        if (__builtin_expect(mask != 0, 0))
+            mpi_engine_queue_coins(e, ring, counter, mask);
+
+        counter += MPI_KERNEL_BLOCK;
+        local_hashes += MPI_KERNEL_BLOCK;
+        if (__builtin_expect((local_hashes & 0xFFFFF) == 0, 0))
+            __atomic_add_fetch(&e->hashes, 0x100000, __ATOMIC_RELAXED);
+    }
+    if (counter < counter_end) {
+        e->unfinished[hash_id].start_counter = counter;
+        e->unfinished[hash_id].end_counter = counter_end;
+    } else if (counter_end > chunk_start) {
+        mpi_engine_chunk_done(e, chunk_start, counter_end);
+    }
+    __atomic_add_fetch(&e->hashes, local_hashes & 0xFFFFF, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&e->finished, 1, __ATOMIC_RELEASE);
+}
+
+#endif
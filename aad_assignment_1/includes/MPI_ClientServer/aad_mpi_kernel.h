@@ -0,0 +1,172 @@
+#ifndef AAD_MPI_KERNEL_H
+#define AAD_MPI_KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "aad_mpi_common.h"
+#include "../aad_data_types.h"
+#include "../aad_coin_types.h"
+#include "../aad_sha1_batch.h"
+
+//
+// coin template and hashing kernels of the MPI miner
+//
+// the template (14 words: "DETI coin 2 ", the counter in words 3 and 4, the optional custom text
+// from word 5 on, a salt word, zeros, and the final '\n' and padding in word 13) is built by the
+// master and sent to every rank with MPI_Bcast at startup, so all ranks hash the same coin layout
+// whatever their command line; the salt replaces the per-call time(NULL) of the old kernel, is
+// saved in the checkpoint and comes back on a resume, so the resumed counters continue the same
+// coin space
+//
+// the binary is compiled for the x86-64 baseline and each rank picks its kernel at run time (the
+// widest its processor supports, or --kernel=NAME / DETI_MPI_KERNEL); the kernels are the counter
+// kernels of aad_sha1_batch.h, each compiled with its own target attribute:
+//   avx512 --- 16 lanes (avx512f)
+//   avx2   ---  8 lanes, two rounds per block
+//   avx    ---  4 lanes (VEX encoded), four rounds per block
+//   sse2   ---  4 lanes (any x86-64 processor)
+//   cpu    ---  scalar sha1
+// a kernel hashes one block of MPI_KERNEL_BLOCK consecutive counters and returns the mask of the
+// lanes whose first hash word is the DETI signature; the nonce scheduler keeps every boundary a
+// multiple of NONCE_ALIGN (16), so the low counter word never carries inside a block
+//
+
+#define MPI_KERNEL_BLOCK    SHA1_COUNTER_BLOCK
+#define MPI_COIN_SIGNATURE  0xAAD20250u
+
+typedef struct {
+    u32_t words[COIN_DATA_SIZE];    // counter words (3 and 4) are set by the kernels
+    u32_t salt;
+    int salt_word;
+    char custom_text[28];           // "" = plain DETI coin
+} mpi_coin_template_t;
+
+typedef struct {
+    const char *name;
+    sha1_counter_kernel_t hash;
+} mpi_kernel_t;
+
+// the salt becomes part of every coin, so none of its bytes may be a '\n'
+static inline u32_t mpi_coin_salt(u32_t salt)
+{
+    for (int shift = 0; shift < 32; shift += 8)
+        if (((salt >> shift) & 0xFFu) == (u32_t)'\n')
+            salt ^= 1u << shift;
+    return salt;
+}
+
+// 0 on success, -1 on a custom text that does not fit (see validate_custom_text)
+static inline int mpi_coin_template_init(mpi_coin_template_t *t, const char *custom_text, u32_t salt)
+{
+    memset(t, 0, sizeof(*t));
+    t->words[0] = 0x44455449u;  // "DETI"
+    t->words[1] = 0x20636F69u;  // " coi"
+    t->words[2] = 0x6E203220u;  // "n 2 "
+    t->salt_word = 5;
+    if (custom_text != NULL && custom_text[0] != '\0') {
+        if (!validate_custom_text(custom_text))
+            return -1;
+        snprintf(t->custom_text, sizeof(t->custom_text), "%s", custom_text);
+        t->salt_word = encode_custom_text(t->words, custom_text, 5);
+    }
+    t->salt = mpi_coin_salt(salt);
+    t->words[t->salt_word] = t->salt;
+    t->words[13] = 0x00000A80u; // '\n' and the padding byte
+    return 0;
+}
+
+// rank 0 builds the template, the others receive it (collective)
+static inline void mpi_coin_template_bcast(mpi_coin_template_t *t)
+{
+    MPI_Bcast(t, (int)sizeof(*t), MPI_BYTE, MPI_MASTER_RANK, MPI_COMM_WORLD);
+}
+
+// the coin of one counter (scalar rebuild of a candidate)
+static inline void mpi_coin_build(const mpi_coin_template_t *t, u64_t counter, u32_t coin[COIN_DATA_SIZE])
+{
+    memcpy(coin, t->words, sizeof(t->words));
+    coin[3] = (u32_t)counter;
+    coin[4] = (u32_t)(counter >> 32);
+}
+
+static inline int mpi_coin_valid(const u32_t coin[COIN_DATA_SIZE])
+{
+    const u08_t *bytes = (const u08_t *)coin;
+
+    for (int i = 12; i < 54; i++)
+        if (bytes[i ^ 3] == '\n')
+            return 0;
+    return 1;
+}
+
+// from the widest to the narrowest
+static const mpi_kernel_t mpi_kernels[] = {
+#if defined(__x86_64__)
+    { "avx512", sha1_counter16_avx512f },
+    { "avx2",   sha1_counter16_avx2 },
+    { "avx",    sha1_counter16_avx },
+    { "sse2",   sha1_counter16_sse2 },
+#endif
+    { "cpu",    sha1_counter16_scalar },
+};
+
+#define MPI_KERNEL_COUNT ((int)(sizeof(mpi_kernels) / sizeof(mpi_kernels[0])))
+
+static inline int mpi_kernel_supported(const mpi_kernel_t *k)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (strcmp(k->name, "avx512") == 0)
+        return __builtin_cpu_supports("avx512f");
+    if (strcmp(k->name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(k->name, "avx") == 0)
+        return __builtin_cpu_supports("avx");
+#endif
+    (void)k;
+    return 1;
+}
+
+// index of the kernel this rank uses: the named one when the processor supports it (a warning and
+// the best one otherwise), the widest supported one for NULL, "" or "auto"
+static inline int mpi_kernel_select(const char *name, int rank)
+{
+    if (name != NULL && name[0] != '\0' && strcmp(name, "auto") != 0) {
+        for (int i = 0; i < MPI_KERNEL_COUNT; i++) {
+            if (strcmp(mpi_kernels[i].name, name) != 0)
+                continue;
+            if (mpi_kernel_supported(&mpi_kernels[i]))
+                return i;
+            break;
+        }
+        fprintf(stderr, "Rank %d: kernel \"%s\" not available here, using the best one\n", rank, name);
+    }
+    for (int i = 0; i < MPI_KERNEL_COUNT; i++)
+        if (mpi_kernel_supported(&mpi_kernels[i]))
+            return i;
+    return MPI_KERNEL_COUNT - 1;
+}
+
+// collective: rank 0 prints how many ranks run each kernel
+static inline void mpi_kernel_report(int kernel, int rank, int size)
+{
+    int *all = (rank == MPI_MASTER_RANK) ? (int *)calloc((size_t)size, sizeof(int)) : NULL;
+
+    MPI_Gather(&kernel, 1, MPI_INT, all, 1, MPI_INT, MPI_MASTER_RANK, MPI_COMM_WORLD);
+    if (all == NULL)
+        return;
+    printf("Kernels:");
+    for (int k = 0; k < MPI_KERNEL_COUNT; k++) {
+        int n = 0;
+        for (int r = 0; r < size; r++)
+            n += (all[r] == k);
+        if (n > 0)
+            printf(" %s x%d", mpi_kernels[k].name, n);
+    }
+    printf(" (rank 0: %s)\n", mpi_kernels[all[MPI_MASTER_RANK]].name);
+    free(all);
+}
+
+#endif
@@ -6,16 +6,121 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <omp.h>
 #include "aad_mpi_common.h"
+#include "aad_mpi_alloc.h"
+#include "aad_mpi_checkpoint.h"
+#include "aad_mpi_engine.h"
+#include "aad_mpi_stats.h"
+#include "../aad_cgroup.h"
 #include "../aad_data_types.h"
 #include "../aad_sha1_cpu.h"
 #include "../aad_vault.h"
 
-#define MAX_WORKERS 256
+//
+// the master is event driven: one persistent receive per message tag is posted once
+// (MPI_Recv_init + MPI_Startall), mpi_wait_some() returns as soon as any of them completes, and the
+// handler of that tag re-arms it with MPI_Start; the wait times out once per second for the
+// progress line, the time limit and Ctrl+C
+//
+
+#define MASTER_PRINT_INTERVAL   5.0
+#define MASTER_WAIT_TIMEOUT     1.0
+#define MASTER_RATE_SMOOTHING   0.5     // weight of the newest rate sample
+
+//
+// the master mines too: its event loop runs on OpenMP thread 0 (the only thread that calls MPI)
+// and the other threads run the hashing engine of the workers; their ranges come straight from
+// the master's allocator (next_counter, or its own window in rma mode) through the engine's
+// mailbox, which the loop keeps full; their coins and hashes count as those of rank 0
+//
+
+//
+// vault group commit: the coins of the worker reports go to save_coin()'s buffer and the buffer is
+// written (one fopen/fwrite/fclose) once MASTER_VAULT_FLUSH_COINS coins are waiting or the oldest
+// has waited MASTER_VAULT_FLUSH_SECONDS, and when the master stops
+//
+#define MASTER_VAULT_FLUSH_COINS    256
+#define MASTER_VAULT_FLUSH_SECONDS  1.0
+
+//
+// range sizes follow the rate of each worker (from the hashes reported with its work requests,
+// one entry per rank, allocated for the size of the job): a range takes about
+// WORK_TARGET_SECONDS, so a laptop and a 128-thread node make the same number of requests per
+// second; near the time limit a range only covers the time left, so all workers finish together
+//
+
+//
+// lost workers: a worker sends a work request (master mode) or a claim report (rma mode) every
+// WORK_TARGET_SECONDS or so; one that has sent nothing for MASTER_LOST_SECONDS and for
+// MASTER_LOST_FACTOR times the time its outstanding ranges should take is declared lost: its
+// ranges are handed out again, it no longer counts as active, and whatever it sends later is ignored (its coins excepted); a lost rank also
+// blocks the collective statistics rounds and MPI_Finalize, so the master ends the job with
+// MPI_Abort once the run is over and the checkpoint is written
+//
+// in rma mode a worker's claims and finished ranges travel with a report sent right after each
+// claim, and its unfinished pieces come back at a stop, so its ranges are in the table and it is
+// judged like a worker of master mode; a lost worker may still claim from the window, and the
+// claims it reports afterwards enter the table as free entries, to be hashed again by others
+//
+// rma checkpoints: a claim reaches the table only with the claimer's report, so the checkpoint
+// does not resume from the window's cursor but from rma_reported, below which every claim has been
+// reported (claims reported out of order wait in rma_ahead); the counters from there on are redone
+// after a crash, and the free entries of the table (a resumed checkpoint, the pieces of a stopped
+// rank) are pushed to the workers when they claim (master_push_free)
+//
+#define MASTER_LOST_SECONDS     60.0
+#define MASTER_LOST_FACTOR      4.0
+
+typedef struct {
+    u64_t hashes;                   // latest total reported
+    double report_time;             // when it was received
+    double rate;                    // smoothed hashes per second (0 = unknown)
+    double last_seen;               // last message of any kind
+    int done;                       // its last done message has arrived
+    int lost;
+} mpi_worker_info_t;
+
+enum {
+    MASTER_RECV_WORK = 0,
+    MASTER_RECV_COINS,
+    MASTER_RECV_DONE,
+    MASTER_RECV_COUNT
+};
+
+typedef struct {
+    MPI_Request requests[MASTER_RECV_COUNT];
+    stats_message_t work_request;   // receive buffers of the persistent requests
+    stats_message_t coins;
+    stats_message_t done;           // final statistics of a finished worker
+    mpi_alloc_t *alloc;
+    mpi_stats_t *stats;             // collective statistics rounds
+    mpi_engine_t engine;            // the master's own hashing threads
+    int local_threads;              // 0 = the master does not mine
+    int local_coins;                // coins found by them
+
+    int num_workers;
+    int active_workers;
+    u64_t next_counter;
+    u64_t total_hashes;
+    int total_coins;
+    u64_t ranges_assigned;
+    u64_t ranges_reassigned;        // handed out from the free entries of the table
+    mpi_checkpoint_t *checkpoint;
+    mpi_range_table_t *ranges;      // outstanding ranges (checkpoint->ranges)
+    u64_t rma_reported;             // rma mode: the counters below it were claimed and reported
+    mpi_range_table_t rma_ahead;    // rma mode: claims reported before an earlier one
+    double next_checkpoint;
+    int lost_workers;
+    int vault_pending;              // coins in save_coin()'s buffer
+    double vault_oldest;            // when the first of them arrived
+    u64_t vault_commits;
+    int time_limit;
+    double start_time;
+    mpi_worker_info_t *workers;     // indexed by rank (0 = the master's own threads)
+} mpi_master_t;
 
 static volatile int master_stop_signal = 0;
-// per-worker hash counts
-static u64_t worker_hashes[MAX_WORKERS] = {0}; 
 
 static void master_signal_handler(int sig)
 {
@@ -33,13 +138,81 @@ static inline void setup_master_signal_handler(void)
     sigaction(SIGTERM, &sa, NULL);
 }
 
-static inline void distribute_initial_work(int num_workers, u64_t *next_counter)
+static inline void master_post_receives(mpi_master_t *m)
 {
-    for (int w = 1; w <= num_workers; w++) {
+    MPI_Recv_init(&m->work_request, sizeof(stats_message_t), MPI_BYTE, MPI_ANY_SOURCE, TAG_REQUEST_WORK,
+                  MPI_COMM_WORLD, &m->requests[MASTER_RECV_WORK]);
+    MPI_Recv_init(&m->coins, sizeof(stats_message_t), MPI_BYTE, MPI_ANY_SOURCE, TAG_COIN_REPORT, MPI_COMM_WORLD,
+                  &m->requests[MASTER_RECV_COINS]);
+    MPI_Recv_init(&m->done, sizeof(stats_message_t), MPI_BYTE, MPI_ANY_SOURCE, TAG_WORKER_DONE, MPI_COMM_WORLD,
+                  &m->requests[MASTER_RECV_DONE]);
+    MPI_Startall(MASTER_RECV_COUNT, m->requests);
+}
+
+static inline void master_free_receives(mpi_master_t *m)
+{
+    for (int i = 0; i < MASTER_RECV_COUNT; i++) {
+        MPI_Cancel(&m->requests[i]);
+        MPI_Wait(&m->requests[i], MPI_STATUS_IGNORE);
+        MPI_Request_free(&m->requests[i]);
+    }
+}
+
+// size of the next range of a worker (a multiple of WORK_CHUNK_ALIGN)
+static inline u64_t master_chunk_size(const mpi_master_t *m, int worker_rank)
+{
+    double rate = (worker_rank >= 0 && worker_rank <= m->num_workers) ? m->workers[worker_rank].rate : 0.0;
+    double seconds = WORK_TARGET_SECONDS;
+    double size;
+
+    if (m->time_limit > 0) {
+        double left = (double)m->time_limit - (mpi_now() - m->start_time);
+        if (left < seconds)
+            seconds = (left > 0.1) ? left : 0.1;
+    }
+    if (rate <= 0.0) {
+        size = (double)WORK_CHUNK_SIZE;
+        if (m->time_limit > 0 && seconds < WORK_TARGET_SECONDS)
+            size *= seconds / WORK_TARGET_SECONDS;
+    } else {
+        size = rate * seconds;
+    }
+    if (size < (double)WORK_CHUNK_MIN)
+        size = (double)WORK_CHUNK_MIN;
+    if (size > (double)WORK_CHUNK_MAX)
+        size = (double)WORK_CHUNK_MAX;
+    return (u64_t)size & ~(WORK_CHUNK_ALIGN - 1ULL);
+}
+
+static inline void master_track(mpi_master_t *m, const work_range_t *work, int owner)
+{
+    if (mpi_ranges_add(m->ranges, work, owner) != 0) {
+        fprintf(stderr, "Master: out of memory\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+// free entries of the table (lost workers, pieces left at a stop, a resumed checkpoint) go first
+static inline void master_assign(mpi_master_t *m, int worker_rank, work_range_t *work)
+{
+    u64_t size = master_chunk_size(m, worker_rank);
+
+    if (mpi_ranges_take_free(m->ranges, size, work)) {
+        m->ranges_reassigned++;
+    } else {
+        work->start_counter = m->next_counter;
+        work->end_counter = m->next_counter + size;
+        m->next_counter += size;
+    }
+    master_track(m, work, worker_rank);
+    m->ranges_assigned++;
+}
+
+static inline void distribute_initial_work(mpi_master_t *m)
+{
+    for (int w = 1; w <= m->num_workers; w++) {
         work_range_t work;
-        work.start_counter = *next_counter;
-        work.end_counter = *next_counter + WORK_CHUNK_SIZE;
-        *next_counter += WORK_CHUNK_SIZE;
+        master_assign(m, w, &work);
         MPI_Send(&work, sizeof(work_range_t), MPI_BYTE, w, TAG_WORK_ASSIGN, MPI_COMM_WORLD);
     }
 }
@@ -52,148 +225,454 @@ static inline void broadcast_stop_signal(int num_workers)
     }
 }
 
-static inline int handle_coin_found(int *total_coins)
+static inline void master_vault_commit(mpi_master_t *m, int force)
+{
+    if (m->vault_pending == 0)
+        return;
+    if (!force && m->vault_pending < MASTER_VAULT_FLUSH_COINS &&
+        mpi_now() - m->vault_oldest < MASTER_VAULT_FLUSH_SECONDS)
+        return;
+    save_coin(NULL);
+    m->vault_pending = 0;
+    m->vault_commits++;
+}
+
+static inline void master_save_coin(mpi_master_t *m, u32_t coin[14], int worker_rank)
 {
-    MPI_Status status;
-    int flag = 0;
+    m->total_coins++;
+    if (worker_rank == MPI_MASTER_RANK)
+        printf("\n[*] COIN #%d (Master)\n", m->total_coins);
+    else
+        printf("\n[*] COIN #%d (Worker %d)\n", m->total_coins, worker_rank);
+    save_coin(coin);
+    if (m->vault_pending++ == 0)
+        m->vault_oldest = mpi_now();
+}
+
+static inline void handle_coins_found(mpi_master_t *m, stats_message_t *report)
+{
+    int n = (report->n_coins < MPI_COIN_BATCH) ? report->n_coins : MPI_COIN_BATCH;
 
-    MPI_Iprobe(MPI_ANY_SOURCE, TAG_COIN_FOUND, MPI_COMM_WORLD, &flag, &status);
-    if (flag) {
-        coin_message_t msg;
-        MPI_Recv(&msg, sizeof(coin_message_t), MPI_BYTE, status.MPI_SOURCE, TAG_COIN_FOUND, MPI_COMM_WORLD, &status);
+    for (int i = 0; i < n; i++)
+        master_save_coin(m, report->coins[i], report->worker_rank);
+}
+
+// rma mode: a claim from the window is known to the master (it is in the table or done)
+static inline void master_rma_claimed(mpi_master_t *m, const work_range_t *claim)
+{
+    if (claim->start_counter != m->rma_reported) {
+        if (mpi_ranges_add(&m->rma_ahead, claim, MPI_RANGE_FREE) != 0) {
+            fprintf(stderr, "Master: out of memory\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        return;
+    }
+    m->rma_reported = claim->end_counter;
+    for (int i = 0; i < m->rma_ahead.count; ) {
+        if (m->rma_ahead.entries[i].range.start_counter == m->rma_reported) {
+            m->rma_reported = m->rma_ahead.entries[i].range.end_counter;
+            mpi_ranges_remove(&m->rma_ahead, i);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+}
 
-        (*total_coins)++;
-        printf("\n[*] COIN #%d (Worker %d)\n", *total_coins, msg.worker_rank);
+// rma mode: the ranges source has claimed from the window enter the table (free when source is lost)
+static inline void handle_ranges_claimed(mpi_master_t *m, const stats_message_t *report, int source)
+{
+    int n = (report->n_claimed < MPI_RANGE_BATCH) ? report->n_claimed : MPI_RANGE_BATCH;
+    int owner = m->workers[source].lost ? MPI_RANGE_FREE : source;
 
-        save_coin(msg.coin_data);
-        // Flush immediately so coins aren't lost
-        save_coin(NULL);   
-        return 1;
+    for (int k = 0; k < n; k++) {
+        master_track(m, &report->claimed[k], owner);
+        master_rma_claimed(m, &report->claimed[k]);
     }
-    return 0;
 }
 
-static inline int handle_work_request(u64_t *next_counter, int *active_workers)
+// rma mode: a worker that has just claimed also gets the lowest free entry of the table, if any
+// (no one would take it otherwise when the master does not mine); it hashes it before its next claim
+static inline void master_push_free(mpi_master_t *m, int worker_rank)
+{
+    work_range_t work;
+
+    if (master_stop_signal || !mpi_ranges_take_free(m->ranges, master_chunk_size(m, worker_rank), &work))
+        return;
+    master_track(m, &work, worker_rank);
+    m->ranges_reassigned++;
+    MPI_Send(&work, sizeof(work_range_t), MPI_BYTE, worker_rank, TAG_WORK_ASSIGN, MPI_COMM_WORLD);
+}
+
+// ranges fully hashed by source leave the table
+static inline void handle_ranges_done(mpi_master_t *m, const stats_message_t *report, int source)
 {
-    MPI_Status status;
-    int flag = 0;
+    int n = (report->n_done < MPI_RANGE_BATCH) ? report->n_done : MPI_RANGE_BATCH;
 
-    MPI_Iprobe(MPI_ANY_SOURCE, TAG_REQUEST_WORK, MPI_COMM_WORLD, &flag, &status);
-    if (flag) {
-        int worker_rank;
-        MPI_Recv(&worker_rank, 1, MPI_INT, status.MPI_SOURCE, TAG_REQUEST_WORK, MPI_COMM_WORLD, &status);
+    for (int k = 0; k < n; k++) {
+        int i = mpi_ranges_find(m->ranges, source, report->done[k]);
+        if (i >= 0)
+            mpi_ranges_remove(m->ranges, i);
+    }
+}
 
-        work_range_t work;
-        if (master_stop_signal) {
-            work.start_counter = 0;
-            work.end_counter = 0;
-            (*active_workers)--;
+// unfinished pieces of a stopping rank; with last set its ranges without pieces are freed whole
+static inline void handle_ranges_left(mpi_master_t *m, const work_range_t *pieces, int n_pieces, int source,
+                                      int last)
+{
+    if (mpi_ranges_leftovers(m->ranges, source, pieces, n_pieces, last) != 0) {
+        fprintf(stderr, "Master: out of memory\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+static inline void master_checkpoint(mpi_master_t *m, int force)
+{
+    if (m->checkpoint->path == NULL || (!force && mpi_now() < m->next_checkpoint))
+        return;
+    m->next_checkpoint = mpi_now() + MPI_CHECKPOINT_PERIOD;
+    mpi_checkpoint_save(m->checkpoint, (m->alloc->mode == MPI_ALLOC_RMA) ? m->rma_reported : m->next_counter,
+                        m->ranges);
+}
+
+// hands the ranges of silent workers out again (a worker whose rate is not known yet is judged by
+// the slowest rate measured so far, and not at all before there is one)
+static inline void master_check_lost(mpi_master_t *m)
+{
+    double now = mpi_now();
+    double slowest = 0.0;
+
+    for (int r = 0; r <= m->num_workers; r++)
+        if (m->workers[r].rate > 0.0 && (slowest == 0.0 || m->workers[r].rate < slowest))
+            slowest = m->workers[r].rate;
+    for (int r = 1; r <= m->num_workers; r++) {
+        mpi_worker_info_t *w = &m->workers[r];
+        double silent = now - ((w->last_seen > 0.0) ? w->last_seen : m->start_time);
+        if (w->done || w->lost || silent < MASTER_LOST_SECONDS)
+            continue;
+        double rate = (w->rate > 0.0) ? w->rate : slowest;
+        if (rate <= 0.0 || silent < MASTER_LOST_FACTOR * (double)mpi_ranges_owned(m->ranges, r) / rate)
+            continue;
+        printf("\n[Worker %d lost: silent for %.0f s, %lu counters handed out again]\n", r, silent,
+               mpi_ranges_release(m->ranges, r));
+        w->lost = 1;
+        m->lost_workers++;
+        m->active_workers--;
+    }
+}
+
+// a range for the master's own hashing threads, from the master's allocator
+static inline void master_local_range(mpi_master_t *m, work_range_t *work)
+{
+    if (m->alloc->mode == MPI_ALLOC_RMA) {
+        u64_t size = master_chunk_size(m, MPI_MASTER_RANK);
+        if (mpi_ranges_take_free(m->ranges, size, work)) {
+            m->ranges_reassigned++;
         } else {
-            work.start_counter = *next_counter;
-            work.end_counter = *next_counter + WORK_CHUNK_SIZE;
-            *next_counter += WORK_CHUNK_SIZE;
+            mpi_alloc_claim(m->alloc, size, &work->start_counter);
+            work->end_counter = work->start_counter + size;
+            master_rma_claimed(m, work);
         }
+        master_track(m, work, MPI_MASTER_RANK);
+    } else {
+        master_assign(m, MPI_MASTER_RANK, work);
+    }
+}
 
-        MPI_Send(&work, sizeof(work_range_t), MPI_BYTE, worker_rank, TAG_WORK_ASSIGN, MPI_COMM_WORLD);
-        return 1;
+// keeps the mailbox of the master's own hashing threads full; on a stop they finish at once
+static inline void master_feed_local(mpi_master_t *m)
+{
+    work_range_t work;
+
+    if (m->local_threads == 0)
+        return;
+    if (master_stop_signal) {
+        m->engine.stop = 1;
+        mpi_engine_exhaust(&m->engine);
+        return;
+    }
+    if (!mpi_engine_wants_range(&m->engine))
+        return;
+    master_local_range(m, &work);
+    if (mpi_engine_post(&m->engine, &work) != 0) {
+        fprintf(stderr, "Master: finished-ranges table full\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    return 0;
 }
 
-static inline int handle_stats_update(int num_workers, u64_t *total_hashes)
+static inline void handle_work_request(mpi_master_t *m, int source)
 {
-    MPI_Status status;
-    int flag = 0;
+    work_range_t work;
 
-    MPI_Iprobe(MPI_ANY_SOURCE, TAG_STATS_UPDATE, MPI_COMM_WORLD, &flag, &status);
-    if (flag) {
-        stats_message_t stats;
-        MPI_Recv(&stats, sizeof(stats_message_t), MPI_BYTE, status.MPI_SOURCE, TAG_STATS_UPDATE, MPI_COMM_WORLD, &status);
-        worker_hashes[stats.worker_rank] = stats.hashes_done;
-        *total_hashes = 0;
-        for (int w = 1; w <= num_workers; w++) {
-            *total_hashes += worker_hashes[w];
-        }
-        return 1;
+    // after a stop the worker gets an empty range and finishes; it is counted out by TAG_WORKER_DONE
+    // (a lost worker gets one too: its ranges belong to others now)
+    if (master_stop_signal || m->workers[source].lost) {
+        work.start_counter = 0;
+        work.end_counter = 0;
+    } else {
+        master_assign(m, source, &work);
     }
-    return 0;
+    MPI_Send(&work, sizeof(work_range_t), MPI_BYTE, source, TAG_WORK_ASSIGN, MPI_COMM_WORLD);
 }
 
-static inline int handle_worker_done(int *active_workers)
+static inline void handle_stats_update(mpi_master_t *m, const stats_message_t *stats)
 {
-    MPI_Status status;
-    int flag = 0;
+    if (stats->worker_rank < 0 || stats->worker_rank > m->num_workers)
+        return;
+    mpi_worker_info_t *w = &m->workers[stats->worker_rank];
+    double now = mpi_now();
+    double since = now - ((w->report_time > 0.0) ? w->report_time : m->start_time);
 
-    MPI_Iprobe(MPI_ANY_SOURCE, TAG_WORKER_DONE, MPI_COMM_WORLD, &flag, &status);
-    if (flag) {
-        int worker_rank;
-        MPI_Recv(&worker_rank, 1, MPI_INT, status.MPI_SOURCE, TAG_WORKER_DONE, MPI_COMM_WORLD, &status);
-        (*active_workers)--;
-        return 1;
+    if (since > 0.0 && stats->hashes_done >= w->hashes) {
+        double rate = (double)(stats->hashes_done - w->hashes) / since;
+        w->rate = (w->rate > 0.0) ? MASTER_RATE_SMOOTHING * rate + (1.0 - MASTER_RATE_SMOOTHING) * w->rate : rate;
     }
-    return 0;
+    w->hashes = stats->hashes_done;
+    w->report_time = now;
 }
 
-static inline void run_master(int num_workers, int time_limit)
+// coins and hashes of the master's own threads, as if rank 0 had sent a report (the hashes at
+// most once per MASTER_WAIT_TIMEOUT, so that its rate is measured over comparable periods)
+static inline void master_local_report(mpi_master_t *m, int force)
 {
-    setup_master_signal_handler();
+    stats_message_t stats;
+    u32_t coin[COIN_DATA_SIZE];
+    u64_t start;
 
-    u64_t next_counter = 0;
-    u64_t total_hashes = 0;
-    int total_coins = 0;
-    int active_workers = num_workers;
-    int shutdown_sent = 0;
-    time_t start_time = time(NULL);
-    time_t last_print = start_time;
-    for (int w = 0; w < MAX_WORKERS; w++) {
-        worker_hashes[w] = 0;
+    if (m->local_threads == 0)
+        return;
+    while (mpi_engine_pop_coin(&m->engine, coin)) {
+        master_save_coin(m, coin, MPI_MASTER_RANK);
+        m->local_coins++;
+    }
+    while (mpi_engine_pop_done(&m->engine, &start)) {
+        int i = mpi_ranges_find(m->ranges, MPI_MASTER_RANK, start);
+        if (i >= 0)
+            mpi_ranges_remove(m->ranges, i);
     }
+    if (!force && mpi_now() - m->workers[MPI_MASTER_RANK].report_time < MASTER_WAIT_TIMEOUT)
+        return;
+    memset(&stats, 0, offsetof(stats_message_t, coins));
+    stats.hashes_done = mpi_engine_hashes(&m->engine);
+    stats.worker_rank = MPI_MASTER_RANK;
+    handle_stats_update(m, &stats);
+}
+
+// handles the completed receives and re-arms them
+static inline void master_dispatch(mpi_master_t *m, int count, const int *indices, const MPI_Status *statuses)
+{
+    for (int i = 0; i < count; i++) {
+        int k = indices[i];
+        int source = statuses[i].MPI_SOURCE;
+        mpi_worker_info_t *w = &m->workers[source];
+
+        w->last_seen = mpi_now();
+        switch (k) {
+        case MASTER_RECV_WORK:
+            handle_coins_found(m, &m->work_request);
+            handle_stats_update(m, &m->work_request);
+            if (!w->lost)
+                handle_ranges_done(m, &m->work_request, source);
+            handle_work_request(m, source);
+            break;
+        case MASTER_RECV_COINS:
+            handle_coins_found(m, &m->coins);
+            handle_ranges_claimed(m, &m->coins, source);
+            if (!w->lost)
+                handle_ranges_done(m, &m->coins, source);
+            if (m->coins.n_claimed > 0 && !w->done && !w->lost) {
+                handle_stats_update(m, &m->coins);
+                master_push_free(m, source);
+            }
+            break;
+        case MASTER_RECV_DONE:
+            handle_coins_found(m, &m->done);
+            handle_stats_update(m, &m->done);
+            handle_ranges_claimed(m, &m->done, source);
+            if (!w->lost) {
+                handle_ranges_done(m, &m->done, source);
+                handle_ranges_left(m, m->done.left, (m->done.n_left < MPI_RANGE_BATCH) ? m->done.n_left : MPI_RANGE_BATCH,
+                                   source, !m->done.more);
+            }
+            if (!m->done.more && !w->lost) {
+                w->done = 1;
+                m->active_workers--;
+            }
+            break;
+        }
+        MPI_Start(&m->requests[k]);
+    }
+}
 
-    printf(">>> Starting MPI mining with %d workers\n", num_workers);
-    printf("============================================================\n");
+// in rma mode the workers claim their ranges from the window and no work request ever arrives
+static inline void master_event_loop(mpi_master_t *m)
+{
+    int indices[MASTER_RECV_COUNT];
+    MPI_Status statuses[MASTER_RECV_COUNT];
+    int shutdown_sent = 0;
+    double last_print = m->start_time;
 
-    distribute_initial_work(num_workers, &next_counter);
+    master_post_receives(m);
+    if (m->alloc->mode == MPI_ALLOC_MASTER)
+        distribute_initial_work(m);
 
-    while (active_workers > 0) {
-        while (handle_coin_found(&total_coins));
-        while (handle_work_request(&next_counter, &active_workers));
-        while (handle_stats_update(num_workers, &total_hashes));
-        while (handle_worker_done(&active_workers));
+    // after the last done message only the last statistics round may be left (never completed
+    // while a lost rank takes part in it)
+    while (m->active_workers > 0 || (!m->stats->finished && m->lost_workers == 0)) {
+        double timeout = (m->active_workers > 0) ? MASTER_WAIT_TIMEOUT : 0.001;
+        int count = mpi_wait_some(MASTER_RECV_COUNT, m->requests, indices, statuses, timeout);
+        master_dispatch(m, count, indices, statuses);
 
-        time_t now = time(NULL);
-        double elapsed = difftime(now, start_time);
-        if (time_limit > 0 && elapsed >= (double)time_limit && !master_stop_signal) {
-            printf("\n[Time limit reached (%d seconds)]\n", time_limit);
+        double now = mpi_now();
+        double elapsed = now - m->start_time;
+        if (m->time_limit > 0 && elapsed >= (double)m->time_limit && !master_stop_signal) {
+            printf("\n[Time limit reached (%d seconds)]\n", m->time_limit);
             master_stop_signal = 1;
         }
-        if (difftime(now, last_print) >= 5.0) {
-            double hash_rate = (elapsed > 0) ? (total_hashes / elapsed / 1e6) : 0;
-            printf("[%.0fs] %lu M @ %.2f MH/s | Coins: %d | Workers: %d\n",
-                   elapsed, total_hashes / 1000000UL, hash_rate, total_coins, active_workers);
-            last_print = now;
-        }
         if (master_stop_signal && !shutdown_sent) {
             printf("[Stopping all workers...]\n");
-            broadcast_stop_signal(num_workers);
+            broadcast_stop_signal(m->num_workers);
             shutdown_sent = 1;
         }
-        struct timespec ts = {0, 100000};  
-        nanosleep(&ts, NULL);
+        master_local_report(m, 0);
+        master_feed_local(m);
+        master_vault_commit(m, 0);
+        master_check_lost(m);
+        master_checkpoint(m, 0);
+        if (mpi_stats_poll(m->stats, (m->local_threads > 0) ? mpi_engine_hashes(&m->engine) : 0,
+                           (u64_t)m->local_coins, master_stop_signal))
+            m->total_hashes = m->stats->total_hashes;
+        if (now - last_print >= MASTER_PRINT_INTERVAL) {
+            double hash_rate = (elapsed > 0) ? (m->total_hashes / elapsed / 1e6) : 0;
+            printf("[%.0fs] %lu M @ %.2f MH/s | Coins: %d | Workers: %d\n",
+                   elapsed, m->total_hashes / 1000000UL, hash_rate, m->total_coins, m->active_workers);
+            last_print = now;
+        }
     }
-    save_coin(NULL);
+    // coins sent just before the last done message
+    int count;
+    while ((count = mpi_wait_some(MASTER_RECV_COUNT, m->requests, indices, statuses, 0.0)) > 0) {
+        master_dispatch(m, count, indices, statuses);
+    }
+    master_free_receives(m);
+    master_stop_signal = 1;
+    master_feed_local(m);
+}
+
+// local_threads: hashing threads of the master itself (0 = it only coordinates, -1 = one per CPU
+// allowed by the cpuset and the cgroup CPU quota, like a worker); checkpoint: the resumed state
+// (loaded before mpi_alloc_init, which starts the rma cursor at its next_counter); returns the
+// number of lost workers; tmpl and kernel: the coin template of the job and the kernel of this rank
+static inline int run_master(int num_workers, int time_limit, int local_threads, mpi_alloc_t *alloc,
+                             mpi_stats_t *stats, mpi_checkpoint_t *checkpoint, const mpi_coin_template_t *tmpl,
+                             const mpi_kernel_t *kernel)
+{
+    setup_master_signal_handler();
+    if (local_threads < 0) {
+        cgroup_cpu_t cgroup;
+        cgroup_cpu_init(&cgroup);
+        local_threads = cgroup_cpu_size_threads(&cgroup, omp_get_max_threads());
+    }
+
+    mpi_master_t *m = (mpi_master_t *)calloc(1, sizeof(mpi_master_t));
+    double start_time = mpi_now();
+
+    if (m == NULL) {
+        fprintf(stderr, "Master: out of memory\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    m->num_workers = num_workers;
+    m->active_workers = num_workers;
+    m->time_limit = time_limit;
+    m->start_time = start_time;
+    m->alloc = alloc;
+    m->stats = stats;
+    m->local_threads = local_threads;
+    m->checkpoint = checkpoint;
+    m->ranges = &checkpoint->ranges;
+    m->next_counter = checkpoint->next_counter;
+    m->rma_reported = checkpoint->next_counter;     // where the window's cursor starts
+    m->next_checkpoint = start_time + MPI_CHECKPOINT_PERIOD;
+    m->workers = (mpi_worker_info_t *)calloc((size_t)num_workers + 1, sizeof(mpi_worker_info_t));
+    if (m->workers == NULL) {
+        fprintf(stderr, "Master: out of memory\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (local_threads > 0) {
+        work_range_t work;
+        master_local_range(m, &work);
+        if (mpi_engine_init(&m->engine, local_threads, &work, tmpl, kernel) != 0) {
+            fprintf(stderr, "Master: cannot allocate the hashing engine; not mining locally\n");
+            m->local_threads = 0;
+        }
+    }
+
+    if (checkpoint->resumed)
+        printf(">>> Resuming from %s: next counter %lu, %d ranges to redo\n", checkpoint->path,
+               checkpoint->next_counter, m->ranges->count);
+    printf(">>> Starting MPI mining with %d workers", num_workers);
+    if (m->local_threads > 0)
+        printf(" + %d master threads", m->local_threads);
+    printf("\n============================================================\n");
+
+    #pragma omp parallel num_threads(m->local_threads + 1)
+    {
+        int thread_id = omp_get_thread_num();
+        if (thread_id == 0)
+            master_event_loop(m);
+        else
+            mpi_engine_run(&m->engine, thread_id - 1);
+    }
+    master_local_report(m, 1);
+    master_vault_commit(m, 1);
+    if (m->local_threads > 0) {
+        work_range_t *left = (work_range_t *)malloc((size_t)mpi_engine_leftover_max(&m->engine) * sizeof(work_range_t));
+        if (left == NULL) {
+            fprintf(stderr, "Master: out of memory\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        handle_ranges_left(m, left, mpi_engine_leftovers(&m->engine, left), MPI_MASTER_RANK, 1);
+        free(left);
+    }
+    if (alloc->mode == MPI_ALLOC_RMA)
+        m->next_counter = mpi_alloc_cursor(alloc);
+    master_checkpoint(m, 1);
+    // exact totals: the final hashes of every worker came with its done message
+    m->total_hashes = 0;
+    for (int r = 0; r <= num_workers; r++)
+        m->total_hashes += m->workers[r].hashes;
 
-    double elapsed = difftime(time(NULL), start_time);
-    double final_rate = (elapsed > 0) ? (total_hashes / elapsed / 1e6) : 0;
+    double elapsed = mpi_now() - start_time;
+    double final_rate = (elapsed > 0) ? (m->total_hashes / elapsed / 1e6) : 0;
 
     printf("\n╔════════════════════════════════════════════════════════════╗\n");
     printf("║              MPI CLIENT/SERVER FINAL STATISTICS            ║\n");
     printf("╠════════════════════════════════════════════════════════════╣\n");
     printf("║ Workers:         %-37d ║\n", num_workers);
-    printf("║ Total hashes:    %-37lu ║\n", total_hashes);
+    printf("║ Master threads:  %-37d ║\n", m->local_threads);
+    printf("║ Master hashes:   %-37lu ║\n", m->workers[MPI_MASTER_RANK].hashes);
+    printf("║ Total hashes:    %-37lu ║\n", m->total_hashes);
     printf("║ Time:            %.2f seconds%-26s║\n", elapsed, "");
     printf("║ Average rate:    %.2f MH/s%-29s║\n", final_rate, "");
-    printf("║ Coins found:     %-37d ║\n", total_coins);
+    printf("║ Coins found:     %-37d ║\n", m->total_coins);
+    printf("║ Vault commits:   %-37lu ║\n", m->vault_commits);
+    if (alloc->mode == MPI_ALLOC_MASTER)
+        printf("║ Ranges assigned: %-37lu ║\n", m->ranges_assigned);
+    printf("║ Counters issued: %-37lu ║\n", m->next_counter);
+    printf("║ Reassigned:      %-37lu ║\n", m->ranges_reassigned);
+    printf("║ Ranges to redo:  %-37d ║\n", m->ranges->count);
+    if (checkpoint->path != NULL)
+        printf("║ Checkpoints:     %-37lu ║\n", checkpoint->writes);
+    if (m->lost_workers > 0)
+        printf("║ Lost workers:    %-37d ║\n", m->lost_workers);
     printf("╚════════════════════════════════════════════════════════════╝\n");
+    if (m->local_threads > 0)
+        mpi_engine_free(&m->engine);
+    mpi_ranges_free(&m->rma_ahead);
+    int lost = m->lost_workers;
+    free(m->workers);
+    free(m);
+    return lost;
 }
 
 #endif
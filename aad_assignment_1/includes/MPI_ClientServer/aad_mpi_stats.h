@@ -0,0 +1,94 @@
+#ifndef AAD_MPI_STATS_H
+#define AAD_MPI_STATS_H
+
+#include <string.h>
+#include "aad_mpi_common.h"
+
+//
+// statistics aggregation with a nonblocking collective
+//
+// every MPI_STATS_PERIOD seconds each rank (master included) contributes its hashes, its coins
+// and a stop flag to an MPI_Iallreduce(MPI_SUM) on a communicator of its own (a duplicate of
+// MPI_COMM_WORLD, so the rounds never interfere with the point-to-point traffic); the reduction
+// tree keeps the fan-in of rank 0 at O(log P) messages per round however many workers there are
+//
+// each rank has at most one round in flight and posts the next one when its clock says so; the
+// rounds therefore match across ranks by their order; a rank contributes stop = 1 once it knows
+// that the run ends (the master's stop), every rank sees the same result, and the first round
+// whose result has stop > 0 is the last one on every rank (a stopping rank posts its rounds at
+// once instead of waiting for the period)
+//
+
+#define MPI_STATS_PERIOD 2.0
+
+enum {
+    MPI_STATS_HASHES = 0,
+    MPI_STATS_COINS,
+    MPI_STATS_STOP,
+    MPI_STATS_FIELDS
+};
+
+typedef struct {
+    MPI_Comm comm;
+    MPI_Request request;
+    u64_t send[MPI_STATS_FIELDS];
+    u64_t recv[MPI_STATS_FIELDS];
+    int pending;                // a round is in flight
+    int finished;               // the last round is done (no more rounds)
+    double next_time;           // when the next round is due
+    u64_t rounds;
+    u64_t total_hashes;         // result of the last completed round
+    u64_t total_coins;
+} mpi_stats_t;
+
+// collective over MPI_COMM_WORLD
+static inline void mpi_stats_init(mpi_stats_t *s)
+{
+    memset(s, 0, sizeof(*s));
+    MPI_Comm_dup(MPI_COMM_WORLD, &s->comm);
+    s->request = MPI_REQUEST_NULL;
+    s->next_time = mpi_now() + MPI_STATS_PERIOD;
+}
+
+// collective over MPI_COMM_WORLD, after the last round
+static inline void mpi_stats_free(mpi_stats_t *s)
+{
+    MPI_Comm_free(&s->comm);
+}
+
+// completes the round in flight and posts the next one when due (at once when stopping); returns
+// 1 when a round has completed
+static inline int mpi_stats_poll(mpi_stats_t *s, u64_t hashes, u64_t coins, int stopping)
+{
+    int completed = 0;
+
+    if (s->finished)
+        return 0;
+    if (s->pending) {
+        int done = 0;
+        MPI_Test(&s->request, &done, MPI_STATUS_IGNORE);
+        if (!done)
+            return 0;
+        s->pending = 0;
+        s->rounds++;
+        s->total_hashes = s->recv[MPI_STATS_HASHES];
+        s->total_coins = s->recv[MPI_STATS_COINS];
+        if (s->recv[MPI_STATS_STOP] > 0) {
+            s->finished = 1;
+            return 1;
+        }
+        completed = 1;
+    }
+    double now = mpi_now();
+    if (!stopping && now < s->next_time)
+        return completed;
+    s->next_time = now + MPI_STATS_PERIOD;
+    s->send[MPI_STATS_HASHES] = hashes;
+    s->send[MPI_STATS_COINS] = coins;
+    s->send[MPI_STATS_STOP] = (u64_t)(stopping != 0);
+    MPI_Iallreduce(s->send, s->recv, MPI_STATS_FIELDS, MPI_UINT64_T, MPI_SUM, s->comm, &s->request);
+    s->pending = 1;
+    return completed;
+}
+
+#endif
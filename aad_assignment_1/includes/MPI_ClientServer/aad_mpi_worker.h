@@ -7,95 +7,78 @@
 #include <string.h>
 #include <time.h>
 #include <omp.h>
-#include <immintrin.h>
 #include "aad_mpi_common.h"
+#include "aad_mpi_alloc.h"
+#include "aad_mpi_engine.h"
+#include "aad_mpi_stats.h"
 #include "../aad_data_types.h"
-#include "../aad_sha1_cpu.h"
+#include "../aad_cgroup.h"
 
-static volatile int worker_stop_signal = 0;
+//
+// threads of a worker process
+//
+// OpenMP thread 0 is the communication thread: it is the thread that called MPI_Init_thread, so
+// with MPI_THREAD_FUNNELED it is the only one allowed to call MPI, and it makes every MPI call of
+// the worker (ranges, coins, statistics, stop); threads 1..N run the hashing engine
+//
 
-static inline void init_coin_data_avx2_mpi(v8si coin[14])
-{
-    coin[0] = (v8si){0x44455449u, 0x44455449u, 0x44455449u, 0x44455449u,
-                     0x44455449u, 0x44455449u, 0x44455449u, 0x44455449u};
-    coin[1] = (v8si){0x20636F69u, 0x20636F69u, 0x20636F69u, 0x20636F69u,
-                     0x20636F69u, 0x20636F69u, 0x20636F69u, 0x20636F69u};
-    coin[2] = (v8si){0x6E203220u, 0x6E203220u, 0x6E203220u, 0x6E203220u,
-                     0x6E203220u, 0x6E203220u, 0x6E203220u, 0x6E203220u};
-    coin[6] = (v8si){0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
-    coin[7] = (v8si){0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
-    coin[8] = (v8si){0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
-    coin[9] = (v8si){0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
-    coin[10] = (v8si){0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
-    coin[11] = (v8si){0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
-    coin[12] = (v8si){0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
-}
+#define WORKER_COIN_QUEUE       4096        // coins drained from the rings, waiting for a report
+#define WORKER_COMM_SLEEP_NS    200000L     // communication thread idle period
 
-static inline void update_counters_avx2_mpi(v8si coin[14], u64_t counter)
-{
-    u32_t base_counters[8];
-    for (int i = 0; i < 8; i++)
-        base_counters[i] = (u32_t)((counter + i) & 0xFFFFFFFFu);
-
-    coin[3] = (v8si){base_counters[0], base_counters[1], base_counters[2], base_counters[3],
-                     base_counters[4], base_counters[5], base_counters[6], base_counters[7]};
+static volatile int worker_stop_signal = 0;
 
-    u32_t counter_high = (u32_t)((counter >> 32) & 0xFFFFFFFFu);
-    coin[4] = (v8si){counter_high, counter_high, counter_high, counter_high,
-                     counter_high, counter_high, counter_high, counter_high};
+//
+// coins drained from the rings wait here until the communication thread sends its next report
+// (a work request, or a coin report once MPI_COIN_BATCH coins are waiting or MPI_STATS_PERIOD
+// has passed)
+//
 
-    u32_t time_seed = (u32_t)time(NULL);
-    coin[5] = (v8si){time_seed, time_seed, time_seed, time_seed,
-                     time_seed, time_seed, time_seed, time_seed};
+typedef struct {
+    u32_t coins[WORKER_COIN_QUEUE][COIN_DATA_SIZE];
+    int count;                  // coins waiting
+    int found;                  // coins found so far
+} worker_coins_t;
 
-    coin[13] = (v8si){0x00000A80u, 0x00000A80u, 0x00000A80u, 0x00000A80u,
-                      0x00000A80u, 0x00000A80u, 0x00000A80u, 0x00000A80u};
-}
+//
+// rma mode: the ranges claimed from the window wait here until the next report (which leaves at
+// once) tells the master, so that its outstanding-ranges table and its checkpoints hold them
+//
 
-static inline int validate_coin_mpi(u32_t coin[14])
-{
-    u08_t *bytes = (u08_t *)coin;
-    for (int i = 12; i < 54; i++)
-        if (bytes[i ^ 3] == '\n')
-            return 0;
-    return 1;
-}
+typedef struct {
+    work_range_t ranges[MPI_RANGE_BATCH];
+    int count;
+} worker_claims_t;
 
-static inline void send_coin_to_master(u32_t coin[14], int worker_rank)
+static inline void worker_coins_drain(worker_coins_t *q, mpi_engine_t *e)
 {
-    coin_message_t msg;
-    memcpy(msg.coin_data, coin, COIN_DATA_SIZE * sizeof(u32_t));
-    msg.worker_rank = worker_rank;
-    MPI_Send(&msg, sizeof(coin_message_t), MPI_BYTE, MPI_MASTER_RANK, TAG_COIN_FOUND, MPI_COMM_WORLD);
+    while (q->count < WORKER_COIN_QUEUE && mpi_engine_pop_coin(e, q->coins[q->count])) {
+        q->count++;
+        q->found++;
+    }
 }
 
-static inline int check_and_send_coins_avx2_mpi(v8si coin[14], v8si hash[5], int worker_rank)
+// fills a report, moves up to MPI_COIN_BATCH queued coins into it and lists the ranges claimed
+// since the previous report and those the engine has finished
+static inline void worker_report_fill(stats_message_t *msg, worker_coins_t *q, worker_claims_t *claims,
+                                      mpi_engine_t *e, u64_t hashes, int worker_rank)
 {
-    __m256i target = _mm256_set1_epi32(0xAAD20250u);
-    __m256i hash0_vec = (__m256i)hash[0];
-    __m256i cmp = _mm256_cmpeq_epi32(hash0_vec, target);
-    int mask = _mm256_movemask_epi8(cmp);
-    int found = 0;
-
-    if (__builtin_expect(mask == 0, 1))
-        return 0;
-
-    u32_t *hash_data = (u32_t *)&hash[0];
-    for (int lane = 0; lane < 8; lane++) {
-        if (hash_data[lane] == 0xAAD20250u) {
-            u32_t coin_scalar[14] __attribute__((aligned(16)));
-            for (int i = 0; i < 14; i++) {
-                u32_t *coin_data = (u32_t *)&coin[i];
-                coin_scalar[i] = coin_data[lane];
-            }
+    int n = (q->count < MPI_COIN_BATCH) ? q->count : MPI_COIN_BATCH;
 
-            if (validate_coin_mpi(coin_scalar)) {
-                send_coin_to_master(coin_scalar, worker_rank);
-                found++;
-            }
-        }
-    }
-    return found;
+    memcpy(msg->claimed, claims->ranges, (size_t)claims->count * sizeof(claims->ranges[0]));
+    msg->n_claimed = claims->count;
+    claims->count = 0;
+    msg->n_done = 0;
+    msg->n_left = 0;
+    while (msg->n_done < MPI_RANGE_BATCH && mpi_engine_pop_done(e, &msg->done[msg->n_done]))
+        msg->n_done++;
+    msg->hashes_done = hashes;
+    msg->worker_rank = worker_rank;
+    memcpy(msg->coins, q->coins, (size_t)n * sizeof(q->coins[0]));
+    memmove(q->coins, q->coins[n], (size_t)(q->count - n) * sizeof(q->coins[0]));
+    q->count -= n;
+    msg->n_coins = n;
+    msg->more = (q->count > 0);
+    msg->coins_found = q->found;
 }
 
 static inline int check_stop_signal(void)
@@ -111,113 +94,257 @@ static inline int check_stop_signal(void)
     return 0;
 }
 
-static inline void request_more_work(work_range_t *range, int worker_rank)
+static inline void send_coins_to_master(worker_coins_t *q, worker_claims_t *claims, mpi_engine_t *e, u64_t hashes,
+                                        int worker_rank)
 {
-    int request = worker_rank;
-    MPI_Send(&request, 1, MPI_INT, MPI_MASTER_RANK, TAG_REQUEST_WORK, MPI_COMM_WORLD);
-    MPI_Recv(range, sizeof(work_range_t), MPI_BYTE, MPI_MASTER_RANK, TAG_WORK_ASSIGN, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    stats_message_t stats;
+    worker_report_fill(&stats, q, claims, e, hashes, worker_rank);
+    MPI_Send(&stats, stats_message_size(&stats), MPI_BYTE, MPI_MASTER_RANK, TAG_COIN_REPORT, MPI_COMM_WORLD);
 }
 
-static inline void send_stats_to_master(u64_t hashes, int coins, int worker_rank)
+// the final statistics, the last coins and the unfinished pieces of this worker's ranges travel
+// with the done message(s) (a message with another tag could be matched after them, when the
+// master no longer listens); the hashing threads have stopped, so the rings only shrink
+static inline void send_done_to_master(worker_coins_t *q, worker_claims_t *claims, mpi_engine_t *e, u64_t hashes,
+                                       int worker_rank)
 {
     stats_message_t stats;
-    stats.hashes_done = hashes;
-    stats.coins_found = coins;
-    stats.worker_rank = worker_rank;
-    MPI_Send(&stats, sizeof(stats_message_t), MPI_BYTE, MPI_MASTER_RANK, TAG_STATS_UPDATE, MPI_COMM_WORLD);
+    work_range_t *left = (work_range_t *)malloc((size_t)mpi_engine_leftover_max(e) * sizeof(work_range_t));
+    int n_left = 0, sent = 0;
+
+    if (left == NULL) {
+        fprintf(stderr, "Worker %d: out of memory\n", worker_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    n_left = mpi_engine_leftovers(e, left);
+    do {
+        worker_coins_drain(q, e);
+        worker_report_fill(&stats, q, claims, e, hashes, worker_rank);
+        while (stats.n_left < MPI_RANGE_BATCH && sent < n_left)
+            stats.left[stats.n_left++] = left[sent++];
+        stats.more = stats.more || mpi_engine_pending(e) || mpi_engine_has_done(e) || sent < n_left;
+        MPI_Send(&stats, stats_message_size(&stats), MPI_BYTE, MPI_MASTER_RANK, TAG_WORKER_DONE, MPI_COMM_WORLD);
+    } while (stats.more);
+    free(left);
+}
+
+//
+// work prefetch
+//
+// the communication thread requests the next range with MPI_Isend/MPI_Irecv once less than
+// WORKER_PREFETCH_REMAINING of the last range is left (or at once when a hashing thread is already
+// waiting), and posts it in the engine's mailbox
+//
+// in rma mode there is nothing to overlap: a claim is one MPI_Fetch_and_op on the rank 0 window,
+// so the prefetch claims the next range at once, sized from this worker's own rate; a free entry
+// of the master's table that the master has pushed (TAG_WORK_ASSIGN, see master_push_free) is
+// taken before any claim
+//
+
+#define WORKER_PREFETCH_REMAINING 0.3
+
+typedef struct {
+    int worker_rank;
+    mpi_alloc_t *alloc;
+    mpi_engine_t *engine;
+    worker_coins_t *coins;      // queued coins ride on the work requests
+    worker_claims_t *claims;    // rma mode
+    double start_time;
+    u64_t hashes_seen;          // hashes done at the last poll (rma range sizing)
+    MPI_Request requests[2];    // [0] receive of the range, [1] send of the request
+    stats_message_t request_msg;
+    work_range_t next;
+    int pending;                // a request is in flight
+    u64_t assigned;             // counters received so far
+    u64_t last_size;            // size of the last range received
+} worker_prefetch_t;
+
+static inline void worker_prefetch_init(worker_prefetch_t *p, int worker_rank, mpi_alloc_t *alloc,
+                                        mpi_engine_t *engine, worker_coins_t *coins, worker_claims_t *claims,
+                                        const work_range_t *first)
+{
+    memset(p, 0, sizeof(*p));
+    p->worker_rank = worker_rank;
+    p->alloc = alloc;
+    p->engine = engine;
+    p->coins = coins;
+    p->claims = claims;
+    p->start_time = mpi_now();
+    p->requests[0] = MPI_REQUEST_NULL;
+    p->requests[1] = MPI_REQUEST_NULL;
+    p->last_size = first->end_counter - first->start_counter;
+    p->assigned = p->last_size;
+}
+
+static inline void worker_prefetch_complete(worker_prefetch_t *p)
+{
+    p->pending = 0;
+    if (p->next.start_counter == 0 && p->next.end_counter == 0) {
+        mpi_engine_exhaust(p->engine);
+        return;
+    }
+    p->last_size = p->next.end_counter - p->next.start_counter;
+    p->assigned += p->last_size;
+    if (mpi_engine_post(p->engine, &p->next) != 0) {
+        fprintf(stderr, "Worker %d: finished-ranges table full\n", p->worker_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+static inline void worker_prefetch_start(worker_prefetch_t *p)
+{
+    if (p->alloc->mode == MPI_ALLOC_RMA) {
+        int pushed = 0;
+        MPI_Iprobe(MPI_MASTER_RANK, TAG_WORK_ASSIGN, MPI_COMM_WORLD, &pushed, MPI_STATUS_IGNORE);
+        if (pushed) {
+            MPI_Recv(&p->next, sizeof(work_range_t), MPI_BYTE, MPI_MASTER_RANK, TAG_WORK_ASSIGN, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+        } else {
+            double elapsed = mpi_now() - p->start_time;
+            double rate = (elapsed > 0.0 && p->hashes_seen > 0) ? (double)p->hashes_seen / elapsed : 0.0;
+            u64_t size = mpi_alloc_chunk_size(rate, WORK_TARGET_SECONDS);
+            mpi_alloc_claim(p->alloc, size, &p->next.start_counter);
+            p->next.end_counter = p->next.start_counter + size;
+            p->claims->ranges[p->claims->count++] = p->next;
+        }
+        worker_prefetch_complete(p);
+        return;
+    }
+    worker_report_fill(&p->request_msg, p->coins, p->claims, p->engine, p->hashes_seen, p->worker_rank);
+    MPI_Irecv(&p->next, sizeof(work_range_t), MPI_BYTE, MPI_MASTER_RANK, TAG_WORK_ASSIGN, MPI_COMM_WORLD, &p->requests[0]);
+    MPI_Isend(&p->request_msg, stats_message_size(&p->request_msg), MPI_BYTE, MPI_MASTER_RANK, TAG_REQUEST_WORK,
+              MPI_COMM_WORLD, &p->requests[1]);
+    p->pending = 1;
+}
+
+// communication thread: completes an answered request or starts one when the work left (counters
+// assigned minus hashes done) drops below the threshold or a hashing thread is starving
+static inline void worker_prefetch_poll(worker_prefetch_t *p, u64_t hashes_done)
+{
+    p->hashes_seen = hashes_done;
+    if (p->pending) {
+        int done = 0;
+        MPI_Testall(2, p->requests, &done, MPI_STATUSES_IGNORE);
+        if (done)
+            worker_prefetch_complete(p);
+        return;
+    }
+    if (!mpi_engine_wants_range(p->engine) || p->claims->count == MPI_RANGE_BATCH)
+        return;
+    u64_t left = (p->assigned > hashes_done) ? p->assigned - hashes_done : 0;
+    if (mpi_engine_starved(p->engine) || (double)left < WORKER_PREFETCH_REMAINING * (double)p->last_size)
+        worker_prefetch_start(p);
 }
 
-static inline void run_worker(int worker_rank, int num_workers)
+// withdraws a request that will not be used (the worker is stopping); a range that arrived anyway
+// is not reported among the unfinished pieces, and the master frees it whole
+static inline void worker_prefetch_cancel(worker_prefetch_t *p)
+{
+    if (p->alloc->mode == MPI_ALLOC_RMA) {
+        int pushed = 1;
+        while (pushed) {
+            MPI_Iprobe(MPI_MASTER_RANK, TAG_WORK_ASSIGN, MPI_COMM_WORLD, &pushed, MPI_STATUS_IGNORE);
+            if (pushed)
+                MPI_Recv(&p->next, sizeof(work_range_t), MPI_BYTE, MPI_MASTER_RANK, TAG_WORK_ASSIGN, MPI_COMM_WORLD,
+                         MPI_STATUS_IGNORE);
+        }
+        return;
+    }
+    if (!p->pending)
+        return;
+    MPI_Cancel(&p->requests[0]);
+    MPI_Waitall(2, p->requests, MPI_STATUSES_IGNORE);
+    p->pending = 0;
+}
+
+static inline void run_worker(int worker_rank, int num_workers, mpi_alloc_t *alloc, mpi_stats_t *stats,
+                              const mpi_coin_template_t *tmpl, const mpi_kernel_t *kernel)
 {
     (void)num_workers;
     signal(SIGINT, SIG_IGN);
 
     work_range_t work;
-    volatile u64_t total_hashes = 0;
-    volatile int total_coins = 0;
-    time_t last_stats = time(NULL);
-    time_t last_check = last_stats;
+    worker_prefetch_t prefetch;
+    mpi_engine_t engine;
+    worker_claims_t claims;
+    worker_coins_t *coins = (worker_coins_t *)calloc(1, sizeof(worker_coins_t));
 
-    MPI_Recv(&work, sizeof(work_range_t), MPI_BYTE, MPI_MASTER_RANK, TAG_WORK_ASSIGN, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    // size the pool to the container's cpuset and CPU quota, not to the host; the communication
+    // thread sleeps almost all the time and is not counted
+    cgroup_cpu_t cgroup;
+    cgroup_cpu_init(&cgroup);
+    int num_threads = cgroup_cpu_size_threads(&cgroup, omp_get_max_threads());
 
-    #pragma omp parallel
+    if (coins == NULL) {
+        fprintf(stderr, "Worker %d: out of memory\n", worker_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    claims.count = 0;
+    if (alloc->mode == MPI_ALLOC_RMA) {
+        mpi_alloc_claim(alloc, WORK_CHUNK_SIZE, &work.start_counter);
+        work.end_counter = work.start_counter + WORK_CHUNK_SIZE;
+        claims.ranges[claims.count++] = work;
+    } else {
+        MPI_Recv(&work, sizeof(work_range_t), MPI_BYTE, MPI_MASTER_RANK, TAG_WORK_ASSIGN, MPI_COMM_WORLD,
+                 MPI_STATUS_IGNORE);
+    }
+    if (mpi_engine_init(&engine, num_threads, &work, tmpl, kernel) != 0) {
+        fprintf(stderr, "Worker %d: cannot allocate the hashing engine\n", worker_rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    worker_prefetch_init(&prefetch, worker_rank, alloc, &engine, coins, &claims, &work);
+
+    #pragma omp parallel num_threads(num_threads + 1)
     {
         int thread_id = omp_get_thread_num();
-        int num_threads = omp_get_num_threads();
-        v8si coin[14] __attribute__((aligned(32)));
-        v8si hash[5] __attribute__((aligned(32)));
-
-        u64_t range_size = work.end_counter - work.start_counter;
-        u64_t chunk_size = range_size / num_threads;
-        u64_t my_start = work.start_counter + thread_id * chunk_size;
-        u64_t my_end = (thread_id == num_threads - 1) ? work.end_counter : my_start + chunk_size;
-        u64_t counter = my_start;
-        u64_t local_hashes = 0;
-
-        init_coin_data_avx2_mpi(coin);
-
-        while (!worker_stop_signal) {
-            if (counter >= my_end) {
-                #pragma omp barrier
-                #pragma omp single
-                {
-                    if (check_stop_signal()) {
-                        worker_stop_signal = 1;
-                    } else {
-                        request_more_work(&work, worker_rank);
-                        if (work.start_counter == 0 && work.end_counter == 0) {
-                            worker_stop_signal = 1;
-                        }
-                    }
-                }
-                #pragma omp barrier
-
-                if (worker_stop_signal) break;
-                range_size = work.end_counter - work.start_counter;
-                chunk_size = range_size / num_threads;
-                my_start = work.start_counter + thread_id * chunk_size;
-                my_end = (thread_id == num_threads - 1) ? work.end_counter : my_start + chunk_size;
-                counter = my_start;
-            }
+        int n_hashing = omp_get_num_threads() - 1;
 
-            update_counters_avx2_mpi(coin, counter);
-            sha1_avx2(coin, hash);
+        if (thread_id == 0) {
+            double last_coins = mpi_now();
+            int done_sent = 0;
 
-            int found = check_and_send_coins_avx2_mpi(coin, hash, worker_rank);
-            if (found > 0) {
-                #pragma omp atomic
-                total_coins += found;
-            }
+            // the done message leaves as soon as the hashing threads stop (the master must not wait
+            // for the statistics rounds, which a lost rank would block); the rounds go on until the
+            // last one
+            while (!done_sent || !stats->finished) {
+                u64_t hashes = mpi_engine_hashes(&engine);
+                double now = mpi_now();
 
-            counter += 8;
-            local_hashes += 8;
-            if (__builtin_expect((local_hashes & 0xFFFFF) == 0, 0)) {
-                #pragma omp atomic
-                total_hashes += 0x100000;
-                if (thread_id == 0) {
-                    time_t now = time(NULL);
-                    if (difftime(now, last_check) >= 1.0) {
-                        if (check_stop_signal()) {
-                            worker_stop_signal = 1;
-                        }
-                        last_check = now;
-                    }
-                    if (difftime(now, last_stats) >= 2.0) {
-                        send_stats_to_master(total_hashes, total_coins, worker_rank);
-                        last_stats = now;
+                if (!worker_stop_signal && check_stop_signal()) {
+                    worker_stop_signal = 1;
+                    engine.stop = 1;
+                }
+                mpi_stats_poll(stats, hashes, (u64_t)coins->found, worker_stop_signal || engine.exhausted);
+                if (!done_sent && mpi_engine_finished(&engine, n_hashing)) {
+                    worker_prefetch_cancel(&prefetch);
+                    send_done_to_master(coins, &claims, &engine, mpi_engine_hashes(&engine), worker_rank);
+                    done_sent = 1;
+                }
+                if (!done_sent) {
+                    worker_coins_drain(coins, &engine);
+                    worker_prefetch_poll(&prefetch, hashes);
+                    if (coins->count == 0)
+                        last_coins = now;
+                    // rma mode: claims and finished ranges leave at once (there are no work requests)
+                    if (claims.count > 0 || (alloc->mode == MPI_ALLOC_RMA && mpi_engine_has_done(&engine)))
+                        send_coins_to_master(coins, &claims, &engine, hashes, worker_rank);
+                    if (now - last_coins >= MPI_STATS_PERIOD || coins->count >= MPI_COIN_BATCH) {
+                        while (coins->count > 0)
+                            send_coins_to_master(coins, &claims, &engine, hashes, worker_rank);
+                        last_coins = now;
                     }
                 }
+                struct timespec nap = {0, WORKER_COMM_SLEEP_NS};
+                nanosleep(&nap, NULL);
             }
-        }
-        u64_t remainder = local_hashes & 0xFFFFF;
-        if (remainder > 0) {
-            #pragma omp atomic
-            total_hashes += remainder;
+        } else {
+            mpi_engine_run(&engine, thread_id - 1);
         }
     }
-    send_stats_to_master(total_hashes, total_coins, worker_rank);
-    int done = worker_rank;
-    MPI_Send(&done, 1, MPI_INT, MPI_MASTER_RANK, TAG_WORKER_DONE, MPI_COMM_WORLD);
+    if (mpi_engine_dropped(&engine) > 0)
+        fprintf(stderr, "Worker %d: %lu coins lost (coin ring full)\n", worker_rank, mpi_engine_dropped(&engine));
+    mpi_engine_free(&engine);
+    free(coins);
 }
 
 #endif
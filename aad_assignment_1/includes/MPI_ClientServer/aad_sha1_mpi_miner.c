@@ -1,9 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <mpi.h>
 
 #include "aad_mpi_common.h"
+#include "aad_mpi_alloc.h"
+#include "aad_mpi_checkpoint.h"
+#include "aad_mpi_kernel.h"
+#include "aad_mpi_stats.h"
 #include "aad_mpi_master.h"
 #include "aad_mpi_worker.h"
 
@@ -14,6 +19,7 @@ int main(int argc, char *argv[])
     int rank, size;
     int provided;
 
+    // only the main thread (OpenMP thread 0, the worker's communication thread) calls MPI
     MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     if (provided < MPI_THREAD_FUNNELED) {
         fprintf(stderr, "Warning: MPI thread support level lower than requested\n");
@@ -25,39 +31,161 @@ int main(int argc, char *argv[])
     if (size < 2) {
         if (rank == 0) {
             fprintf(stderr, "Error: Need at least 2 processes (1 master + 1 worker)\n");
-            fprintf(stderr, "Usage: mpirun -np N %s [time_seconds]\n", argv[0]);
+            fprintf(stderr, "Usage: mpirun -np N %s [--alloc=master|rma] [--master-threads=T] [--checkpoint=FILE|none] [--custom=TEXT] [--kernel=NAME] [--bench-alloc[=claims]] [time_seconds]\n", argv[0]);
             fprintf(stderr, "       N >= 2 (1 master + (N-1) workers)\n");
             fprintf(stderr, "       time_seconds: 0 = unlimited (default), >0 = run for N seconds\n");
+            fprintf(stderr, "       --alloc: nonce range allocation (default master, or DETI_MPI_ALLOC)\n");
+            fprintf(stderr, "       --master-threads: hashing threads of rank 0 (default one per CPU, 0 = none)\n");
+            fprintf(stderr, "       --checkpoint: resume from and save to FILE (default " MPI_CHECKPOINT_FILE ", or DETI_MPI_CHECKPOINT)\n");
+            fprintf(stderr, "       --custom: mine custom coins with TEXT (1-27 characters)\n");
+            fprintf(stderr, "       --kernel: auto (default, or DETI_MPI_KERNEL), avx512, avx2, avx, sse2 or cpu\n");
+            fprintf(stderr, "       --bench-alloc: only time both allocation protocols\n");
         }
         MPI_Finalize();
         return 1;
     }
     int time_limit = DEFAULT_TIME_LIMIT;
-    if (argc > 1) {
-        time_limit = atoi(argv[1]);
-        if (time_limit < 0) time_limit = 0;
+    int bench_claims = 0;
+    int master_threads = -1;
+    mpi_alloc_mode_t alloc_mode = MPI_ALLOC_MASTER;
+    const char *checkpoint_path = MPI_CHECKPOINT_FILE;
+    const char *custom_text = NULL;
+    const char *kernel_name = getenv("DETI_MPI_KERNEL");    // per node: the environment of each rank
+    const char *env = getenv("DETI_MPI_CHECKPOINT");
+    if (env != NULL && env[0] != '\0')
+        checkpoint_path = env;
+    env = getenv("DETI_MPI_ALLOC");
+    if (env != NULL && env[0] != '\0' && mpi_alloc_parse(env, &alloc_mode) != 0) {
+        if (rank == 0)
+            fprintf(stderr, "Warning: unknown DETI_MPI_ALLOC \"%s\" (master or rma)\n", env);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--alloc=", 8) == 0) {
+            if (mpi_alloc_parse(argv[i] + 8, &alloc_mode) != 0) {
+                if (rank == 0)
+                    fprintf(stderr, "Error: unknown allocation mode \"%s\" (master or rma)\n", argv[i] + 8);
+                MPI_Finalize();
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--master-threads=", 17) == 0) {
+            master_threads = atoi(argv[i] + 17);
+            if (master_threads < 0) master_threads = 0;
+        } else if (strncmp(argv[i], "--checkpoint=", 13) == 0) {
+            checkpoint_path = argv[i] + 13;
+        } else if (strncmp(argv[i], "--custom=", 9) == 0) {
+            custom_text = argv[i] + 9;
+        } else if (strncmp(argv[i], "--kernel=", 9) == 0) {
+            kernel_name = argv[i] + 9;
+        } else if (strcmp(argv[i], "--bench-alloc") == 0) {
+            bench_claims = MPI_ALLOC_BENCH_CLAIMS;
+        } else if (strncmp(argv[i], "--bench-alloc=", 14) == 0) {
+            bench_claims = atoi(argv[i] + 14);
+            if (bench_claims < 1) bench_claims = MPI_ALLOC_BENCH_CLAIMS;
+        } else {
+            time_limit = atoi(argv[i]);
+            if (time_limit < 0) time_limit = 0;
+        }
     }
 
     int num_workers = size - 1;
 
+    if (bench_claims > 0) {
+        mpi_alloc_bench(rank, num_workers, bench_claims);
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (strcmp(checkpoint_path, "none") == 0 || checkpoint_path[0] == '\0')
+        checkpoint_path = NULL;
+
+    // rank 0 resumes from the checkpoint, if any; a damaged one is left alone for the user to check
+    mpi_checkpoint_t checkpoint;
+    int checkpoint_ok = 1;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    if (rank == MPI_MASTER_RANK)
+        checkpoint_ok = (mpi_checkpoint_load(&checkpoint, checkpoint_path) == 0);
+    MPI_Bcast(&checkpoint_ok, 1, MPI_INT, MPI_MASTER_RANK, MPI_COMM_WORLD);
+    if (!checkpoint_ok) {
+        if (rank == MPI_MASTER_RANK)
+            fprintf(stderr, "Error: remove \"%s\" or run with --checkpoint=none\n", checkpoint_path);
+        MPI_Finalize();
+        return 1;
+    }
+
+    // rank 0 builds the coin template (a resumed run keeps the salt of the checkpoint and must mine
+    // the same custom text) and sends it to every rank, so the workers hash its layout whatever
+    // their own command line
+    mpi_coin_template_t tmpl;
+    int template_ok = 1;
+    memset(&tmpl, 0, sizeof(tmpl));
+    if (rank == MPI_MASTER_RANK) {
+        u32_t salt = checkpoint.has_salt ? checkpoint.salt : (u32_t)time(NULL);
+        template_ok = (mpi_coin_template_init(&tmpl, custom_text, salt) == 0);
+        if (!template_ok) {
+            fprintf(stderr, "Error: Invalid custom text '%s'\n", custom_text);
+            fprintf(stderr, "  - Must be 1-27 characters\n");
+            fprintf(stderr, "  - Cannot contain newline characters\n");
+        } else if (checkpoint.resumed && strcmp(checkpoint.custom_text, tmpl.custom_text) != 0) {
+            fprintf(stderr, "Error: \"%s\" was written for custom text '%s'; use the same --custom or "
+                    "another --checkpoint\n", checkpoint_path, checkpoint.custom_text);
+            template_ok = 0;
+        }
+        checkpoint.salt = tmpl.salt;
+        checkpoint.has_salt = 1;
+        memcpy(checkpoint.custom_text, tmpl.custom_text, sizeof(checkpoint.custom_text));
+    }
+    MPI_Bcast(&template_ok, 1, MPI_INT, MPI_MASTER_RANK, MPI_COMM_WORLD);
+    if (!template_ok) {
+        MPI_Finalize();
+        return 1;
+    }
+    mpi_coin_template_bcast(&tmpl);
+
+    // every rank picks the best kernel of its own processor; rank 0 prints the mix (collective)
+    int kernel = mpi_kernel_select(kernel_name, rank);
     if (rank == MPI_MASTER_RANK) {
         printf("===========================================\n");
         printf("  DETI Coin MPI Miner - AAD 2025/2026\n");
         printf("===========================================\n");
         printf("Processes: %d (1 master + %d workers)\n", size, num_workers);
         printf("Mining for SHA1 signature: 0xAAD20250\n");
-        printf("Using: AVX2 SIMD + OpenMP parallelization\n");
+        printf("Using: SIMD kernel per rank + OpenMP parallelization\n");
+    }
+    mpi_kernel_report(kernel, rank, size);
+    if (rank == MPI_MASTER_RANK) {
+        if (tmpl.custom_text[0] != '\0')
+            printf("Custom text: %s\n", tmpl.custom_text);
+        printf("Nonce allocation: %s\n", mpi_alloc_mode_name(alloc_mode));
+        printf("Checkpoint: %s\n", (checkpoint_path != NULL) ? checkpoint_path : "disabled");
         if (time_limit > 0) {
             printf("Time limit: %d seconds\n", time_limit);
         } else {
             printf("Time limit: unlimited (Ctrl+C to stop)\n");
         }
         printf("===========================================\n\n");
+    }
 
-        run_master(num_workers, time_limit);
+    // collective: the rma window (if any) and the statistics communicator exist on every rank
+    // before anyone mines
+    mpi_alloc_t alloc;
+    mpi_stats_t stats;
+    int lost_workers = 0;
+    mpi_alloc_init(&alloc, alloc_mode, rank, checkpoint.next_counter);
+    mpi_stats_init(&stats);
+    if (rank == MPI_MASTER_RANK) {
+        lost_workers = run_master(num_workers, time_limit, master_threads, &alloc, &stats, &checkpoint, &tmpl,
+                                  &mpi_kernels[kernel]);
+        mpi_ranges_free(&checkpoint.ranges);
     } else {
-        run_worker(rank, num_workers);
+        run_worker(rank, num_workers, &alloc, &stats, &tmpl, &mpi_kernels[kernel]);
+    }
+    // a lost worker would never join the collective calls below; the checkpoint is on disk
+    if (lost_workers > 0) {
+        fprintf(stderr, "Master: %d workers lost, aborting the job (resume from the checkpoint)\n", lost_workers);
+        MPI_Abort(MPI_COMM_WORLD, 2);
     }
+    mpi_stats_free(&stats);
+    mpi_alloc_free(&alloc);
 
     MPI_Finalize();
     return 0;
@@ -21,33 +21,6 @@ void handle_sigint(int sig)
   stop_signal = 1;
 }
 
-static char *load_kernel_source(const char *filename)
-{
-  FILE *fp = fopen(filename, "r");
-  if(fp == NULL)
-  {
-    fprintf(stderr, "Cannot open %s\n", filename);
-    return NULL;
-  }
-  
-  fseek(fp, 0, SEEK_END);
-  size_t size = (size_t)ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-  
-  char *source = (char *)malloc(size + 1);
-  if(source == NULL)
-  {
-    fclose(fp);
-    return NULL;
-  }
-  
-  size_t read = fread(source, 1, size, fp);
-  source[read] = '\0';
-  fclose(fp);
-  
-  return source;
-}
-
 int main(int argc, char **argv)
 {
   opencl_context_t ctx;
@@ -31,7 +31,7 @@ typedef struct
 } opencl_context_t;
 
 __attribute__((unused))
-static void list_opencl_devices(void)
+static void list_opencl_devices_of_type(cl_device_type type)
 {
   cl_uint num_platforms;
   cl_int err = clGetPlatformIDs(0, NULL, &num_platforms);
@@ -54,12 +54,12 @@ static void list_opencl_devices(void)
     printf("Platform %u: %s\n", p, platform_name);
     
     cl_uint num_devices;
-    err = clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_GPU, 0, NULL, &num_devices);
+    err = clGetDeviceIDs(platforms[p], type, 0, NULL, &num_devices);
     
     if(err == CL_SUCCESS && num_devices > 0)
     {
       cl_device_id *devices = (cl_device_id *)malloc(num_devices * sizeof(cl_device_id));
-      clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_GPU, num_devices, devices, NULL);
+      clGetDeviceIDs(platforms[p], type, num_devices, devices, NULL);
       
       for(cl_uint d = 0; d < num_devices; d++)
       {
@@ -78,7 +78,7 @@ static void list_opencl_devices(void)
     }
     else
     {
-      printf("  No GPU devices\n");
+      printf("  No %s devices\n", (type == CL_DEVICE_TYPE_GPU) ? "GPU" : "OpenCL");
     }
   }
   
@@ -86,7 +86,17 @@ static void list_opencl_devices(void)
 }
 
 __attribute__((unused))
-static int initialize_opencl(opencl_context_t *ctx, int platform_id, int device_id)
+static void list_opencl_devices(void)
+{
+  list_opencl_devices_of_type(CL_DEVICE_TYPE_GPU);
+}
+
+//
+// type selects the devices that device_id indexes (CL_DEVICE_TYPE_GPU, or CL_DEVICE_TYPE_ALL to
+// include CPU devices such as pocl)
+//
+__attribute__((unused))
+static int initialize_opencl_of_type(opencl_context_t *ctx, int platform_id, int device_id, cl_device_type type)
 {
   cl_int err;
   cl_uint num_platforms;
@@ -113,15 +123,15 @@ static int initialize_opencl(opencl_context_t *ctx, int platform_id, int device_
   free(platforms);
   
   cl_uint num_devices;
-  err = clGetDeviceIDs(ctx->platform, CL_DEVICE_TYPE_GPU, 0, NULL, &num_devices);
+  err = clGetDeviceIDs(ctx->platform, type, 0, NULL, &num_devices);
   if(err != CL_SUCCESS || num_devices == 0)
   {
-    fprintf(stderr, "No GPU devices found\n");
+    fprintf(stderr, "No %s devices found\n", (type == CL_DEVICE_TYPE_GPU) ? "GPU" : "OpenCL");
     return -1;
   }
   
   cl_device_id *devices = (cl_device_id *)malloc(num_devices * sizeof(cl_device_id));
-  clGetDeviceIDs(ctx->platform, CL_DEVICE_TYPE_GPU, num_devices, devices, NULL);
+  clGetDeviceIDs(ctx->platform, type, num_devices, devices, NULL);
   
   if(device_id < 0 || device_id >= (int)num_devices)
   {
@@ -160,6 +170,40 @@ static int initialize_opencl(opencl_context_t *ctx, int platform_id, int device_
   return 0;
 }
 
+__attribute__((unused))
+static int initialize_opencl(opencl_context_t *ctx, int platform_id, int device_id)
+{
+  return initialize_opencl_of_type(ctx, platform_id, device_id, CL_DEVICE_TYPE_GPU);
+}
+
+__attribute__((unused))
+static char *load_kernel_source(const char *filename)
+{
+  FILE *fp = fopen(filename, "r");
+  if(fp == NULL)
+  {
+    fprintf(stderr, "Cannot open %s\n", filename);
+    return NULL;
+  }
+  
+  fseek(fp, 0, SEEK_END);
+  size_t size = (size_t)ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  
+  char *source = (char *)malloc(size + 1);
+  if(source == NULL)
+  {
+    fclose(fp);
+    return NULL;
+  }
+  
+  size_t read = fread(source, 1, size, fp);
+  source[read] = '\0';
+  fclose(fp);
+  
+  return source;
+}
+
 __attribute__((unused))
 static int load_opencl_kernel(opencl_context_t *ctx, const char *source, const char *kernel_name, const char *build_options)
 {
@@ -132,3 +132,51 @@ __kernel void mine_deti_coins_v2(
     }
   }
 }
+
+//
+// counter-range kernel of the hybrid miner: work-item n hashes counter first + n (n < count), with
+// the same coin layout as the native AVX2 threads (counter in words 3-4, time stamp in word 5), so
+// both can take disjoint ranges from one nonce scheduler
+//
+
+__kernel void mine_deti_coins_range(
+    __global uint *coins_storage_area,
+    uint stamp,
+    ulong first,
+    uint count)
+{
+  uint n = get_global_id(0);
+  if(n >= count)
+    return;
+
+  ulong counter = first + (ulong)n;
+  uint data[16];
+  uint hash[5];
+
+  data[0] = 0x44455449u;
+  data[1] = 0x20636F69u;
+  data[2] = 0x6E203220u;
+  data[3] = (uint)(counter & 0xFFFFFFFFu);
+  data[4] = (uint)((counter >> 32) & 0xFFFFFFFFu);
+  data[5] = stamp;
+  for(int i = 6; i < 13; i++)
+    data[i] = 0x00000000u;
+  data[13] = 0x00000A80u;
+  data[14] = 0x00000000u;
+  data[15] = 0x000001B8u;
+
+  sha1_hash(data, hash);
+
+  if(hash[0] == 0xAAD20250u)
+  {
+    uint idx = atomic_add(coins_storage_area, 14u);
+
+    if(idx + 14u <= 1024u)
+    {
+      for(uint i = 0; i < 14u; i++)
+      {
+        coins_storage_area[idx + i] = data[i];
+      }
+    }
+  }
+}
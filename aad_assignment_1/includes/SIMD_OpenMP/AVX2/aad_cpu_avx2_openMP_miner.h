@@ -14,9 +14,12 @@
 #include "../aad_vault.h"
 #include "../aad_utilities.h"
 #include "../aad_coin_types.h"
+#include "../aad_thread_stats.h"
+#include "../aad_nonce_scheduler.h"
+#include "../aad_shm_nonce.h"
+#include "../aad_cpu_topology.h"
 
 static volatile int stop_signal = 0;
-static volatile int coins_found = 0;
 
 // optional custom text 
 static inline void init_coin_data_avx2(v8si coin[14], const coin_config_t *config) {
@@ -74,7 +77,8 @@ static inline void update_counters_avx2(v8si coin[14], u64_t counter, const coin
                       0x00000A80u, 0x00000A80u, 0x00000A80u, 0x00000A80u};
 }
 
-static inline void check_and_save_coins_avx2(v8si coin[14], v8si hash[5], const coin_config_t *config) {
+static inline void check_and_save_coins_avx2(v8si coin[14], v8si hash[5], const coin_config_t *config,
+                                             const thread_stats_t *stats, thread_counters_t *counters) {
     __m256i target = _mm256_set1_epi32(0xAAD20250u);
     __m256i hash0_vec = (__m256i)hash[0];
     __m256i cmp = _mm256_cmpeq_epi32(hash0_vec, target);
@@ -87,6 +91,7 @@ static inline void check_and_save_coins_avx2(v8si coin[14], v8si hash[5], const
     u32_t *hash_data = (u32_t *)&hash[0];
     for (int lane = 0; lane < 8; lane++) {
         if (hash_data[lane] == 0xAAD20250u) {
+            thread_stats_add_share(counters);
             u32_t coin_scalar[14] __attribute__((aligned(16)));
             for (int i = 0; i < 14; i++) {
                 u32_t *coin_data = (u32_t *)&coin[i];
@@ -104,13 +109,12 @@ static inline void check_and_save_coins_avx2(v8si coin[14], v8si hash[5], const
             }
 
             if (valid) {
-                #pragma omp atomic
-                coins_found++;
+                thread_stats_add_coin(counters);
 
                 #pragma omp critical
                 {
-                    printf("\n%s COIN #%d (Thread %d, Lane %d)\n",
-                           (config->type == COIN_TYPE_CUSTOM ? "[+]" : "[*]"), coins_found, omp_get_thread_num(), lane);
+                    printf("\n%s COIN #%lu (Thread %d, Lane %d)\n",
+                           (config->type == COIN_TYPE_CUSTOM ? "[+]" : "[*]"), thread_stats_total_coins(stats), omp_get_thread_num(), lane);
                     save_coin(coin_scalar);
                 }
             }
@@ -119,7 +123,11 @@ static inline void check_and_save_coins_avx2(v8si coin[14], v8si hash[5], const
 }
 
 static inline void mine_cpu_avx2_coins_openmp(const coin_config_t *config) {
-    int num_threads = omp_get_max_threads();
+    cpu_placement_t placement;
+    cpu_placement_init(&placement);
+    cgroup_cpu_t cgroup;
+    cgroup_cpu_init(&cgroup);
+    int num_threads = cgroup_cpu_size_threads(&cgroup, cpu_placement_threads(&placement, omp_get_max_threads()));
 
     // Print startup message
     if (config->type == COIN_TYPE_CUSTOM) {
@@ -128,74 +136,97 @@ static inline void mine_cpu_avx2_coins_openmp(const coin_config_t *config) {
     } else {
         printf("[*] Starting DETI coin mining (AVX2 OpenMP, %d threads)...\n", num_threads);
     }
+    cpu_placement_print(&placement, num_threads);
+    cgroup_cpu_print(&cgroup);
+    shm_nonce_t shm;
+    shm_nonce_attach(&shm, config);
+    shm_nonce_print(&shm);
+    background_t background;
+    background_init(&background);
+    background_print(&background);
     printf("============================================================\n");
 
-    time_t start = time(NULL);
-    u64_t total_attempts = 0;
+    thread_stats_t stats;
+    nonce_scheduler_t scheduler;
+    if (thread_stats_init(&stats, num_threads) != 0) {
+        fprintf(stderr, "Error: cannot allocate the per-thread mining state\n");
+        cpu_placement_free(&placement);
+        shm_nonce_detach(&shm);
+        return;
+    }
+    if (nonce_scheduler_init(&scheduler, num_threads, shm_nonce_refill, &shm, NONCE_REFILL_ANY, &stop_signal) != 0) {
+        fprintf(stderr, "Error: cannot allocate the per-thread mining state\n");
+        thread_stats_free(&stats);
+        cpu_placement_free(&placement);
+        shm_nonce_detach(&shm);
+        return;
+    }
+    thread_stats_watch_cgroup(&stats, &cgroup);
+    thread_stats_watch_background(&stats, &background);
+    thread_stats_start_reporter(&stats);
 
-    #pragma omp parallel
+    #pragma omp parallel num_threads(num_threads)
     {
         int thread_id = omp_get_thread_num();
+        cpu_placement_pin(&placement, thread_id);
+        background_enter_thread(&background);
         v8si coin[14] __attribute__((aligned(32)));
         v8si hash[5] __attribute__((aligned(32)));
         u64_t local_counter = 0;
-        u64_t thread_offset = (u64_t)thread_id * 1000000000ULL;
-        time_t last_print = start;
+        u64_t counter = 0, counter_end = 0;
+        double duty_mark = 0.0;
+        thread_counters_t *counters = &stats.threads[thread_id];
 
         init_coin_data_avx2(coin, config);
 
         while (!stop_signal) {
-            u64_t counter = thread_offset + local_counter;
+            if (counter >= counter_end) {
+                thread_stats_park(&stats, thread_id, &stop_signal);
+                background_pause(&background, &duty_mark, &stop_signal);
+                if (!nonce_scheduler_next(&scheduler, thread_id, &counter, &counter_end)) {
+                    break;
+                }
+            }
 
             update_counters_avx2(coin, counter, config);
             sha1_avx2(coin, hash);
-            check_and_save_coins_avx2(coin, hash, config);
+            check_and_save_coins_avx2(coin, hash, config, &stats, counters);
 
+            counter += 8;
             local_counter += 8;
             if (__builtin_expect((local_counter & 0xFFFFF) == 0, 0)) {
-                #pragma omp atomic
-                total_attempts += 0x100000;
-            }
-            if (thread_id == 0 && __builtin_expect((local_counter & 0xFFFFF) == 0, 0)) {
-                time_t now = time(NULL);
-                double elapsed = difftime(now, start);
-
-                if (elapsed >= 5.0 && difftime(now, last_print) >= 5.0) {
-                    u64_t snapshot;
-                    #pragma omp atomic read
-                    snapshot = total_attempts;
-
-                    double hash_rate = snapshot / elapsed / 1e6;
-
-                    printf("[%ds] %lu M @ %.2f M/s | Coins: %d | Threads: %d\n",
-                           (int)elapsed,
-                           snapshot / 1000000UL,
-                           hash_rate,
-                           coins_found,
-                           num_threads);
-                    last_print = now;
-                }
+                thread_stats_set_hashes(counters, local_counter);
             }
         }
-        u64_t remainder = local_counter & 0xFFFFF;
-        if (remainder > 0) {
-            #pragma omp atomic
-            total_attempts += remainder;
-        }
+        thread_stats_set_hashes(counters, local_counter);
     }
-    time_t end = time(NULL);
-    double elapsed = difftime(end, start);
-    double final_rate = total_attempts / elapsed / 1e6;
+    thread_stats_stop_reporter(&stats);
+    nonce_scheduler_free(&scheduler);
+    shm_nonce_detach(&shm);
+
+    thread_totals_t totals;
+    thread_stats_totals(&stats, &totals);
+    double elapsed = thread_stats_elapsed(&stats);
+    double final_rate = totals.hashes / elapsed / 1e6;
 
     printf("\n╔════════════════════════════════════════════════════════════╗\n");
     printf("║              OPENMP AVX2 FINAL STATISTICS                  ║\n");
     printf("╠════════════════════════════════════════════════════════════╣\n");
     printf("║ Threads:         %-37d ║\n", num_threads);
-    printf("║ Total attempts:  %-37lu ║\n", total_attempts);
+    printf("║ Placement:       %-37s ║\n", placement.name);
+    printf("║ Total attempts:  %-37lu ║\n", totals.hashes);
     printf("║ Time:            %.2f seconds%-26s║\n", elapsed, "");
     printf("║ Average rate:    %.2f M/s%-30s║\n", final_rate, "");
-    printf("║ Coins found:     %-37d ║\n", coins_found);
+    printf("║ Coins found:     %-37lu ║\n", totals.coins);
+    printf("║ Shares:          %-37lu ║\n", totals.shares);
+    char energy[64];
+    if (thread_stats_energy_text(&stats, totals.hashes, elapsed, energy, sizeof(energy))) {
+        printf("║ Energy:          %-37s ║\n", energy);
+    }
     printf("╚════════════════════════════════════════════════════════════╝\n");
+    cpu_placement_report(&placement, &stats, elapsed);
+    thread_stats_free(&stats);
+    cpu_placement_free(&placement);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,421 @@
+#ifndef AAD_AUTOTUNE_H
+#define AAD_AUTOTUNE_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../aad_data_types.h"
+#include "../../aad_sha1_stream.h"
+#include "../../aad_cpu_topology.h"
+
+//
+// startup autotuner for the OpenMP miners
+//
+// every kernel lives in its own binary (cpu, avx, avx2 and avx512 _openmp_miner, each compiled with
+// its own -m flags), so a candidate configuration is a binary plus the environment it runs with:
+//   DETI_AFFINITY    --- SMT policy (cores or smt, see aad_cpu_topology.h)
+//   OMP_NUM_THREADS  --- thread count
+//
+// --autotune runs each candidate for a few seconds, parses the "Average rate" (and "Energy", when
+// the RAPL counters are readable) of its final report and stores the best one in a profile file,
+// one line per host:
+//   <cpu model>|<sha1 of the cpu flags> <TAB> miner <TAB> affinity <TAB> threads <TAB> M/s <TAB> MH/J
+// so a shared home directory can hold the profiles of several machines
+//
+// the objective is the hash rate (rate) or the hashes per joule (efficiency); efficiency also tries
+// half of the cores, since a wide kernel on fewer cores can beat downclocked zmm code on all of them
+//
+// a normal start looks the host up and execs the stored configuration right away (explicit
+// DETI_AFFINITY or OMP_NUM_THREADS settings are kept); without a profile the widest kernel the
+// processor supports is used with the default settings
+//
+
+#define AUTOTUNE_PROFILE_ENV    "DETI_PROFILE"
+#define AUTOTUNE_PROFILE_NAME   ".deti_tuning_profile"
+#define AUTOTUNE_SECONDS        4
+#define AUTOTUNE_MAX_CANDIDATES 16
+#define AUTOTUNE_KEY_SIZE       192
+#define AUTOTUNE_PATH_SIZE      1024
+
+typedef struct {
+    char miner[32];         // binary name, e.g. "avx2_openmp_miner"
+    char affinity[32];      // DETI_AFFINITY value
+    int threads;            // OMP_NUM_THREADS (0 = the miner decides)
+    double rate;            // measured M/s
+    double efficiency;      // measured MH/J (0 = no energy counters)
+} autotune_config_t;
+
+typedef enum {
+    AUTOTUNE_OBJECTIVE_RATE = 0,
+    AUTOTUNE_OBJECTIVE_EFFICIENCY
+} autotune_objective_t;
+
+// kernels from the widest to the narrowest
+static const char *autotune_miners[] = {
+    "avx512_openmp_miner", "avx2_openmp_miner", "avx_openmp_miner", "cpu_openmp_miner"
+};
+
+static inline int autotune_miner_supported(const char *miner) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (strcmp(miner, "avx512_openmp_miner") == 0) {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl");
+    }
+    if (strcmp(miner, "avx2_openmp_miner") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (strcmp(miner, "avx_openmp_miner") == 0) {
+        return __builtin_cpu_supports("avx");
+    }
+#endif
+    return strcmp(miner, "cpu_openmp_miner") == 0;
+}
+
+//
+// host key: cpu model name plus the SHA1 of the flags line of /proc/cpuinfo
+//
+static inline void autotune_host_key(char *key, size_t size) {
+    char line[8192], model[128] = "unknown", flags_hex[41] = "none";
+    FILE *f = fopen("/proc/cpuinfo", "r");
+
+    if (f != NULL) {
+        int have_model = 0, have_flags = 0;
+        while ((!have_model || !have_flags) && fgets(line, sizeof(line), f) != NULL) {
+            char *colon = strchr(line, ':');
+            if (colon == NULL) {
+                continue;
+            }
+            char *value = colon + 1 + strspn(colon + 1, " \t");
+            value[strcspn(value, "\n")] = '\0';
+            if (!have_model && strncmp(line, "model name", 10) == 0) {
+                snprintf(model, sizeof(model), "%s", value);
+                have_model = 1;
+            } else if (!have_flags && (strncmp(line, "flags", 5) == 0 || strncmp(line, "Features", 8) == 0)) {
+                u08_t digest[20];
+                sha1_digest(value, strlen(value), digest);
+                for (int i = 0; i < 20; i++) {
+                    snprintf(&flags_hex[2 * i], 3, "%02x", digest[i]);
+                }
+                have_flags = 1;
+            }
+        }
+        fclose(f);
+    }
+    for (char *p = model; *p != '\0'; p++) {
+        if (*p == '\t' || *p == '|') {
+            *p = ' ';   // keep the profile fields separable
+        }
+    }
+    snprintf(key, size, "%s|%s", model, flags_hex);
+}
+
+static inline void autotune_profile_path(char *path, size_t size) {
+    const char *env = getenv(AUTOTUNE_PROFILE_ENV);
+    const char *home = getenv("HOME");
+
+    if (env != NULL && env[0] != '\0') {
+        snprintf(path, size, "%s", env);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(path, size, "%s/%s", home, AUTOTUNE_PROFILE_NAME);
+    } else {
+        snprintf(path, size, "%s", AUTOTUNE_PROFILE_NAME);
+    }
+}
+
+// parses one profile line; returns 1 when it belongs to key
+static inline int autotune_parse_line(const char *line, const char *key, autotune_config_t *cfg) {
+    size_t key_len = strlen(key);
+
+    if (line[0] == '#' || strncmp(line, key, key_len) != 0 || line[key_len] != '\t') {
+        return 0;
+    }
+    memset(cfg, 0, sizeof(*cfg));
+    return sscanf(line + key_len + 1, "%31[^\t]\t%31[^\t]\t%d\t%lf\t%lf", cfg->miner, cfg->affinity, &cfg->threads,
+                  &cfg->rate, &cfg->efficiency) >= 4;
+}
+
+static inline int autotune_profile_load(const char *path, const char *key, autotune_config_t *cfg) {
+    char line[1024];
+    int found = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        found = autotune_parse_line(line, key, cfg);
+    }
+    fclose(f);
+    return found;
+}
+
+// replaces (or adds) the line of key; the file is rewritten through a temporary and rename()
+static inline int autotune_profile_save(const char *path, const char *key, const autotune_config_t *cfg) {
+    char tmp[AUTOTUNE_PATH_SIZE + 16], line[1024];
+    autotune_config_t other;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (!autotune_parse_line(line, key, &other)) {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    } else {
+        fprintf(out, "# DETI coin miner tuning profiles (written by auto_miner --autotune)\n");
+    }
+    fprintf(out, "%s\t%s\t%s\t%d\t%.2f\t%.4f\n", key, cfg->miner, cfg->affinity, cfg->threads, cfg->rate, cfg->efficiency);
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// directory of the running executable (the miner binaries are installed next to it)
+static inline void autotune_bin_dir(const char *argv0, char *dir, size_t size) {
+    ssize_t n = readlink("/proc/self/exe", dir, size - 1);
+
+    if (n <= 0) {
+        snprintf(dir, size, "%s", argv0);
+    } else {
+        dir[n] = '\0';
+    }
+    char *slash = strrchr(dir, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        snprintf(dir, size, ".");
+    }
+}
+
+static inline void autotune_set_env(const autotune_config_t *cfg, int overwrite) {
+    char threads[16];
+
+    if (cfg->affinity[0] != '\0') {
+        setenv(CPU_TOPOLOGY_ENV, cfg->affinity, overwrite);
+    }
+    if (cfg->threads > 0) {
+        snprintf(threads, sizeof(threads), "%d", cfg->threads);
+        setenv("OMP_NUM_THREADS", threads, overwrite);
+    }
+}
+
+// one line of a candidate's output; the final report comes last, so its values win over any
+// earlier line that looks alike
+static inline void autotune_parse_report(autotune_config_t *cfg, const char *line) {
+    const char *field;
+
+    if ((field = strstr(line, "║ Energy:")) != NULL &&
+        sscanf(field + strlen("║ Energy:"), "%*f J, %lf MH/J", &cfg->efficiency) != 1) {
+        cfg->efficiency = 0.0;
+    }
+    if ((field = strstr(line, "Average rate:")) != NULL) {
+        cfg->rate = atof(field + strlen("Average rate:"));
+    }
+    if ((field = strstr(line, "║ Threads:")) != NULL) {
+        cfg->threads = atoi(field + strlen("║ Threads:"));
+    }
+}
+
+//
+// runs one candidate for the given time and fills in its rate, efficiency and thread count
+//
+// the output is parsed line by line while the candidate runs and until it exits, so the pipe never
+// fills up (a blocked miner would stop hashing) and the final report is seen however long the
+// output before it
+//
+static inline int autotune_measure(const char *bin_dir, autotune_config_t *cfg, int seconds) {
+    char path[AUTOTUNE_PATH_SIZE + 64], chunk[4096], line[1024];
+    int fds[2], status, stopped = 0;
+    size_t used = 0;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "%.*s/%.31s", AUTOTUNE_PATH_SIZE - 1, bin_dir, cfg->miner);
+    if (access(path, X_OK) != 0 || pipe(fds) != 0) {
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        unsetenv("OMP_NUM_THREADS");
+        autotune_set_env(cfg, 1);
+        execl(path, path, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    cfg->rate = 0.0;
+    cfg->efficiency = 0.0;
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += seconds;
+    for (;;) {
+        int timeout_ms = -1;
+        if (!stopped) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long left_ms = (long long)(deadline.tv_sec - now.tv_sec) * 1000LL +
+                                (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+            if (left_ms <= 0) {
+                kill(pid, SIGINT);  // the miner prints its final report on SIGINT
+                stopped = 1;
+            } else {
+                timeout_ms = (int)left_ms;
+            }
+        }
+        struct pollfd pfd = {fds[0], POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0) {
+            continue;  // the deadline (or a signal)
+        }
+        if ((n = read(fds[0], chunk, sizeof(chunk))) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;  // the miner exited
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            if (chunk[i] == '\n' || used == sizeof(line) - 1) {
+                line[used] = '\0';
+                autotune_parse_report(cfg, line);
+                used = 0;
+            }
+            if (chunk[i] != '\n') {
+                line[used++] = chunk[i];
+            }
+        }
+    }
+    line[used] = '\0';
+    autotune_parse_report(cfg, line);
+    close(fds[0]);
+    if (!stopped) {
+        kill(pid, SIGINT);
+    }
+    waitpid(pid, &status, 0);
+    return (cfg->rate > 0.0) ? 0 : -1;
+}
+
+// candidates: every supported kernel under the cores policy, under smt too when the cores have
+// SMT siblings, and on half of the cores when tuning for efficiency
+static inline int autotune_candidates(autotune_config_t *list, int max, autotune_objective_t objective) {
+    cpu_topology_t topo;
+    int smt = 0, half = 0, n = 0;
+
+    if (cpu_topology_load(&topo) == 0) {
+        smt = (topo.n_cpus > topo.n_cores);
+        half = (objective == AUTOTUNE_OBJECTIVE_EFFICIENCY) ? topo.n_cores / 2 : 0;
+    }
+    cpu_topology_free(&topo);
+    for (size_t k = 0; k < sizeof(autotune_miners) / sizeof(autotune_miners[0]); k++) {
+        if (!autotune_miner_supported(autotune_miners[k])) {
+            continue;
+        }
+        for (int policy = 0; policy <= smt && n < max; policy++) {
+            memset(&list[n], 0, sizeof(list[n]));
+            snprintf(list[n].miner, sizeof(list[n].miner), "%s", autotune_miners[k]);
+            snprintf(list[n].affinity, sizeof(list[n].affinity), "%s", (policy == 0) ? "cores" : "smt");
+            n++;
+        }
+        if (half > 0 && n < max) {
+            memset(&list[n], 0, sizeof(list[n]));
+            snprintf(list[n].miner, sizeof(list[n].miner), "%s", autotune_miners[k]);
+            snprintf(list[n].affinity, sizeof(list[n].affinity), "cores");
+            list[n].threads = half;
+            n++;
+        }
+    }
+    return n;
+}
+
+static inline int autotune_parse_objective(const char *text, autotune_objective_t *objective) {
+    if (strcmp(text, "rate") == 0) {
+        *objective = AUTOTUNE_OBJECTIVE_RATE;
+    } else if (strcmp(text, "efficiency") == 0) {
+        *objective = AUTOTUNE_OBJECTIVE_EFFICIENCY;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// benchmarks all candidates; returns 0 and the best one in *best (by rate when the objective is
+// efficiency but some candidate has no energy reading)
+static inline int autotune_run(const char *bin_dir, int seconds, autotune_objective_t objective, autotune_config_t *best) {
+    autotune_config_t list[AUTOTUNE_MAX_CANDIDATES];
+    int n = autotune_candidates(list, AUTOTUNE_MAX_CANDIDATES, objective);
+    int best_index = -1, measured = 0, metered = 0;
+
+    printf("[*] Autotuning %d configurations for %s, %d seconds each...\n", n,
+           (objective == AUTOTUNE_OBJECTIVE_EFFICIENCY) ? "hashes per joule" : "hash rate", seconds);
+    for (int i = 0; i < n; i++) {
+        printf("   %-22s %-6s ", list[i].miner, list[i].affinity);
+        fflush(stdout);
+        if (autotune_measure(bin_dir, &list[i], seconds) != 0) {
+            printf("failed (is %s/%s built?)\n", bin_dir, list[i].miner);
+            continue;
+        }
+        printf("%3d threads  %10.2f M/s", list[i].threads, list[i].rate);
+        if (list[i].efficiency > 0.0) {
+            printf("  %8.3f MH/J", list[i].efficiency);
+            metered++;
+        }
+        printf("\n");
+        measured++;
+    }
+    if (objective == AUTOTUNE_OBJECTIVE_EFFICIENCY && metered < measured) {
+        printf("[!] No energy reading for some configurations (RAPL unavailable?); choosing by hash rate\n");
+        objective = AUTOTUNE_OBJECTIVE_RATE;
+    }
+    for (int i = 0; i < n; i++) {
+        if (list[i].rate <= 0.0) {
+            continue;
+        }
+        if (best_index < 0 ||
+            (objective == AUTOTUNE_OBJECTIVE_RATE && list[i].rate > list[best_index].rate) ||
+            (objective == AUTOTUNE_OBJECTIVE_EFFICIENCY && list[i].efficiency > list[best_index].efficiency)) {
+            best_index = i;
+        }
+    }
+    if (best_index < 0) {
+        return -1;
+    }
+    *best = list[best_index];
+    return 0;
+}
+
+// configuration without a profile: the widest supported kernel with the miner defaults
+static inline void autotune_default(autotune_config_t *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    for (size_t k = 0; k < sizeof(autotune_miners) / sizeof(autotune_miners[0]); k++) {
+        if (autotune_miner_supported(autotune_miners[k])) {
+            snprintf(cfg->miner, sizeof(cfg->miner), "%s", autotune_miners[k]);
+            return;
+        }
+    }
+}
+
+#endif
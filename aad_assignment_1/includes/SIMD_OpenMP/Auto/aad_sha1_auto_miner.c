@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "aad_autotune.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [custom_text]\n", prog);
+    fprintf(stderr, "       %s --autotune [seconds] [rate|efficiency]\n", prog);
+    fprintf(stderr, "  No arguments: mine standard DETI coins with the tuned configuration of this host\n");
+    fprintf(stderr, "  With text:    mine custom coins with embedded text\n");
+    fprintf(stderr, "  --autotune:   benchmark every kernel/SMT policy (default %d s each) and save the best\n", AUTOTUNE_SECONDS);
+    fprintf(stderr, "                by hash rate (default, or DETI_TUNE_OBJECTIVE) or by hashes per joule\n");
+}
+
+int main(int argc, char *argv[]) {
+    char key[AUTOTUNE_KEY_SIZE], profile[AUTOTUNE_PATH_SIZE], bin_dir[AUTOTUNE_PATH_SIZE], path[2 * AUTOTUNE_PATH_SIZE];
+    autotune_config_t cfg;
+
+    autotune_host_key(key, sizeof(key));
+    autotune_profile_path(profile, sizeof(profile));
+    autotune_bin_dir(argv[0], bin_dir, sizeof(bin_dir));
+
+    if (argc >= 2 && strcmp(argv[1], "--autotune") == 0) {
+        int seconds = (argc >= 3) ? atoi(argv[2]) : AUTOTUNE_SECONDS;
+        const char *objective_text = (argc >= 4) ? argv[3] : getenv("DETI_TUNE_OBJECTIVE");
+        autotune_objective_t objective = AUTOTUNE_OBJECTIVE_RATE;
+        if (seconds <= 0 || (objective_text != NULL && autotune_parse_objective(objective_text, &objective) != 0)) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        printf("   Host: %s\n", key);
+        if (autotune_run(bin_dir, seconds, objective, &cfg) != 0) {
+            fprintf(stderr, "Error: no miner could be benchmarked (build them with make all-openmp)\n");
+            return EXIT_FAILURE;
+        }
+        if (autotune_profile_save(profile, key, &cfg) != 0) {
+            fprintf(stderr, "Error: cannot write the profile %s\n", profile);
+            return EXIT_FAILURE;
+        }
+        printf("[OK] Best: %s, %s=%s, %d threads, %.2f M/s, %.3f MH/J (saved to %s)\n",
+               cfg.miner, CPU_TOPOLOGY_ENV, cfg.affinity, cfg.threads, cfg.rate, cfg.efficiency, profile);
+        return 0;
+    }
+    if (argc >= 2 && argv[1][0] == '-') {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (autotune_profile_load(profile, key, &cfg)) {
+        printf("[*] Tuned profile: %s, %s=%s, %d threads (%.2f M/s when tuned)\n",
+               cfg.miner, CPU_TOPOLOGY_ENV, cfg.affinity, cfg.threads, cfg.rate);
+    } else {
+        autotune_default(&cfg);
+        printf("[*] No tuning profile for this host in %s; using %s (run with --autotune to tune)\n", profile, cfg.miner);
+    }
+    autotune_set_env(&cfg, 0);
+    snprintf(path, sizeof(path), "%s/%s", bin_dir, cfg.miner);
+    fflush(stdout);
+    execl(path, path, (argc >= 2) ? argv[1] : (char *)NULL, (char *)NULL);
+    fprintf(stderr, "Error: cannot run %s (build it with make all-openmp)\n", path);
+    return EXIT_FAILURE;
+}
@@ -12,9 +12,12 @@
 #include "../aad_sha1_cpu.h"
 #include "../aad_vault.h"
 #include "../aad_coin_types.h"
+#include "../aad_thread_stats.h"
+#include "../aad_nonce_scheduler.h"
+#include "../aad_shm_nonce.h"
+#include "../aad_cpu_topology.h"
 
 static volatile int stop_signal = 0;
-static volatile int coins_found = 0;
 
 // optional custom text
 static inline void generate_coin_counter(u32_t coin[14], u64_t counter, const coin_config_t *config) {
@@ -40,7 +43,11 @@ static inline void generate_coin_counter(u32_t coin[14], u64_t counter, const co
 }
 
 static inline void mine_cpu_coins_openmp(const coin_config_t *config) {
-    int num_threads = omp_get_max_threads();
+    cpu_placement_t placement;
+    cpu_placement_init(&placement);
+    cgroup_cpu_t cgroup;
+    cgroup_cpu_init(&cgroup);
+    int num_threads = cgroup_cpu_size_threads(&cgroup, cpu_placement_threads(&placement, omp_get_max_threads()));
     // startup message
     if (config->type == COIN_TYPE_CUSTOM) {
         printf("[+] Starting CUSTOM coin mining (CPU OpenMP, %d threads)...\n", num_threads);
@@ -48,24 +55,58 @@ static inline void mine_cpu_coins_openmp(const coin_config_t *config) {
     } else {
         printf("[*] Starting DETI coin mining (CPU OpenMP, %d threads)...\n", num_threads);
     }
+    cpu_placement_print(&placement, num_threads);
+    cgroup_cpu_print(&cgroup);
+    shm_nonce_t shm;
+    shm_nonce_attach(&shm, config);
+    shm_nonce_print(&shm);
+    background_t background;
+    background_init(&background);
+    background_print(&background);
     printf("============================================================\n");
 
-    time_t start = time(NULL);
-    u64_t total_attempts = 0;
+    thread_stats_t stats;
+    nonce_scheduler_t scheduler;
+    if (thread_stats_init(&stats, num_threads) != 0) {
+        fprintf(stderr, "Error: cannot allocate the per-thread mining state\n");
+        cpu_placement_free(&placement);
+        shm_nonce_detach(&shm);
+        return;
+    }
+    if (nonce_scheduler_init(&scheduler, num_threads, shm_nonce_refill, &shm, NONCE_REFILL_ANY, &stop_signal) != 0) {
+        fprintf(stderr, "Error: cannot allocate the per-thread mining state\n");
+        thread_stats_free(&stats);
+        cpu_placement_free(&placement);
+        shm_nonce_detach(&shm);
+        return;
+    }
+    thread_stats_watch_cgroup(&stats, &cgroup);
+    thread_stats_watch_background(&stats, &background);
+    thread_stats_start_reporter(&stats);
 
-    #pragma omp parallel
+    #pragma omp parallel num_threads(num_threads)
     {
         int thread_id = omp_get_thread_num();
+        cpu_placement_pin(&placement, thread_id);
+        background_enter_thread(&background);
         u32_t coin[14] __attribute__((aligned(16)));
         u32_t hash[5] __attribute__((aligned(16)));
         u64_t local_counter = 0;
-        u64_t thread_offset = (u64_t)thread_id * 1000000000ULL;
-        time_t last_print = start;
+        u64_t counter = 0, counter_end = 0;
+        double duty_mark = 0.0;
+        thread_counters_t *counters = &stats.threads[thread_id];
         while (!stop_signal) {
-            u64_t counter = thread_offset + local_counter;
+            if (counter >= counter_end) {
+                thread_stats_park(&stats, thread_id, &stop_signal);
+                background_pause(&background, &duty_mark, &stop_signal);
+                if (!nonce_scheduler_next(&scheduler, thread_id, &counter, &counter_end)) {
+                    break;
+                }
+            }
             generate_coin_counter(coin, counter, config);
             sha1(coin, hash);
             if (__builtin_expect(hash[0] == 0xAAD20250u, 0)) {
+                thread_stats_add_share(counters);
                 u08_t *base_coin = (u08_t *)coin;
                 int valid = 1;
                 for (int i = 12; i < 54; i++) {
@@ -75,63 +116,52 @@ static inline void mine_cpu_coins_openmp(const coin_config_t *config) {
                     }
                 }
                 if (valid) {
-                    #pragma omp atomic
-                    coins_found++;
+                    thread_stats_add_coin(counters);
 
                     #pragma omp critical
                     {
-                        printf("\n%s COIN #%d (Thread %d)\n", (config->type == COIN_TYPE_CUSTOM ? "[+]" : "[*]"), coins_found, thread_id);
+                        printf("\n%s COIN #%lu (Thread %d)\n", (config->type == COIN_TYPE_CUSTOM ? "[+]" : "[*]"), thread_stats_total_coins(&stats), thread_id);
                         save_coin(coin);
                     }
                 }
             }
 
+            counter++;
             local_counter++;
             if (__builtin_expect((local_counter & 0xFFFFF) == 0, 0)) {
-                #pragma omp atomic
-                total_attempts += 0x100000;
-            }
-            if (thread_id == 0 && __builtin_expect((local_counter & 0xFFFFF) == 0, 0)) {
-                time_t now = time(NULL);
-                double elapsed = difftime(now, start);
-
-                if (elapsed >= 5.0 && difftime(now, last_print) >= 5.0) {
-                    u64_t snapshot;
-                    #pragma omp atomic read
-                    snapshot = total_attempts;
-
-                    double hash_rate = snapshot / elapsed / 1e6;
-
-                    printf("[%ds] %lu M @ %.2f M/s | Coins: %d | Threads: %d\n",
-                           (int)elapsed,
-                           snapshot / 1000000UL,
-                           hash_rate,
-                           coins_found,
-                           num_threads);
-                    last_print = now;
-                }
+                thread_stats_set_hashes(counters, local_counter);
             }
         }
-        u64_t remainder = local_counter & 0xFFFFF;
-        if (remainder > 0) {
-            #pragma omp atomic
-            total_attempts += remainder;
-        }
+        thread_stats_set_hashes(counters, local_counter);
     }
 
-    time_t end = time(NULL);
-    double elapsed = difftime(end, start);
-    double final_rate = total_attempts / elapsed / 1e6;
+    thread_stats_stop_reporter(&stats);
+    nonce_scheduler_free(&scheduler);
+    shm_nonce_detach(&shm);
+
+    thread_totals_t totals;
+    thread_stats_totals(&stats, &totals);
+    double elapsed = thread_stats_elapsed(&stats);
+    double final_rate = totals.hashes / elapsed / 1e6;
 
     printf("\n╔════════════════════════════════════════════════════════════╗\n");
     printf("║              OPENMP CPU FINAL STATISTICS                   ║\n");
     printf("╠════════════════════════════════════════════════════════════╣\n");
     printf("║ Threads:         %-37d ║\n", num_threads);
-    printf("║ Total attempts:  %-37lu ║\n", total_attempts);
+    printf("║ Placement:       %-37s ║\n", placement.name);
+    printf("║ Total attempts:  %-37lu ║\n", totals.hashes);
     printf("║ Time:            %.2f seconds%-26s║\n", elapsed, "");
     printf("║ Average rate:    %.2f M/s%-30s║\n", final_rate, "");
-    printf("║ Coins found:     %-37d ║\n", coins_found);
+    printf("║ Coins found:     %-37lu ║\n", totals.coins);
+    printf("║ Shares:          %-37lu ║\n", totals.shares);
+    char energy[64];
+    if (thread_stats_energy_text(&stats, totals.hashes, elapsed, energy, sizeof(energy))) {
+        printf("║ Energy:          %-37s ║\n", energy);
+    }
     printf("╚════════════════════════════════════════════════════════════╝\n");
+    cpu_placement_report(&placement, &stats, elapsed);
+    thread_stats_free(&stats);
+    cpu_placement_free(&placement);
 }
 
 #endif
\ No newline at end of file
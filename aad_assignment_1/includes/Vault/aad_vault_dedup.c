@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../aad_data_types.h"
+#include "../aad_vault_dedup.h"
+
+//
+// offline deduplication of one or more vault files
+//
+// every well-formed record is inserted in a fingerprint set; the first occurrence of a coin
+// is kept (and written to the output file, if one was given), later ones are counted as
+// duplicate work (a DETI coin costs about 2^32 SHA1 evaluations on average)
+//
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-o output_vault] vault_file [vault_file ...]\n", prog);
+    fprintf(stderr, "  Reports duplicate coins within and across the given vault files\n");
+    fprintf(stderr, "  -o: also write the unique records (first occurrence order) to output_vault\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *output_path = NULL;
+    int first_input = 1;
+
+    if (argc >= 3 && strcmp(argv[1], "-o") == 0) {
+        output_path = argv[2];
+        first_input = 3;
+    }
+    if (first_input >= argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // size the table from the total input size (one record per 59 bytes)
+    u64_t expected = 0;
+    for (int i = first_input; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (fp != NULL) {
+            fseek(fp, 0, SEEK_END);
+            long size = ftell(fp);
+            expected += (size > 0) ? (u64_t)size / VAULT_RECORD_SIZE : 0;
+            fclose(fp);
+        }
+    }
+
+    vault_dedup_set_t set;
+    if (vault_dedup_init(&set, expected) != 0) {
+        fprintf(stderr, "Error: cannot allocate the fingerprint table (%lu records)\n", expected);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = NULL;
+    if (output_path != NULL) {
+        out = fopen(output_path, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Error: cannot create \"%s\"\n", output_path);
+            vault_dedup_free(&set);
+            return EXIT_FAILURE;
+        }
+    }
+
+    vault_dedup_stats_t total = {0, 0, 0, 0};
+    printf("%-40s %10s %10s %10s %10s\n", "file", "records", "unique", "duplicate", "malformed");
+    for (int i = first_input; i < argc; i++) {
+        vault_dedup_stats_t stats = {0, 0, 0, 0};
+        vault_reader_t r;
+        const u08_t *line;
+        size_t len;
+
+        if (vault_reader_open(&r, argv[i]) != 0) {
+            fprintf(stderr, "Warning: cannot open \"%s\", skipped\n", argv[i]);
+            continue;
+        }
+        while ((line = vault_reader_next(&r, &len)) != NULL) {
+            if (!vault_record_is_valid(line, len)) {
+                if (!(len == 1 && line[0] == '\n')) {
+                    stats.malformed++;
+                }
+                continue;
+            }
+            stats.records++;
+            int inserted = vault_dedup_insert(&set, vault_bytes_fingerprint(line + 4));
+            if (inserted < 0) {
+                fprintf(stderr, "Error: out of memory\n");
+                return EXIT_FAILURE;
+            }
+            if (inserted == 0) {
+                stats.duplicates++;
+                continue;
+            }
+            stats.unique++;
+            if (out != NULL && fwrite(line, 1, len, out) != len) {
+                fprintf(stderr, "Error: write to \"%s\" failed\n", output_path);
+                return EXIT_FAILURE;
+            }
+        }
+        vault_reader_close(&r);
+
+        printf("%-40s %10lu %10lu %10lu %10lu\n", argv[i], stats.records, stats.unique, stats.duplicates, stats.malformed);
+        total.records += stats.records;
+        total.unique += stats.unique;
+        total.duplicates += stats.duplicates;
+        total.malformed += stats.malformed;
+    }
+
+    if (out != NULL && (fflush(out) != 0 || fclose(out) != 0)) {
+        fprintf(stderr, "Error: write to \"%s\" failed\n", output_path);
+        return EXIT_FAILURE;
+    }
+
+    double dup_pct = (total.records > 0) ? 100.0 * total.duplicates / total.records : 0.0;
+    printf("\n╔════════════════════════════════════════════════════════════╗\n");
+    printf("║                  VAULT DEDUPLICATION REPORT                ║\n");
+    printf("╠════════════════════════════════════════════════════════════╣\n");
+    printf("║ Files:           %-37d ║\n", argc - first_input);
+    printf("║ Records:         %-37lu ║\n", total.records);
+    printf("║ Unique coins:    %-37lu ║\n", total.unique);
+    printf("║ Duplicates:      %-37lu ║\n", total.duplicates);
+    printf("║ Duplicate work:  %6.2f%% (~%.3g SHA1 hashes)%-11s║\n", dup_pct, (double)total.duplicates * 4294967296.0, "");
+    printf("║ Malformed lines: %-37lu ║\n", total.malformed);
+    printf("╚════════════════════════════════════════════════════════════╝\n");
+
+    vault_dedup_free(&set);
+    return 0;
+}
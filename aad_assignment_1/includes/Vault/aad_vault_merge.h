@@ -0,0 +1,319 @@
+#ifndef AAD_VAULT_MERGE_H
+#define AAD_VAULT_MERGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../aad_data_types.h"
+#include "../aad_vault_dedup.h"
+
+//
+// external k-way merge of vault files
+//
+// phase 1 streams the input files through a bounded buffer; each full buffer is sorted, stripped
+// of duplicates and written as a sorted run file
+// phase 2 merges the runs with a binary min-heap, at most MERGE_MAX_FANIN runs at a time (extra
+// passes produce bigger runs), and drops records equal to the previously written one
+//
+// records are ordered by the sort key first and by their bytes next, so identical coins are
+// always adjacent in the merged stream and no global hash set is needed
+//
+
+#define MERGE_DEFAULT_RUN_MB  64u
+#ifndef MERGE_MAX_FANIN
+# define MERGE_MAX_FANIN      64u
+#endif
+#define MERGE_IO_BUF_SIZE     (1u << 16)
+
+typedef enum {
+    MERGE_BY_POWER = 0,  // highest power first
+    MERGE_BY_TIME  = 1   // oldest time stamp first
+} merge_order_t;
+
+typedef struct {
+    u32_t key;
+    u08_t rec[VAULT_RECORD_SIZE];
+} merge_record_t;
+
+typedef struct {
+    merge_order_t order;
+    size_t run_records;     // records per sorted run (bounds the memory used)
+    const char *run_prefix; // run files are named <run_prefix>.run.<pid>.<n>
+} merge_config_t;
+
+typedef struct {
+    u64_t input_files;
+    u64_t records;
+    u64_t malformed;
+    u64_t runs;
+    u64_t passes;
+    u64_t duplicates;
+    u64_t written;
+} merge_stats_t;
+
+typedef struct {
+    FILE *fp;
+    merge_record_t cur;
+} merge_source_t;
+
+typedef struct {
+    char **names;
+    size_t count, capacity, next_id;
+} merge_run_list_t;
+
+static inline u32_t merge_key(const u08_t *rec, merge_order_t order) {
+    if (order == MERGE_BY_TIME) {
+        return vault_record_timestamp(rec);
+    }
+    return 99u - (u32_t)vault_record_power(rec);
+}
+
+static inline int merge_compare(const merge_record_t *a, const merge_record_t *b) {
+    if (a->key != b->key) {
+        return (a->key < b->key) ? -1 : 1;
+    }
+    return memcmp(a->rec, b->rec, VAULT_RECORD_SIZE);
+}
+
+static int merge_qsort_compare(const void *a, const void *b) {
+    return merge_compare((const merge_record_t *)a, (const merge_record_t *)b);
+}
+
+static inline char *merge_new_run_name(merge_run_list_t *runs, const merge_config_t *config) {
+    if (runs->count == runs->capacity) {
+        size_t capacity = runs->capacity ? 2 * runs->capacity : 64;
+        char **names = (char **)realloc(runs->names, capacity * sizeof(char *));
+        if (names == NULL) {
+            return NULL;
+        }
+        runs->names = names;
+        runs->capacity = capacity;
+    }
+    size_t size = strlen(config->run_prefix) + 48;
+    char *name = (char *)malloc(size);
+    if (name == NULL) {
+        return NULL;
+    }
+    snprintf(name, size, "%s.run.%ld.%zu", config->run_prefix, (long)getpid(), runs->next_id++);
+    runs->names[runs->count++] = name;
+    return name;
+}
+
+static inline void merge_remove_runs(merge_run_list_t *runs, size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++) {
+        remove(runs->names[i]);
+        free(runs->names[i]);
+    }
+    memmove(&runs->names[first], &runs->names[first + count], (runs->count - first - count) * sizeof(char *));
+    runs->count -= count;
+}
+
+// sorts buf[0..n-1] and writes it, without duplicates, as a new run
+static inline int merge_flush_run(merge_record_t *buf, size_t n, merge_run_list_t *runs,
+                                  const merge_config_t *config, merge_stats_t *stats) {
+    if (n == 0) {
+        return 0;
+    }
+    qsort(buf, n, sizeof(merge_record_t), merge_qsort_compare);
+    char *name = merge_new_run_name(runs, config);
+    FILE *fp = (name != NULL) ? fopen(name, "wb") : NULL;
+    if (fp == NULL) {
+        fprintf(stderr, "merge: cannot create run file\n");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0 && memcmp(buf[i].rec, buf[i - 1].rec, VAULT_RECORD_SIZE) == 0) {
+            stats->duplicates++;
+            continue;
+        }
+        if (fwrite(buf[i].rec, VAULT_RECORD_SIZE, 1, fp) != 1) {
+            fclose(fp);
+            fprintf(stderr, "merge: write to \"%s\" failed\n", name);
+            return -1;
+        }
+    }
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "merge: write to \"%s\" failed\n", name);
+        return -1;
+    }
+    stats->runs++;
+    return 0;
+}
+
+// phase 1: streams every input file into sorted runs
+static inline int merge_make_runs(char *const *inputs, int n_inputs, merge_run_list_t *runs,
+                                  const merge_config_t *config, merge_stats_t *stats) {
+    merge_record_t *buf = (merge_record_t *)malloc(config->run_records * sizeof(merge_record_t));
+    size_t n = 0;
+
+    if (buf == NULL) {
+        fprintf(stderr, "merge: cannot allocate the run buffer\n");
+        return -1;
+    }
+    for (int i = 0; i < n_inputs; i++) {
+        vault_reader_t r;
+        const u08_t *line;
+        size_t len;
+
+        if (vault_reader_open(&r, inputs[i]) != 0) {
+            fprintf(stderr, "Warning: cannot open \"%s\", skipped\n", inputs[i]);
+            continue;
+        }
+        stats->input_files++;
+        while ((line = vault_reader_next(&r, &len)) != NULL) {
+            if (!vault_record_is_valid(line, len)) {
+                if (!(len == 1 && line[0] == '\n')) {
+                    stats->malformed++;
+                }
+                continue;
+            }
+            stats->records++;
+            memcpy(buf[n].rec, line, VAULT_RECORD_SIZE);
+            buf[n].key = merge_key(line, config->order);
+            if (++n == config->run_records) {
+                if (merge_flush_run(buf, n, runs, config, stats) != 0) {
+                    vault_reader_close(&r);
+                    free(buf);
+                    return -1;
+                }
+                n = 0;
+            }
+        }
+        vault_reader_close(&r);
+    }
+    int result = merge_flush_run(buf, n, runs, config, stats);
+    free(buf);
+    return result;
+}
+
+static inline int merge_source_advance(merge_source_t *s, merge_order_t order) {
+    if (fread(s->cur.rec, VAULT_RECORD_SIZE, 1, s->fp) != 1) {
+        return 0;
+    }
+    s->cur.key = merge_key(s->cur.rec, order);
+    return 1;
+}
+
+static inline void merge_heap_sift_down(merge_source_t **heap, size_t n, size_t i) {
+    for (;;) {
+        size_t smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && merge_compare(&heap[l]->cur, &heap[smallest]->cur) < 0) smallest = l;
+        if (r < n && merge_compare(&heap[r]->cur, &heap[smallest]->cur) < 0) smallest = r;
+        if (smallest == i) {
+            return;
+        }
+        merge_source_t *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// merges runs[first..first+count-1] into out; counts the records written in *written
+static inline int merge_runs_into(merge_run_list_t *runs, size_t first, size_t count, FILE *out,
+                                  merge_order_t order, merge_stats_t *stats, u64_t *written) {
+    merge_source_t *sources = (merge_source_t *)calloc(count, sizeof(merge_source_t));
+    merge_source_t **heap = (merge_source_t **)calloc(count, sizeof(merge_source_t *));
+    u08_t last[VAULT_RECORD_SIZE];
+    int have_last = 0, result = 0;
+    size_t n = 0;
+
+    if (count > 0 && (sources == NULL || heap == NULL)) {
+        free(sources);
+        free(heap);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        sources[i].fp = fopen(runs->names[first + i], "rb");
+        if (sources[i].fp == NULL) {
+            fprintf(stderr, "merge: cannot open run \"%s\"\n", runs->names[first + i]);
+            result = -1;
+            break;
+        }
+        setvbuf(sources[i].fp, NULL, _IOFBF, MERGE_IO_BUF_SIZE);
+        if (merge_source_advance(&sources[i], order)) {
+            heap[n++] = &sources[i];
+        }
+    }
+    if (result == 0) {
+        for (size_t i = n / 2; i-- > 0;) {
+            merge_heap_sift_down(heap, n, i);
+        }
+        while (n > 0) {
+            merge_source_t *top = heap[0];
+            if (have_last && memcmp(last, top->cur.rec, VAULT_RECORD_SIZE) == 0) {
+                stats->duplicates++;
+            } else {
+                if (fwrite(top->cur.rec, VAULT_RECORD_SIZE, 1, out) != 1) {
+                    result = -1;
+                    break;
+                }
+                memcpy(last, top->cur.rec, VAULT_RECORD_SIZE);
+                have_last = 1;
+                (*written)++;
+            }
+            if (!merge_source_advance(top, order)) {
+                heap[0] = heap[--n];
+            }
+            merge_heap_sift_down(heap, n, 0);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (sources[i].fp != NULL) {
+            fclose(sources[i].fp);
+        }
+    }
+    free(sources);
+    free(heap);
+    return result;
+}
+
+// phase 2: merges the runs (in several passes if there are too many) into output_path
+static inline int merge_runs(merge_run_list_t *runs, const char *output_path,
+                             const merge_config_t *config, merge_stats_t *stats) {
+    while (runs->count > MERGE_MAX_FANIN) {
+        u64_t unused = 0;
+        char *name = merge_new_run_name(runs, config);
+        FILE *fp = (name != NULL) ? fopen(name, "wb") : NULL;
+        if (fp == NULL) {
+            fprintf(stderr, "merge: cannot create run file\n");
+            return -1;
+        }
+        int result = merge_runs_into(runs, 0, MERGE_MAX_FANIN, fp, config->order, stats, &unused);
+        if (fclose(fp) != 0 || result != 0) {
+            fprintf(stderr, "merge: intermediate pass failed\n");
+            return -1;
+        }
+        merge_remove_runs(runs, 0, MERGE_MAX_FANIN);
+        stats->passes++;
+    }
+
+    FILE *out = fopen(output_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "merge: cannot create \"%s\"\n", output_path);
+        return -1;
+    }
+    int result = merge_runs_into(runs, 0, runs->count, out, config->order, stats, &stats->written);
+    if (fflush(out) != 0 || fclose(out) != 0 || result != 0) {
+        fprintf(stderr, "merge: write to \"%s\" failed\n", output_path);
+        return -1;
+    }
+    stats->passes++;
+    merge_remove_runs(runs, 0, runs->count);
+    return 0;
+}
+
+static inline int merge_vault_files(char *const *inputs, int n_inputs, const char *output_path,
+                                    const merge_config_t *config, merge_stats_t *stats) {
+    merge_run_list_t runs = {NULL, 0, 0, 0};
+    int result = merge_make_runs(inputs, n_inputs, &runs, config, stats);
+    if (result == 0) {
+        result = merge_runs(&runs, output_path, config, stats);
+    }
+    merge_remove_runs(&runs, 0, runs.count);
+    free(runs.names);
+    return result;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "aad_vault_query.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] summary|top|histogram|templates vault_file [vault_file ...]\n", prog);
+    fprintf(stderr, "  summary    record counts and best power\n");
+    fprintf(stderr, "  top        best coins (-n N, default 10)\n");
+    fprintf(stderr, "  histogram  power distribution (per custom text with -p)\n");
+    fprintf(stderr, "  templates  count, best coin and time span per custom text\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -f csv|json      output format (default csv)\n");
+    fprintf(stderr, "  --min-power P    only coins with power >= P\n");
+    fprintf(stderr, "  --since T        only coins with time stamp >= T (unix time)\n");
+    fprintf(stderr, "  --since-days D   only coins from the last D days\n");
+    fprintf(stderr, "  --text S         only coins with custom text S (\"\" = DETI coins)\n");
+    fprintf(stderr, "  -n N             number of coins for top (default 10)\n");
+    fprintf(stderr, "  -p               per-template histogram\n");
+    fprintf(stderr, "  -t N             threads per file (default: OpenMP default)\n");
+    fprintf(stderr, "  --verify         rehash every coin; bad coins are counted and skipped\n");
+}
+
+int main(int argc, char *argv[]) {
+    vault_query_t q;
+    int json = 0, per_template = 0;
+    int arg = 1;
+
+    q.min_power = 0;
+    q.since = 0u;
+    q.text = NULL;
+    q.top_n = 10;
+    q.threads = 0;
+    q.verify = 0;
+    while (arg < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-p") == 0) {
+            per_template = 1;
+            arg++;
+            continue;
+        }
+        if (strcmp(argv[arg], "--verify") == 0) {
+            q.verify = 1;
+            arg++;
+            continue;
+        }
+        if (arg + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        const char *value = argv[arg + 1];
+        if (strcmp(argv[arg], "-f") == 0 && (strcmp(value, "csv") == 0 || strcmp(value, "json") == 0)) {
+            json = (strcmp(value, "json") == 0);
+        } else if (strcmp(argv[arg], "--min-power") == 0) {
+            q.min_power = atoi(value);
+        } else if (strcmp(argv[arg], "--since") == 0) {
+            q.since = (u32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[arg], "--since-days") == 0) {
+            q.since = (u32_t)(time(NULL) - (time_t)(atof(value) * 86400.0));
+        } else if (strcmp(argv[arg], "--text") == 0) {
+            q.text = value;
+        } else if (strcmp(argv[arg], "-n") == 0 && atoi(value) > 0) {
+            q.top_n = atoi(value);
+        } else if (strcmp(argv[arg], "-t") == 0 && atoi(value) > 0) {
+            q.threads = atoi(value);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        arg += 2;
+    }
+    if (arg + 1 >= argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *report = argv[arg++];
+    if (strcmp(report, "summary") != 0 && strcmp(report, "top") != 0 &&
+        strcmp(report, "histogram") != 0 && strcmp(report, "templates") != 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    vault_query_result_t res;
+    if (vault_query_result_init(&res, q.top_n) != 0) {
+        fprintf(stderr, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (; arg < argc; arg++) {
+        vault_query_result_t file_res;
+        if (vault_query_result_init(&file_res, q.top_n) != 0 ||
+            vault_query_file(argv[arg], &q, &file_res) != 0 ||
+            vault_query_merge(&res, &file_res) != 0) {
+            fprintf(stderr, "Error: cannot query \"%s\"\n", argv[arg]);
+            vault_query_result_free(&file_res);
+            vault_query_result_free(&res);
+            return EXIT_FAILURE;
+        }
+        vault_query_result_free(&file_res);
+    }
+
+    if (strcmp(report, "summary") == 0) {
+        vault_query_print_summary(stdout, &res, json);
+    } else if (strcmp(report, "top") == 0) {
+        vault_query_print_top(stdout, &res, json);
+    } else if (strcmp(report, "histogram") == 0) {
+        vault_query_print_histogram(stdout, &res, per_template, json);
+    } else {
+        vault_query_print_templates(stdout, &res, json);
+    }
+    vault_query_result_free(&res);
+    return 0;
+}
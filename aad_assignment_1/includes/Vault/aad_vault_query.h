@@ -0,0 +1,455 @@
+#ifndef AAD_VAULT_QUERY_H
+#define AAD_VAULT_QUERY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+#include "../aad_data_types.h"
+#include "../aad_vault_dedup.h"
+#include "../aad_sha1_batch.h"
+
+//
+// streaming vault queries
+//
+// one pass over each vault file answers every report at once (power histogram, top-N coins and
+// per-template statistics); large files are split in byte ranges, one per OpenMP thread, each
+// range starting at the first line that begins inside it; the per-thread partial results are
+// merged at the end
+//
+// with verify set every record is rehashed (in batches, see aad_sha1_batch.h) before it is used;
+// records with a bad signature or whose reported power disagrees with the hash are counted apart
+// and excluded from the reports
+//
+// the template of a coin is its custom text ("" for plain DETI coins, "(other)" for coins whose
+// layout does not follow the text + time stamp convention of the miners)
+//
+
+#define VAULT_QUERY_MAX_POWER      100
+#define VAULT_QUERY_MIN_RANGE      (4u << 20)  // do not split files in ranges smaller than this
+#define VAULT_QUERY_OTHER_TEMPLATE "(other)"
+#define VAULT_QUERY_VERIFY_BATCH   1024
+
+typedef struct {
+    int min_power;      // skip coins with a lower power
+    u32_t since;        // skip coins with an older time stamp (0 = no limit)
+    const char *text;   // only coins with this custom text (NULL = any, "" = DETI coins)
+    int top_n;          // number of best coins to keep
+    int threads;        // 0 = OpenMP default
+    int verify;         // recompute the SHA1 of every record
+} vault_query_t;
+
+typedef struct {
+    char text[29];
+    u64_t count;
+    u64_t power_hist[VAULT_QUERY_MAX_POWER];
+    int best_power;
+    u08_t best_rec[VAULT_RECORD_SIZE];
+    u32_t first_time, last_time;
+} vault_template_stats_t;
+
+typedef struct {
+    u64_t records;      // well-formed records read
+    u64_t matched;      // records that passed the filters
+    u64_t malformed;
+    u64_t bad_signature;  // verify only: the hash does not start with 0xAAD20250
+    u64_t bad_power;      // verify only: the reported power is not the one of the hash
+    u64_t power_hist[VAULT_QUERY_MAX_POWER];
+    vault_template_stats_t *templates;
+    size_t n_templates, templates_capacity;
+    u08_t (*top)[VAULT_RECORD_SIZE];  // best coins, highest power first
+    int n_top, top_capacity;
+} vault_query_result_t;
+
+static inline int vault_query_result_init(vault_query_result_t *res, int top_n) {
+    memset(res, 0, sizeof(*res));
+    res->top_capacity = (top_n > 0) ? top_n : 0;
+    if (res->top_capacity > 0) {
+        res->top = (u08_t (*)[VAULT_RECORD_SIZE])malloc((size_t)res->top_capacity * VAULT_RECORD_SIZE);
+        if (res->top == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline void vault_query_result_free(vault_query_result_t *res) {
+    free(res->templates);
+    free(res->top);
+    memset(res, 0, sizeof(*res));
+}
+
+static inline vault_template_stats_t *vault_query_template(vault_query_result_t *res, const char *text) {
+    for (size_t i = 0; i < res->n_templates; i++) {
+        if (strcmp(res->templates[i].text, text) == 0) {
+            return &res->templates[i];
+        }
+    }
+    if (res->n_templates == res->templates_capacity) {
+        size_t capacity = res->templates_capacity ? 2 * res->templates_capacity : 16;
+        vault_template_stats_t *t = (vault_template_stats_t *)realloc(res->templates, capacity * sizeof(*t));
+        if (t == NULL) {
+            return NULL;
+        }
+        res->templates = t;
+        res->templates_capacity = capacity;
+    }
+    vault_template_stats_t *t = &res->templates[res->n_templates++];
+    memset(t, 0, sizeof(*t));
+    size_t len = strlen(text);
+    memcpy(t->text, text, (len < sizeof(t->text)) ? len : sizeof(t->text) - 1);
+    t->best_power = -1;
+    t->first_time = 0xFFFFFFFFu;
+    return t;
+}
+
+// keeps the top_capacity best records (ties broken by the record bytes, so results are stable)
+static inline void vault_query_offer_top(vault_query_result_t *res, const u08_t *rec) {
+    int power = vault_record_power(rec);
+    int pos = res->n_top;
+    while (pos > 0) {
+        const u08_t *prev = res->top[pos - 1];
+        int prev_power = vault_record_power(prev);
+        if (prev_power > power || (prev_power == power && memcmp(prev, rec, VAULT_RECORD_SIZE) <= 0)) {
+            break;
+        }
+        pos--;
+    }
+    if (pos >= res->top_capacity) {
+        return;
+    }
+    if (pos > 0 && memcmp(res->top[pos - 1], rec, VAULT_RECORD_SIZE) == 0) {
+        return;  // same coin stored twice
+    }
+    int last = (res->n_top < res->top_capacity) ? res->n_top : res->top_capacity - 1;
+    memmove(res->top[pos + 1], res->top[pos], (size_t)(last - pos) * VAULT_RECORD_SIZE);
+    memcpy(res->top[pos], rec, VAULT_RECORD_SIZE);
+    if (res->n_top < res->top_capacity) {
+        res->n_top++;
+    }
+}
+
+static inline void vault_query_template_add(vault_template_stats_t *t, int power, u32_t time_stamp, const u08_t *rec) {
+    t->count++;
+    t->power_hist[power]++;
+    if (power > t->best_power || (power == t->best_power && memcmp(rec, t->best_rec, VAULT_RECORD_SIZE) < 0)) {
+        t->best_power = power;
+        memcpy(t->best_rec, rec, VAULT_RECORD_SIZE);
+    }
+    if (time_stamp < t->first_time) t->first_time = time_stamp;
+    if (time_stamp > t->last_time) t->last_time = time_stamp;
+}
+
+static inline int vault_query_record(vault_query_result_t *res, const vault_query_t *q, const u08_t *rec) {
+    char text[29];
+    int power = vault_record_power(rec);
+    u32_t time_stamp = vault_record_timestamp(rec);
+
+    res->records++;
+    if (power < q->min_power || (q->since != 0u && time_stamp < q->since)) {
+        return 0;
+    }
+    if (vault_record_custom_text(rec, text) < 0) {
+        strcpy(text, VAULT_QUERY_OTHER_TEMPLATE);
+    }
+    if (q->text != NULL && strcmp(q->text, text) != 0) {
+        return 0;
+    }
+    vault_template_stats_t *t = vault_query_template(res, text);
+    if (t == NULL) {
+        return -1;
+    }
+    res->matched++;
+    res->power_hist[power]++;
+    vault_query_template_add(t, power, time_stamp, rec);
+    vault_query_offer_top(res, rec);
+    return 0;
+}
+
+static inline int vault_query_merge(vault_query_result_t *dst, const vault_query_result_t *src) {
+    dst->records += src->records;
+    dst->matched += src->matched;
+    dst->malformed += src->malformed;
+    dst->bad_signature += src->bad_signature;
+    dst->bad_power += src->bad_power;
+    for (int p = 0; p < VAULT_QUERY_MAX_POWER; p++) {
+        dst->power_hist[p] += src->power_hist[p];
+    }
+    for (size_t i = 0; i < src->n_templates; i++) {
+        const vault_template_stats_t *s = &src->templates[i];
+        vault_template_stats_t *d = vault_query_template(dst, s->text);
+        if (d == NULL) {
+            return -1;
+        }
+        d->count += s->count;
+        for (int p = 0; p < VAULT_QUERY_MAX_POWER; p++) {
+            d->power_hist[p] += s->power_hist[p];
+        }
+        if (s->best_power > d->best_power || (s->best_power == d->best_power && memcmp(s->best_rec, d->best_rec, VAULT_RECORD_SIZE) < 0)) {
+            d->best_power = s->best_power;
+            memcpy(d->best_rec, s->best_rec, VAULT_RECORD_SIZE);
+        }
+        if (s->first_time < d->first_time) d->first_time = s->first_time;
+        if (s->last_time > d->last_time) d->last_time = s->last_time;
+    }
+    for (int i = 0; i < src->n_top; i++) {
+        vault_query_offer_top(dst, src->top[i]);
+    }
+    return 0;
+}
+
+// the power a coin with this SHA1 secure hash is reported with (leading zero bits after the signature)
+static inline int vault_query_hash_power(const u32_t hash[5]) {
+    int n = 0;
+    while (n < 99 && ((hash[1 + n / 32] >> (31 - n % 32)) & 1u) == 0u) {
+        n++;
+    }
+    return n;
+}
+
+// hashes the n buffered records and hands the good ones to vault_query_record()
+static inline int vault_query_verify_batch(vault_query_result_t *res, const vault_query_t *q,
+                                           u08_t (*recs)[VAULT_RECORD_SIZE], u32_t (*coins)[14],
+                                           u32_t (*hashes)[5], size_t n) {
+    sha1_batch((const u32_t (*)[14])coins, n, hashes);
+    for (size_t i = 0; i < n; i++) {
+        if (hashes[i][0] != 0xAAD20250u) {
+            res->records++;
+            res->bad_signature++;
+        } else if (vault_query_hash_power(hashes[i]) != vault_record_power(recs[i])) {
+            res->records++;
+            res->bad_power++;
+        } else if (vault_query_record(res, q, recs[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// processes the lines of path that start in [start,end)
+static inline int vault_query_range(const char *path, long start, long end, const vault_query_t *q, vault_query_result_t *res) {
+    vault_reader_t r;
+    const u08_t *line;
+    size_t len, n_batch = 0;
+    long pos = start;
+    u08_t (*recs)[VAULT_RECORD_SIZE] = NULL;
+    u32_t (*coins)[14] = NULL;
+    u32_t (*hashes)[5] = NULL;
+
+    if (q->verify) {
+        recs = (u08_t (*)[VAULT_RECORD_SIZE])malloc(VAULT_QUERY_VERIFY_BATCH * sizeof(*recs));
+        coins = (u32_t (*)[14])malloc(VAULT_QUERY_VERIFY_BATCH * sizeof(*coins));
+        hashes = (u32_t (*)[5])malloc(VAULT_QUERY_VERIFY_BATCH * sizeof(*hashes));
+    }
+    if ((q->verify && (recs == NULL || coins == NULL || hashes == NULL)) || vault_reader_open(&r, path) != 0) {
+        free(recs);
+        free(coins);
+        free(hashes);
+        return -1;
+    }
+    if (start > 0) {
+        // back up one byte so that a line beginning exactly at start is not skipped
+        fseek(r.fp, start - 1, SEEK_SET);
+        pos = start - 1;
+        if ((line = vault_reader_next(&r, &len)) != NULL) {
+            pos += (long)len;
+        }
+    }
+    int result = 0;
+    while (result == 0 && pos < end && (line = vault_reader_next(&r, &len)) != NULL) {
+        pos += (long)len;
+        if (!vault_record_is_valid(line, len)) {
+            if (!(len == 1 && line[0] == '\n')) {
+                res->malformed++;
+            }
+            continue;
+        }
+        if (!q->verify) {
+            result = vault_query_record(res, q, line);
+            continue;
+        }
+        memcpy(recs[n_batch], line, VAULT_RECORD_SIZE);
+        vault_record_to_coin(line, coins[n_batch]);
+        if (++n_batch == VAULT_QUERY_VERIFY_BATCH) {
+            result = vault_query_verify_batch(res, q, recs, coins, hashes, n_batch);
+            n_batch = 0;
+        }
+    }
+    if (result == 0 && n_batch > 0) {
+        result = vault_query_verify_batch(res, q, recs, coins, hashes, n_batch);
+    }
+    vault_reader_close(&r);
+    free(recs);
+    free(coins);
+    free(hashes);
+    return result;
+}
+
+static inline int vault_query_file(const char *path, const vault_query_t *q, vault_query_result_t *res) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+
+    int n_ranges = 1;
+#ifdef _OPENMP
+    n_ranges = (q->threads > 0) ? q->threads : omp_get_max_threads();
+    if ((long)n_ranges * (long)VAULT_QUERY_MIN_RANGE > size) {
+        n_ranges = (int)(size / (long)VAULT_QUERY_MIN_RANGE) + 1;
+    }
+#endif
+    if (n_ranges == 1) {
+        return vault_query_range(path, 0, size, q, res);
+    }
+
+    vault_query_result_t *partial = (vault_query_result_t *)calloc((size_t)n_ranges, sizeof(vault_query_result_t));
+    if (partial == NULL) {
+        return -1;
+    }
+    int failed = 0;
+    #pragma omp parallel for num_threads(n_ranges) schedule(static, 1) reduction(|:failed)
+    for (int i = 0; i < n_ranges; i++) {
+        long start = size / n_ranges * i;
+        long end = (i == n_ranges - 1) ? size : size / n_ranges * (i + 1);
+        if (vault_query_result_init(&partial[i], q->top_n) != 0 || vault_query_range(path, start, end, q, &partial[i]) != 0) {
+            failed = 1;
+        }
+    }
+    for (int i = 0; i < n_ranges; i++) {
+        if (!failed && vault_query_merge(res, &partial[i]) != 0) {
+            failed = 1;
+        }
+        vault_query_result_free(&partial[i]);
+    }
+    free(partial);
+    return failed ? -1 : 0;
+}
+
+//
+// machine-readable output
+//
+
+static inline void vault_query_print_hex(FILE *out, const u08_t *rec) {
+    for (int i = 0; i < 55; i++) {
+        fprintf(out, "%02x", rec[4 + i]);
+    }
+}
+
+static inline void vault_query_print_string(FILE *out, const char *s, int json) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        if (*s == '"') {
+            fputs(json ? "\\\"" : "\"\"", out);
+        } else if (*s == '\\' && json) {
+            fputs("\\\\", out);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static inline void vault_query_print_top(FILE *out, const vault_query_result_t *res, int json) {
+    char text[29];
+    if (!json) {
+        fprintf(out, "rank,power,time,text,coin_hex\n");
+    } else {
+        fprintf(out, "[");
+    }
+    for (int i = 0; i < res->n_top; i++) {
+        const u08_t *rec = res->top[i];
+        if (vault_record_custom_text(rec, text) < 0) {
+            strcpy(text, VAULT_QUERY_OTHER_TEMPLATE);
+        }
+        if (json) {
+            fprintf(out, "%s\n  {\"rank\": %d, \"power\": %d, \"time\": %u, \"text\": ", i ? "," : "", i + 1, vault_record_power(rec), vault_record_timestamp(rec));
+            vault_query_print_string(out, text, 1);
+            fprintf(out, ", \"coin_hex\": \"");
+            vault_query_print_hex(out, rec);
+            fprintf(out, "\"}");
+        } else {
+            fprintf(out, "%d,%d,%u,", i + 1, vault_record_power(rec), vault_record_timestamp(rec));
+            vault_query_print_string(out, text, 0);
+            fputc(',', out);
+            vault_query_print_hex(out, rec);
+            fputc('\n', out);
+        }
+    }
+    if (json) {
+        fprintf(out, "\n]\n");
+    }
+}
+
+// one row per (template, power) pair; without per_template the totals are printed (text "*")
+static inline void vault_query_print_histogram(FILE *out, const vault_query_result_t *res, int per_template, int json) {
+    size_t rows = per_template ? res->n_templates : 1;
+    int first = 1;
+    fprintf(out, json ? "[" : "text,power,count\n");
+    for (size_t t = 0; t < rows; t++) {
+        const u64_t *hist = per_template ? res->templates[t].power_hist : res->power_hist;
+        const char *text = per_template ? res->templates[t].text : "*";
+        for (int p = 0; p < VAULT_QUERY_MAX_POWER; p++) {
+            if (hist[p] == 0) {
+                continue;
+            }
+            if (json) {
+                fprintf(out, "%s\n  {\"text\": ", first ? "" : ",");
+                vault_query_print_string(out, text, 1);
+                fprintf(out, ", \"power\": %d, \"count\": %lu}", p, hist[p]);
+            } else {
+                vault_query_print_string(out, text, 0);
+                fprintf(out, ",%d,%lu\n", p, hist[p]);
+            }
+            first = 0;
+        }
+    }
+    if (json) {
+        fprintf(out, "\n]\n");
+    }
+}
+
+static inline void vault_query_print_templates(FILE *out, const vault_query_result_t *res, int json) {
+    fprintf(out, json ? "[" : "text,count,best_power,first_time,last_time,best_coin_hex\n");
+    for (size_t i = 0; i < res->n_templates; i++) {
+        const vault_template_stats_t *t = &res->templates[i];
+        if (json) {
+            fprintf(out, "%s\n  {\"text\": ", i ? "," : "");
+            vault_query_print_string(out, t->text, 1);
+            fprintf(out, ", \"count\": %lu, \"best_power\": %d, \"first_time\": %u, \"last_time\": %u, \"best_coin_hex\": \"",
+                    t->count, t->best_power, t->first_time, t->last_time);
+            vault_query_print_hex(out, t->best_rec);
+            fprintf(out, "\"}");
+        } else {
+            vault_query_print_string(out, t->text, 0);
+            fprintf(out, ",%lu,%d,%u,%u,", t->count, t->best_power, t->first_time, t->last_time);
+            vault_query_print_hex(out, t->best_rec);
+            fputc('\n', out);
+        }
+    }
+    if (json) {
+        fprintf(out, "\n]\n");
+    }
+}
+
+static inline void vault_query_print_summary(FILE *out, const vault_query_result_t *res, int json) {
+    int best = -1;
+    for (int p = VAULT_QUERY_MAX_POWER - 1; p >= 0 && best < 0; p--) {
+        if (res->power_hist[p] != 0) {
+            best = p;
+        }
+    }
+    if (json) {
+        fprintf(out, "{\"records\": %lu, \"matched\": %lu, \"malformed\": %lu, \"bad_signature\": %lu, \"bad_power\": %lu, \"templates\": %zu, \"best_power\": %d}\n",
+                res->records, res->matched, res->malformed, res->bad_signature, res->bad_power, res->n_templates, best);
+    } else {
+        fprintf(out, "records,matched,malformed,bad_signature,bad_power,templates,best_power\n%lu,%lu,%lu,%lu,%lu,%zu,%d\n",
+                res->records, res->matched, res->malformed, res->bad_signature, res->bad_power, res->n_templates, best);
+    }
+}
+
+#endif
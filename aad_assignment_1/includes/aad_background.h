@@ -0,0 +1,250 @@
+#ifndef AAD_BACKGROUND_H
+#define AAD_BACKGROUND_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "aad_data_types.h"
+
+//
+// background mining mode for shared machines
+//
+// environment variables (the mode is on when any of them is set):
+//   DETI_BACKGROUND  --- idle (SCHED_IDLE, falling back to nice 19) or nice (nice 19 only)
+//   DETI_RATE_CAP    --- total hash rate cap in M/s
+//   DETI_CPU_BUDGET  --- percentage of the time each mining thread may run (1..100)
+//   DETI_MAX_LOAD    --- back off while the 1-minute load average of the other processes exceeds
+//                        this many runnable tasks per CPU (default 1.0, 0 = ignore)
+//   DETI_MAX_PSI     --- back off while /proc/pressure/cpu "some avg10" exceeds this percentage
+//                        (default 20, 0 = ignore)
+//
+// the limits are enforced by duty cycling: after each nonce chunk a mining thread sleeps long
+// enough for its busy fraction to match the current duty (background_pause); the reporter thread
+// recomputes the duty every second (background_control) from the measured rate, the CPU budget and
+// a back-off factor that halves while the machine is under pressure and recovers slowly afterwards
+//
+
+#define BACKGROUND_CONTROL_PERIOD  1.0     // seconds between duty updates
+#define BACKGROUND_MIN_DUTY        0.02
+#define BACKGROUND_MAX_SLEEP       1.0     // longest single pause (seconds)
+#define BACKGROUND_SLEEP_SLICE_NS  50000000L
+
+typedef enum {
+    BACKGROUND_PRIORITY_NORMAL = 0,
+    BACKGROUND_PRIORITY_NICE,
+    BACKGROUND_PRIORITY_IDLE
+} background_priority_t;
+
+typedef struct {
+    int enabled;
+    background_priority_t priority;
+    double rate_cap;        // hashes per second (0 = no cap)
+    double cpu_budget;      // fraction of time (1 = no budget)
+    double max_load;        // runnable tasks per CPU of the other processes (0 = ignore)
+    double max_psi;         // percent (0 = ignore)
+    int n_cpus;
+    double cap_duty;        // duty that keeps the rate at the cap
+    double backoff;         // 1 = no pressure, halves under pressure
+    volatile double duty;   // duty the mining threads follow
+    const char *reason;     // what limits the duty right now
+    double load;            // last samples (for the progress line)
+    double psi;
+} background_t;
+
+static inline double background_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static inline double background_env(const char *name, double fallback, int *given) {
+    const char *value = getenv(name);
+
+    if (value == NULL || value[0] == '\0') {
+        return fallback;
+    }
+    *given = 1;
+    return atof(value);
+}
+
+static inline void background_init(background_t *bg) {
+    const char *mode = getenv("DETI_BACKGROUND");
+    int given = 0;
+
+    memset(bg, 0, sizeof(*bg));
+    if (mode != NULL && mode[0] != '\0' && strcmp(mode, "0") != 0 && strcmp(mode, "off") != 0) {
+        bg->priority = (strcmp(mode, "nice") == 0) ? BACKGROUND_PRIORITY_NICE : BACKGROUND_PRIORITY_IDLE;
+        given = 1;
+    }
+    bg->rate_cap = 1e6 * background_env("DETI_RATE_CAP", 0.0, &given);
+    bg->cpu_budget = background_env("DETI_CPU_BUDGET", 100.0, &given) / 100.0;
+    bg->max_load = background_env("DETI_MAX_LOAD", 1.0, &given);
+    bg->max_psi = background_env("DETI_MAX_PSI", 20.0, &given);
+    if (bg->rate_cap < 0.0) {
+        bg->rate_cap = 0.0;
+    }
+    if (bg->cpu_budget < BACKGROUND_MIN_DUTY || bg->cpu_budget > 1.0) {
+        bg->cpu_budget = (bg->cpu_budget > 1.0) ? 1.0 : BACKGROUND_MIN_DUTY;
+    }
+    bg->enabled = given;
+    bg->n_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (bg->n_cpus < 1) {
+        bg->n_cpus = 1;
+    }
+    bg->cap_duty = 1.0;
+    bg->backoff = 1.0;
+    bg->duty = bg->cpu_budget;
+    bg->reason = (bg->cpu_budget < 1.0) ? "budget" : "full";
+}
+
+static inline void background_print(const background_t *bg) {
+    if (!bg->enabled) {
+        return;
+    }
+    printf("   Background: %s", (bg->priority == BACKGROUND_PRIORITY_IDLE) ? "SCHED_IDLE" :
+                                (bg->priority == BACKGROUND_PRIORITY_NICE) ? "nice 19" : "normal priority");
+    if (bg->rate_cap > 0.0) {
+        printf(", cap %.2f M/s", bg->rate_cap / 1e6);
+    }
+    if (bg->cpu_budget < 1.0) {
+        printf(", CPU budget %.0f%%", 100.0 * bg->cpu_budget);
+    }
+    printf(", back-off at load %.2f/CPU, PSI %.0f%%\n", bg->max_load, bg->max_psi);
+}
+
+//
+// mining thread side
+//
+
+// lowers the priority of the calling thread (each OpenMP thread calls this once)
+static inline void background_enter_thread(const background_t *bg) {
+    if (!bg->enabled || bg->priority == BACKGROUND_PRIORITY_NORMAL) {
+        return;
+    }
+#ifdef SCHED_IDLE
+    if (bg->priority == BACKGROUND_PRIORITY_IDLE) {
+        struct sched_param param = {0};
+        if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) == 0) {
+            return;
+        }
+    }
+#endif
+    // on Linux the nice value is per thread
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19) != 0) {
+        (void)nice(19);
+    }
+}
+
+// called between nonce chunks: sleeps for the idle part of the duty cycle; *mark holds the end of
+// the previous pause (0 before the first chunk)
+static inline void background_pause(const background_t *bg, double *mark, const volatile int *stop) {
+    double now, duty;
+
+    if (!bg->enabled) {
+        return;
+    }
+    now = background_now();
+    duty = bg->duty;
+    if (*mark > 0.0 && duty < 1.0) {
+        double pause = (now - *mark) * (1.0 - duty) / duty;
+        if (pause > BACKGROUND_MAX_SLEEP) {
+            pause = BACKGROUND_MAX_SLEEP;
+        }
+        double until = now + pause;
+        while (!*stop && (now = background_now()) < until) {
+            double left = until - now;
+            struct timespec nap = {0, (left * 1e9 < BACKGROUND_SLEEP_SLICE_NS) ? (long)(left * 1e9) : BACKGROUND_SLEEP_SLICE_NS};
+            nanosleep(&nap, NULL);
+        }
+    }
+    *mark = background_now();
+}
+
+//
+// controller side (reporter thread)
+//
+
+static inline double background_read_load(void) {
+    double load = 0.0;
+    FILE *f = fopen("/proc/loadavg", "r");
+
+    if (f != NULL) {
+        if (fscanf(f, "%lf", &load) != 1) {
+            load = 0.0;
+        }
+        fclose(f);
+    }
+    return load;
+}
+
+// "some avg10" of /proc/pressure/cpu (percentage of time some runnable task waited for a CPU)
+static inline double background_read_psi(void) {
+    double psi = 0.0;
+    FILE *f = fopen("/proc/pressure/cpu", "r");
+
+    if (f != NULL) {
+        if (fscanf(f, "some avg10=%lf", &psi) != 1) {
+            psi = 0.0;
+        }
+        fclose(f);
+    }
+    return psi;
+}
+
+// updates the duty from the rate measured over the last control period and the machine pressure;
+// own_threads are the mining threads (removed from the load average)
+static inline void background_control(background_t *bg, double rate, int own_threads) {
+    double duty = bg->duty;
+    int pressure = 0;
+
+    if (!bg->enabled) {
+        return;
+    }
+    // rate cap: the rate scales with the duty, so move the duty by the ratio cap / rate
+    if (bg->rate_cap > 0.0 && rate > 0.0) {
+        bg->cap_duty *= bg->rate_cap / rate;
+        if (bg->cap_duty > 1.0) {
+            bg->cap_duty = 1.0;
+        }
+        if (bg->cap_duty < BACKGROUND_MIN_DUTY) {
+            bg->cap_duty = BACKGROUND_MIN_DUTY;
+        }
+    }
+
+    bg->load = background_read_load() - (double)own_threads * duty;
+    bg->psi = background_read_psi();
+    if (bg->max_load > 0.0 && bg->load / (double)bg->n_cpus > bg->max_load) {
+        pressure = 1;
+    }
+    if (bg->max_psi > 0.0 && bg->psi > bg->max_psi) {
+        pressure = 2;
+    }
+    if (pressure) {
+        bg->backoff *= 0.5;
+        if (bg->backoff < BACKGROUND_MIN_DUTY) {
+            bg->backoff = BACKGROUND_MIN_DUTY;
+        }
+    } else if (bg->backoff < 1.0) {
+        bg->backoff = (bg->backoff * 1.25 > 1.0) ? 1.0 : bg->backoff * 1.25;
+    }
+
+    duty = bg->cpu_budget;
+    bg->reason = (bg->cpu_budget < 1.0) ? "budget" : "full";
+    if (bg->cap_duty < duty) {
+        duty = bg->cap_duty;
+        bg->reason = "cap";
+    }
+    if (bg->backoff < 1.0) {
+        duty *= bg->backoff;
+        bg->reason = (pressure == 2) ? "psi" : (pressure == 1) ? "load" : "recovering";
+    }
+    bg->duty = (duty < BACKGROUND_MIN_DUTY) ? BACKGROUND_MIN_DUTY : duty;
+}
+
+#endif
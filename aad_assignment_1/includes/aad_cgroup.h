@@ -0,0 +1,289 @@
+#ifndef AAD_CGROUP_H
+#define AAD_CGROUP_H
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "aad_data_types.h"
+
+//
+// CPU limits of the cgroup the miner runs in (containers, systemd slices)
+//
+// the usable CPU count is the smaller of
+//   the cpuset  --- CPUs in the process affinity mask (sched_getaffinity already reflects cpuset.cpus)
+//   the quota   --- ceil(quota / period) of the tightest cpu.max (cgroup v2) or cpu.cfs_quota_us
+//                   (cgroup v1) between the miner's cgroup and the root of the hierarchy
+//
+// with more threads than that, CFS throttles the whole group at the end of every period and the
+// hash rate becomes a sawtooth; cpu.stat counts these throttled periods
+//
+// OMP_NUM_THREADS, when set, always wins over the detected limit
+//
+
+#define CGROUP_PATH_SIZE  512
+
+typedef struct {
+    u64_t periods;          // enforcement periods elapsed
+    u64_t throttled;        // periods in which the group was throttled
+    u64_t throttled_usec;   // total time spent throttled
+} cgroup_cpu_stat_t;
+
+typedef struct {
+    int version;                    // 2 (cgroup v2), 1 (cgroup v1 cpu controller) or 0 (none found)
+    char mount[CGROUP_PATH_SIZE];   // mount point of the hierarchy
+    char dir[CGROUP_PATH_SIZE];     // the miner's cgroup directory
+    char limit_dir[CGROUP_PATH_SIZE]; // directory of the tightest quota (its cpu.stat counts the throttling)
+    double quota_cpus;              // CPUs granted by the quota (0 = no quota)
+    int cpuset_cpus;                // CPUs in the affinity mask
+} cgroup_cpu_t;
+
+// finds the mount point of the cgroup v2 hierarchy, or of the v1 hierarchy with the cpu controller
+static inline int cgroup_find_mount(int version, char *mount, size_t size) {
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    char line[1024];
+    int found = 0;
+
+    if (f == NULL) {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        char point[CGROUP_PATH_SIZE], fstype[64], options[256];
+        const char *sep = strstr(line, " - ");
+        if (sep == NULL || sscanf(line, "%*s %*s %*s %*s %511s", point) != 1 ||
+            sscanf(sep + 3, "%63s %*s %255s", fstype, options) != 2) {
+            continue;
+        }
+        if (version == 2 && strcmp(fstype, "cgroup2") == 0) {
+            found = 1;
+        } else if (version == 1 && strcmp(fstype, "cgroup") == 0) {
+            // the super options list the controllers: look for exactly "cpu"
+            for (char *tok = strtok(options, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                if (strcmp(tok, "cpu") == 0) {
+                    found = 1;
+                    break;
+                }
+            }
+        }
+        if (found) {
+            snprintf(mount, size, "%s", point);
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// finds the path of the process inside the hierarchy ("0::/path" for v2, "N:cpu,cpuacct:/path" for v1)
+static inline int cgroup_find_path(int version, char *path, size_t size) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    char line[1024];
+    int found = 0;
+
+    if (f == NULL) {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        char *first = strchr(line, ':');
+        char *second = (first != NULL) ? strchr(first + 1, ':') : NULL;
+        if (second == NULL) {
+            continue;
+        }
+        *first = '\0';
+        *second = '\0';
+        second[1 + strcspn(second + 1, "\n")] = '\0';
+        if (version == 2 && strcmp(line, "0") == 0 && first[1] == '\0') {
+            found = 1;
+        } else if (version == 1) {
+            for (char *tok = strtok(first + 1, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                if (strcmp(tok, "cpu") == 0) {
+                    found = 1;
+                    break;
+                }
+            }
+        }
+        if (found) {
+            snprintf(path, size, "%s", second + 1);
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// the cpu controller must be enabled in a v2 hierarchy (hybrid hosts keep it in v1)
+static inline int cgroup_v2_has_cpu(const char *mount) {
+    char path[CGROUP_PATH_SIZE + 32], name[64];
+    int found = 0;
+
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", mount);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    while (!found && fscanf(f, "%63s", name) == 1) {
+        found = (strcmp(name, "cpu") == 0);
+    }
+    fclose(f);
+    return found;
+}
+
+// quota of one cgroup directory in CPUs (0 = unlimited, -1 = no such file)
+static inline double cgroup_read_quota(int version, const char *dir) {
+    char path[CGROUP_PATH_SIZE + 32];
+    FILE *f;
+    double quota = -1.0;
+
+    if (version == 2) {
+        char max[32];
+        long long period;
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        if ((f = fopen(path, "r")) == NULL) {
+            return -1.0;
+        }
+        if (fscanf(f, "%31s %lld", max, &period) == 2) {
+            quota = (strcmp(max, "max") == 0 || period <= 0) ? 0.0 : atof(max) / (double)period;
+        }
+        fclose(f);
+        return quota;
+    }
+    long long us = 0, period = 0;
+    snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+    if ((f = fopen(path, "r")) == NULL) {
+        return -1.0;
+    }
+    if (fscanf(f, "%lld", &us) != 1) {
+        us = -1;
+    }
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+    if ((f = fopen(path, "r")) == NULL) {
+        return -1.0;
+    }
+    if (fscanf(f, "%lld", &period) != 1) {
+        period = 0;
+    }
+    fclose(f);
+    return (us <= 0 || period <= 0) ? 0.0 : (double)us / (double)period;
+}
+
+// re-reads the cpuset and the tightest quota along the path to the root of the hierarchy
+static inline void cgroup_cpu_refresh(cgroup_cpu_t *cg) {
+    cpu_set_t allowed;
+    char dir[CGROUP_PATH_SIZE];
+
+    CPU_ZERO(&allowed);
+    cg->cpuset_cpus = (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) ? CPU_COUNT(&allowed) : 0;
+    cg->quota_cpus = 0.0;
+    cg->limit_dir[0] = '\0';
+    if (cg->version == 0) {
+        return;
+    }
+    snprintf(dir, sizeof(dir), "%s", cg->dir);
+    for (;;) {
+        double quota = cgroup_read_quota(cg->version, dir);
+        if (quota > 0.0 && (cg->quota_cpus == 0.0 || quota < cg->quota_cpus)) {
+            cg->quota_cpus = quota;
+            snprintf(cg->limit_dir, sizeof(cg->limit_dir), "%s", dir);
+        }
+        char *slash = strrchr(dir, '/');
+        if (strlen(dir) <= strlen(cg->mount) || slash == NULL || slash == dir) {
+            break;  // reached the root of the hierarchy
+        }
+        *slash = '\0';
+    }
+}
+
+//
+// discovers the miner's cgroup (v2 first, then the v1 cpu controller) and reads its limits
+//
+static inline void cgroup_cpu_init(cgroup_cpu_t *cg) {
+    char path[CGROUP_PATH_SIZE];
+
+    memset(cg, 0, sizeof(*cg));
+    for (int version = 2; version >= 1; version--) {
+        if (!cgroup_find_mount(version, cg->mount, sizeof(cg->mount)) || !cgroup_find_path(version, path, sizeof(path))) {
+            continue;
+        }
+        if (version == 2 && !cgroup_v2_has_cpu(cg->mount)) {
+            continue;
+        }
+        // inside a container the cgroup namespace root is the mount itself, so the path may not exist
+        snprintf(cg->dir, sizeof(cg->dir), "%.255s%.255s", cg->mount, (strcmp(path, "/") == 0) ? "" : path);
+        if (access(cg->dir, F_OK) != 0) {
+            snprintf(cg->dir, sizeof(cg->dir), "%s", cg->mount);
+        }
+        cg->version = version;
+        break;
+    }
+    if (cg->version == 0) {
+        cg->mount[0] = '\0';
+    }
+    cgroup_cpu_refresh(cg);
+}
+
+// throttling counters of the cgroup that holds the quota (all zero without a quota)
+static inline void cgroup_cpu_sample(const cgroup_cpu_t *cg, cgroup_cpu_stat_t *s) {
+    char path[CGROUP_PATH_SIZE + 32], key[64];
+    unsigned long long value;
+
+    memset(s, 0, sizeof(*s));
+    if (cg->limit_dir[0] == '\0') {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/cpu.stat", cg->limit_dir);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+    while (fscanf(f, "%63s %llu", key, &value) == 2) {
+        if (strcmp(key, "nr_periods") == 0) {
+            s->periods = value;
+        } else if (strcmp(key, "nr_throttled") == 0) {
+            s->throttled = value;
+        } else if (strcmp(key, "throttled_usec") == 0) {
+            s->throttled_usec = value;              // v2
+        } else if (strcmp(key, "throttled_time") == 0) {
+            s->throttled_usec = value / 1000ULL;    // v1 reports nanoseconds
+        }
+    }
+    fclose(f);
+}
+
+// number of CPUs the miner may keep busy (at least 1)
+static inline int cgroup_cpu_limit(const cgroup_cpu_t *cg) {
+    int cpus = (cg->cpuset_cpus > 0) ? cg->cpuset_cpus : 1;
+
+    if (cg->quota_cpus > 0.0) {
+        int quota = (int)cg->quota_cpus;
+        if ((double)quota < cg->quota_cpus) {
+            quota++;    // 1.5 CPUs still keep two threads busy half of the time
+        }
+        if (quota < cpus) {
+            cpus = quota;
+        }
+    }
+    return (cpus > 0) ? cpus : 1;
+}
+
+// thread count: OMP_NUM_THREADS if given, otherwise default_threads capped by the cgroup limit
+static inline int cgroup_cpu_size_threads(const cgroup_cpu_t *cg, int default_threads) {
+    int limit = cgroup_cpu_limit(cg);
+
+    if (getenv("OMP_NUM_THREADS") != NULL) {
+        return default_threads;
+    }
+    return (default_threads < limit) ? default_threads : limit;
+}
+
+static inline void cgroup_cpu_print(const cgroup_cpu_t *cg) {
+    if (cg->version == 0) {
+        printf("   Cgroup: not found, cpuset %d CPUs\n", cg->cpuset_cpus);
+    } else if (cg->quota_cpus > 0.0) {
+        printf("   Cgroup v%d: cpuset %d CPUs, quota %.2f CPUs (%s)\n", cg->version, cg->cpuset_cpus,
+               cg->quota_cpus, cg->limit_dir);
+    } else {
+        printf("   Cgroup v%d: cpuset %d CPUs, no CPU quota\n", cg->version, cg->cpuset_cpus);
+    }
+}
+
+#endif
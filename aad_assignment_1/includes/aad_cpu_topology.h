@@ -0,0 +1,379 @@
+#ifndef AAD_CPU_TOPOLOGY_H
+#define AAD_CPU_TOPOLOGY_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aad_data_types.h"
+#include "aad_thread_stats.h"
+
+//
+// CPU topology discovery (Linux sysfs) and thread placement for the OpenMP miners
+//
+// the placement policy is read from the DETI_AFFINITY environment variable:
+//   none           --- no pinning, the OpenMP runtime decides (default)
+//   cores          --- one thread per physical core (the first SMT sibling of each core)
+//   smt            --- every hardware thread; the first SMT sibling of every core is used before
+//                      any second sibling, so fewer threads than CPUs still land on distinct cores
+//   POLICY:N[,N]   --- restrict cores or smt to the listed NUMA nodes (e.g. cores:0 or smt:0,1)
+//
+// unless OMP_NUM_THREADS is set, a pinned run uses one thread per CPU of the placement; with more
+// threads than CPUs the placement wraps around
+//
+// only CPUs in the process affinity mask are considered (taskset, cgroup cpusets, containers)
+//
+
+#define CPU_TOPOLOGY_ENV        "DETI_AFFINITY"
+#define CPU_TOPOLOGY_MAX_NODES  64
+
+typedef enum {
+    CPU_POLICY_NONE = 0,
+    CPU_POLICY_CORES,
+    CPU_POLICY_SMT
+} cpu_policy_t;
+
+typedef struct {
+    int cpu;        // logical CPU number
+    int core;       // lowest logical CPU among the SMT siblings of its core (unique system-wide)
+    int package;    // physical_package_id (socket)
+    int node;       // NUMA node
+    int smt;        // index of this CPU among the SMT siblings of its core (0 = first)
+} cpu_info_t;
+
+typedef struct {
+    cpu_info_t *cpus;
+    int n_cpus;
+    int n_cores;
+    int n_packages;
+    int n_nodes;
+} cpu_topology_t;
+
+typedef struct {
+    cpu_policy_t policy;
+    u64_t node_mask;        // 0 = all nodes
+    char name[64];          // policy as given (for reports)
+    cpu_topology_t topology;
+    int *cpus;              // CPU of each placement slot (thread t uses cpus[t % n_cpus])
+    int n_cpus;
+} cpu_placement_t;
+
+static inline int cpu_topology_read_int(int cpu, const char *file, int fallback) {
+    char path[128];
+    int value;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, file);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return fallback;
+    }
+    if (fscanf(f, "%d", &value) != 1) {
+        value = fallback;
+    }
+    fclose(f);
+    return value;
+}
+
+//
+// the core of a CPU, named by its first SMT sibling: core_id is only unique within a die on some
+// multi-die parts, so two cores of one package may share it; the sibling lists are exact
+// (core_cpus_list on recent kernels, thread_siblings_list before); without them every CPU is its
+// own core
+//
+static inline int cpu_topology_read_core(int cpu) {
+    static const char *files[] = { "core_cpus_list", "thread_siblings_list" };
+    char path[128];
+    int first;
+
+    for (int i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, files[i]);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        int ok = (fscanf(f, "%d", &first) == 1);
+        fclose(f);
+        if (ok) {
+            return first;
+        }
+    }
+    return cpu;
+}
+
+// parses a sysfs CPU list ("0-3,8,10-11") and stores value into map[cpu] for every CPU listed
+static inline void cpu_topology_parse_list(const char *list, int *map, int map_size, int value) {
+    const char *p = list;
+
+    while (*p != '\0' && *p != '\n') {
+        char *next;
+        long first = strtol(p, &next, 10);
+        long last = first;
+        if (next == p) {
+            break;
+        }
+        p = next;
+        if (*p == '-') {
+            last = strtol(p + 1, &next, 10);
+            p = next;
+        }
+        for (long c = first; c <= last && c < map_size; c++) {
+            if (c >= 0) {
+                map[c] = value;
+            }
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+}
+
+static inline int cpu_topology_load(cpu_topology_t *topo) {
+    cpu_set_t allowed;
+    int node_of[CPU_SETSIZE];
+    char line[4096];
+
+    memset(topo, 0, sizeof(*topo));
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+    topo->cpus = (cpu_info_t *)calloc((size_t)CPU_COUNT(&allowed), sizeof(cpu_info_t));
+    if (topo->cpus == NULL) {
+        return -1;
+    }
+
+    // NUMA nodes (a kernel without NUMA support has no node directories: everything is node 0)
+    memset(node_of, 0, sizeof(node_of));
+    topo->n_nodes = 1;
+    for (int node = 0; node < CPU_TOPOLOGY_MAX_NODES; node++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        if (fgets(line, sizeof(line), f) != NULL) {
+            cpu_topology_parse_list(line, node_of, CPU_SETSIZE, node);
+            if (node + 1 > topo->n_nodes) {
+                topo->n_nodes = node + 1;
+            }
+        }
+        fclose(f);
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        cpu_info_t *info = &topo->cpus[topo->n_cpus];
+        info->cpu = cpu;
+        info->core = cpu_topology_read_core(cpu);
+        info->package = cpu_topology_read_int(cpu, "physical_package_id", 0);
+        info->node = node_of[cpu];
+        info->smt = 0;
+        // CPUs are visited in increasing order, so the siblings seen so far come first
+        for (int j = 0; j < topo->n_cpus; j++) {
+            if (topo->cpus[j].core == info->core) {
+                info->smt++;
+            }
+        }
+        if (info->smt == 0) {
+            topo->n_cores++;
+        }
+        if (info->package + 1 > topo->n_packages) {
+            topo->n_packages = info->package + 1;
+        }
+        topo->n_cpus++;
+    }
+    return (topo->n_cpus > 0) ? 0 : -1;
+}
+
+static inline void cpu_topology_free(cpu_topology_t *topo) {
+    free(topo->cpus);
+    topo->cpus = NULL;
+    topo->n_cpus = 0;
+}
+
+// parses "none", "cores", "smt", optionally followed by ":node[,node...]"; returns 0 on success
+static inline int cpu_policy_parse(const char *text, cpu_policy_t *policy, u64_t *node_mask) {
+    const char *colon = strchr(text, ':');
+    size_t len = (colon != NULL) ? (size_t)(colon - text) : strlen(text);
+
+    *node_mask = 0;
+    if (len == 4 && strncmp(text, "none", 4) == 0) {
+        *policy = CPU_POLICY_NONE;
+    } else if (len == 5 && strncmp(text, "cores", 5) == 0) {
+        *policy = CPU_POLICY_CORES;
+    } else if (len == 3 && strncmp(text, "smt", 3) == 0) {
+        *policy = CPU_POLICY_SMT;
+    } else {
+        return -1;
+    }
+    if (colon == NULL) {
+        return 0;
+    }
+    if (*policy == CPU_POLICY_NONE || colon[1] == '\0') {
+        return -1;
+    }
+    const char *p = colon + 1;
+    while (*p != '\0') {
+        char *next;
+        long node = strtol(p, &next, 10);
+        if (next == p || node < 0 || node >= CPU_TOPOLOGY_MAX_NODES || (*next != ',' && *next != '\0')) {
+            return -1;
+        }
+        *node_mask |= 1ULL << node;
+        p = (*next == ',') ? next + 1 : next;
+    }
+    return 0;
+}
+
+static inline int cpu_placement_compare(const void *a, const void *b) {
+    const cpu_info_t *x = (const cpu_info_t *)a;
+    const cpu_info_t *y = (const cpu_info_t *)b;
+
+    if (x->smt != y->smt) {
+        return (x->smt < y->smt) ? -1 : 1;
+    }
+    return (x->cpu < y->cpu) ? -1 : (x->cpu > y->cpu);
+}
+
+static inline void cpu_placement_free(cpu_placement_t *p) {
+    free(p->cpus);
+    p->cpus = NULL;
+    p->n_cpus = 0;
+    cpu_topology_free(&p->topology);
+}
+
+static inline void cpu_placement_disable(cpu_placement_t *p) {
+    cpu_placement_free(p);
+    p->policy = CPU_POLICY_NONE;
+    p->node_mask = 0;
+    snprintf(p->name, sizeof(p->name), "none");
+}
+
+//
+// builds the placement from DETI_AFFINITY; on any problem it warns and falls back to no pinning
+//
+static inline void cpu_placement_init(cpu_placement_t *p) {
+    const char *env = getenv(CPU_TOPOLOGY_ENV);
+
+    memset(p, 0, sizeof(*p));
+    snprintf(p->name, sizeof(p->name), "none");
+    if (env == NULL || env[0] == '\0') {
+        return;
+    }
+    if (cpu_policy_parse(env, &p->policy, &p->node_mask) != 0) {
+        fprintf(stderr, "Warning: unknown %s policy '%s' (use none, cores, smt, cores:N or smt:N,M); not pinning\n",
+                CPU_TOPOLOGY_ENV, env);
+        cpu_placement_disable(p);
+        return;
+    }
+    snprintf(p->name, sizeof(p->name), "%s", env);
+    if (p->policy == CPU_POLICY_NONE) {
+        return;
+    }
+    if (cpu_topology_load(&p->topology) != 0) {
+        fprintf(stderr, "Warning: cannot read the CPU topology from sysfs; not pinning\n");
+        cpu_placement_disable(p);
+        return;
+    }
+
+    cpu_info_t *chosen = (cpu_info_t *)malloc((size_t)p->topology.n_cpus * sizeof(cpu_info_t));
+    p->cpus = (int *)malloc((size_t)p->topology.n_cpus * sizeof(int));
+    if (chosen == NULL || p->cpus == NULL) {
+        free(chosen);
+        cpu_placement_disable(p);
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < p->topology.n_cpus; i++) {
+        const cpu_info_t *info = &p->topology.cpus[i];
+        if (p->node_mask != 0 && (info->node >= CPU_TOPOLOGY_MAX_NODES || !(p->node_mask & (1ULL << info->node)))) {
+            continue;
+        }
+        if (p->policy == CPU_POLICY_CORES && info->smt != 0) {
+            continue;
+        }
+        chosen[n++] = *info;
+    }
+    qsort(chosen, (size_t)n, sizeof(cpu_info_t), cpu_placement_compare);
+    for (int i = 0; i < n; i++) {
+        p->cpus[i] = chosen[i].cpu;
+    }
+    p->n_cpus = n;
+    free(chosen);
+
+    if (n == 0) {
+        fprintf(stderr, "Warning: %s=%s selects no usable CPU; not pinning\n", CPU_TOPOLOGY_ENV, env);
+        cpu_placement_disable(p);
+    }
+}
+
+// number of threads to start: the OpenMP default, or one per placement CPU when pinning and
+// OMP_NUM_THREADS was not given
+static inline int cpu_placement_threads(const cpu_placement_t *p, int default_threads) {
+    if (p->policy == CPU_POLICY_NONE || getenv("OMP_NUM_THREADS") != NULL) {
+        return default_threads;
+    }
+    return p->n_cpus;
+}
+
+// CPU of a thread, or -1 when not pinning
+static inline int cpu_placement_cpu(const cpu_placement_t *p, int thread_id) {
+    if (p->policy == CPU_POLICY_NONE || p->n_cpus == 0) {
+        return -1;
+    }
+    return p->cpus[thread_id % p->n_cpus];
+}
+
+// pins the calling thread to its placement CPU (no-op when not pinning)
+static inline int cpu_placement_pin(const cpu_placement_t *p, int thread_id) {
+    int cpu = cpu_placement_cpu(p, thread_id);
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return 0;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) ? 0 : -1;
+}
+
+static inline const cpu_info_t *cpu_placement_info(const cpu_placement_t *p, int cpu) {
+    for (int i = 0; i < p->topology.n_cpus; i++) {
+        if (p->topology.cpus[i].cpu == cpu) {
+            return &p->topology.cpus[i];
+        }
+    }
+    return NULL;
+}
+
+static inline void cpu_placement_print(const cpu_placement_t *p, int n_threads) {
+    if (p->policy == CPU_POLICY_NONE) {
+        printf("   Placement: %s (not pinned, %d threads)\n", p->name, n_threads);
+        return;
+    }
+    printf("   Placement: %s (%d threads on %d CPUs; host view: %d CPUs, %d cores, %d packages, %d nodes)\n",
+           p->name, n_threads, p->n_cpus, p->topology.n_cpus, p->topology.n_cores,
+           p->topology.n_packages, p->topology.n_nodes);
+}
+
+// per-thread throughput, to compare policies (and spot slow cores or doubled-up SMT siblings)
+static inline void cpu_placement_report(const cpu_placement_t *p, const thread_stats_t *stats, double elapsed) {
+    printf("Per-thread rate (placement %s):\n", p->name);
+    for (int t = 0; t < stats->n_threads; t++) {
+        double rate = (elapsed > 0.0) ? (double)stats->threads[t].hashes / elapsed / 1e6 : 0.0;
+        int cpu = cpu_placement_cpu(p, t);
+        const cpu_info_t *info = (cpu >= 0) ? cpu_placement_info(p, cpu) : NULL;
+        if (info != NULL) {
+            printf("  thread %3d  cpu %3d  core %3d  package %d  node %d  smt %d  %8.2f M/s\n",
+                   t, info->cpu, info->core, info->package, info->node, info->smt, rate);
+        } else {
+            printf("  thread %3d  (not pinned)  %8.2f M/s\n", t, rate);
+        }
+    }
+}
+
+#endif
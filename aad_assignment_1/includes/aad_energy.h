@@ -0,0 +1,118 @@
+#ifndef AAD_ENERGY_H
+#define AAD_ENERGY_H
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aad_data_types.h"
+
+//
+// package energy from the Linux powercap interface (Intel RAPL; recent kernels expose AMD RAPL the
+// same way)
+//
+// only the top-level package zones (intel-rapl:N, named package-N) are summed: their subzones (core,
+// uncore, dram) are already included, and psys would count the whole platform twice
+//
+// energy_uj is a wrapping counter (max_energy_range_uj), so the meter must be sampled at least once
+// per wrap period (minutes at full load); the reporter samples it every interval
+//
+// many distributions make energy_uj readable by root only (CVE-2020-8694); the meter then reports
+// no zones and the miners print no energy figures
+//
+// DETI_POWERCAP overrides the sysfs directory (containers with a bind-mounted powercap tree)
+//
+
+#define ENERGY_POWERCAP_DIR   "/sys/class/powercap"
+#define ENERGY_MAX_ZONES      16
+#define ENERGY_PATH_SIZE      384
+
+typedef struct {
+    char path[ENERGY_PATH_SIZE];    // energy_uj file
+    u64_t range_uj;                 // counter wraps at this value
+    u64_t last_uj;
+} energy_zone_t;
+
+typedef struct {
+    energy_zone_t zones[ENERGY_MAX_ZONES];
+    int n_zones;
+    double joules;                  // accumulated since energy_meter_init
+} energy_meter_t;
+
+static inline int energy_read_u64(const char *path, u64_t *value) {
+    unsigned long long v;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        return -1;
+    }
+    int ok = (fscanf(f, "%llu", &v) == 1);
+    fclose(f);
+    if (!ok) {
+        return -1;
+    }
+    *value = (u64_t)v;
+    return 0;
+}
+
+static inline int energy_meter_init(energy_meter_t *m) {
+    const char *root = getenv("DETI_POWERCAP");
+    char path[ENERGY_PATH_SIZE], name[64];
+    struct dirent *entry;
+    DIR *dir;
+
+    memset(m, 0, sizeof(*m));
+    if (root == NULL || root[0] == '\0') {
+        root = ENERGY_POWERCAP_DIR;
+    }
+    if ((dir = opendir(root)) == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL && m->n_zones < ENERGY_MAX_ZONES) {
+        int index, consumed = 0;
+        // intel-rapl:N only (intel-rapl:N:M are subzones)
+        if (sscanf(entry->d_name, "intel-rapl:%d%n", &index, &consumed) != 1 || entry->d_name[consumed] != '\0') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%.200s/%.100s/name", root, entry->d_name);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        int ok = (fscanf(f, "%63s", name) == 1);
+        fclose(f);
+        if (!ok || strncmp(name, "package", 7) != 0) {
+            continue;
+        }
+        energy_zone_t *zone = &m->zones[m->n_zones];
+        snprintf(zone->path, sizeof(zone->path), "%.200s/%.100s/energy_uj", root, entry->d_name);
+        snprintf(path, sizeof(path), "%.200s/%.100s/max_energy_range_uj", root, entry->d_name);
+        if (energy_read_u64(zone->path, &zone->last_uj) != 0) {
+            continue;   // not readable by this user
+        }
+        if (energy_read_u64(path, &zone->range_uj) != 0) {
+            zone->range_uj = 0;
+        }
+        m->n_zones++;
+    }
+    closedir(dir);
+    return m->n_zones;
+}
+
+// reads all zones and returns the joules accumulated since energy_meter_init
+static inline double energy_meter_sample(energy_meter_t *m) {
+    for (int i = 0; i < m->n_zones; i++) {
+        energy_zone_t *zone = &m->zones[i];
+        u64_t now;
+        if (energy_read_u64(zone->path, &now) != 0) {
+            continue;
+        }
+        u64_t delta = (now >= zone->last_uj) ? now - zone->last_uj :
+                      (zone->range_uj > zone->last_uj) ? zone->range_uj - zone->last_uj + now : now;
+        m->joules += 1e-6 * (double)delta;
+        zone->last_uj = now;
+    }
+    return m->joules;
+}
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef AAD_NONCE_SCHEDULER_H
+#define AAD_NONCE_SCHEDULER_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aad_data_types.h"
+
+//
+// work-stealing nonce (counter) scheduler
+//
+// every thread owns a slot holding a contiguous counter range; the owner takes chunks from the
+// front of its range, an idle thread steals the back half of the busiest slot, and an empty slot
+// is refilled from a shared pool; the pool itself is refilled by a callback (a global cursor in the
+// standalone miners, a request to the master in the MPI worker)
+//
+// the chunk size of each thread follows its measured hash rate, so that a chunk takes about
+// NONCE_TARGET_SECONDS on any core (P-core, E-core or a core shared with an SMT sibling)
+//
+// all boundaries are multiples of NONCE_ALIGN, so SIMD lanes (up to 16) never straddle two chunks
+//
+
+#define NONCE_ALIGN           16ULL
+#define NONCE_MIN_CHUNK       (1ULL << 16)
+#define NONCE_MAX_CHUNK       (1ULL << 30)
+#define NONCE_FIRST_CHUNK     (1ULL << 20)
+#define NONCE_TARGET_SECONDS  0.05
+#define NONCE_SLOT_CHUNKS     4           // chunks moved from the pool into a slot at a time
+#define NONCE_REFILL_ANY      (-1)        // any thread may call the refill callback
+
+// returns 1 and a fresh range [*start,*end), or 0 when there is no more work
+typedef int (*nonce_refill_t)(void *arg, u64_t *start, u64_t *end);
+
+typedef struct {
+    pthread_mutex_t lock;
+    u64_t start, end;       // remaining range of this slot (owner: front, thieves: back)
+    u64_t chunk;            // owner only: next chunk size
+    u64_t last_size;        // owner only: size of the previous chunk
+    double last_time;       // owner only: when the previous chunk was taken
+    double rate;            // owner only: smoothed hashes per second
+    int reported;           // owner only: the rate comes from nonce_scheduler_report_rate()
+} __attribute__((aligned(64))) nonce_slot_t;
+
+typedef struct {
+    nonce_slot_t *slots;
+    int n_threads;
+    pthread_mutex_t pool_lock;
+    u64_t pool_start, pool_end;
+    nonce_refill_t refill;
+    void *refill_arg;
+    int refill_thread;              // thread allowed to call refill (NONCE_REFILL_ANY = any)
+    const volatile int *stop;       // waiting threads give up when *stop becomes non-zero
+    volatile int exhausted;         // refill returned 0
+} nonce_scheduler_t;
+
+static inline double nonce_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static inline u64_t nonce_align_down(u64_t x) {
+    return x & ~(NONCE_ALIGN - 1ULL);
+}
+
+static inline int nonce_scheduler_init(nonce_scheduler_t *s, int n_threads, nonce_refill_t refill, void *refill_arg,
+                                       int refill_thread, const volatile int *stop) {
+    memset(s, 0, sizeof(*s));
+    s->slots = (nonce_slot_t *)aligned_alloc(64, (size_t)n_threads * sizeof(nonce_slot_t));
+    if (s->slots == NULL) {
+        return -1;
+    }
+    memset(s->slots, 0, (size_t)n_threads * sizeof(nonce_slot_t));
+    for (int i = 0; i < n_threads; i++) {
+        pthread_mutex_init(&s->slots[i].lock, NULL);
+        s->slots[i].chunk = NONCE_FIRST_CHUNK;
+    }
+    pthread_mutex_init(&s->pool_lock, NULL);
+    s->n_threads = n_threads;
+    s->refill = refill;
+    s->refill_arg = refill_arg;
+    s->refill_thread = refill_thread;
+    s->stop = stop;
+    return 0;
+}
+
+static inline void nonce_scheduler_free(nonce_scheduler_t *s) {
+    for (int i = 0; i < s->n_threads; i++) {
+        pthread_mutex_destroy(&s->slots[i].lock);
+    }
+    pthread_mutex_destroy(&s->pool_lock);
+    free(s->slots);
+    s->slots = NULL;
+}
+
+// adds [start,end) to the pool (e.g. the first range received from the MPI master)
+static inline void nonce_scheduler_seed(nonce_scheduler_t *s, u64_t start, u64_t end) {
+    pthread_mutex_lock(&s->pool_lock);
+    s->pool_start = start;
+    s->pool_end = end;
+    pthread_mutex_unlock(&s->pool_lock);
+}
+
+// owner only: folds one rate sample into the estimate and sizes the next chunk
+static inline void nonce_slot_rate(nonce_slot_t *slot, double rate) {
+    slot->rate = (slot->rate > 0.0) ? 0.7 * slot->rate + 0.3 * rate : rate;
+    double chunk = slot->rate * NONCE_TARGET_SECONDS;
+    slot->chunk = (chunk < (double)NONCE_MIN_CHUNK) ? NONCE_MIN_CHUNK :
+                  (chunk > (double)NONCE_MAX_CHUNK) ? NONCE_MAX_CHUNK : nonce_align_down((u64_t)chunk);
+}
+
+// owner only: updates the rate estimate (time since the previous chunk was handed out) and the
+// next chunk size
+static inline void nonce_slot_measure(nonce_slot_t *slot) {
+    double now = nonce_now();
+    if (!slot->reported && slot->last_size > 0 && now > slot->last_time) {
+        nonce_slot_rate(slot, (double)slot->last_size / (now - slot->last_time));
+    }
+}
+
+//
+// owner only: for a thread that keeps several chunks in flight (the hybrid miner's OpenCL host
+// thread), the time between two requests says nothing about its rate; it reports the rate it
+// measured itself (hashes of a finished chunk over the time they took) and from then on its chunk
+// size follows only these reports
+//
+static inline void nonce_scheduler_report_rate(nonce_scheduler_t *s, int tid, u64_t hashes, double seconds) {
+    nonce_slot_t *slot = &s->slots[tid];
+
+    slot->reported = 1;
+    if (hashes > 0 && seconds > 0.0) {
+        nonce_slot_rate(slot, (double)hashes / seconds);
+    }
+}
+
+// takes one chunk from the front of the caller's own slot
+static inline int nonce_take_own(nonce_slot_t *slot, u64_t *start, u64_t *end) {
+    int found = 0;
+    pthread_mutex_lock(&slot->lock);
+    if (slot->start < slot->end) {
+        u64_t size = slot->end - slot->start;
+        if (size > slot->chunk) {
+            size = slot->chunk;
+        }
+        *start = slot->start;
+        *end = slot->start + size;
+        slot->start += size;
+        found = 1;
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return found;
+}
+
+// moves up to NONCE_SLOT_CHUNKS chunks from the pool into the caller's slot, refilling the pool
+// when it is empty and the caller is allowed to
+static inline int nonce_take_pool(nonce_scheduler_t *s, int tid) {
+    nonce_slot_t *slot = &s->slots[tid];
+    int found = 0;
+
+    pthread_mutex_lock(&s->pool_lock);
+    if (s->pool_start >= s->pool_end && !s->exhausted &&
+        (s->refill_thread == NONCE_REFILL_ANY || s->refill_thread == tid)) {
+        if (s->refill == NULL || !s->refill(s->refill_arg, &s->pool_start, &s->pool_end)) {
+            s->pool_start = s->pool_end = 0;
+            s->exhausted = 1;
+        }
+    }
+    if (s->pool_start < s->pool_end) {
+        u64_t size = s->pool_end - s->pool_start;
+        if (size > NONCE_SLOT_CHUNKS * slot->chunk) {
+            size = NONCE_SLOT_CHUNKS * slot->chunk;
+        }
+        pthread_mutex_lock(&slot->lock);
+        slot->start = s->pool_start;
+        slot->end = s->pool_start + size;
+        pthread_mutex_unlock(&slot->lock);
+        s->pool_start += size;
+        found = 1;
+    }
+    pthread_mutex_unlock(&s->pool_lock);
+    return found;
+}
+
+// steals the back half of the slot with the most remaining work
+static inline int nonce_steal(nonce_scheduler_t *s, int tid) {
+    int victim = -1;
+    u64_t best = 0;
+
+    for (int k = 1; k < s->n_threads; k++) {
+        int v = (tid + k) % s->n_threads;
+        u64_t left = __atomic_load_n(&s->slots[v].end, __ATOMIC_RELAXED) - __atomic_load_n(&s->slots[v].start, __ATOMIC_RELAXED);
+        if ((s64_t)left > (s64_t)best) {
+            best = left;
+            victim = v;
+        }
+    }
+    if (victim < 0 || best < 2 * NONCE_ALIGN) {
+        return 0;
+    }
+    nonce_slot_t *from = &s->slots[victim];
+    nonce_slot_t *slot = &s->slots[tid];
+    u64_t start = 0, end = 0;
+    pthread_mutex_lock(&from->lock);
+    if (from->end > from->start && from->end - from->start >= 2 * NONCE_ALIGN) {
+        u64_t half = nonce_align_down((from->end - from->start) / 2);
+        start = from->end - half;
+        end = from->end;
+        from->end = start;
+    }
+    pthread_mutex_unlock(&from->lock);
+    if (start == end) {
+        return 0;
+    }
+    pthread_mutex_lock(&slot->lock);
+    slot->start = start;
+    slot->end = end;
+    pthread_mutex_unlock(&slot->lock);
+    return 1;
+}
+
+// refill callback of the standalone miners: consecutive ranges of a global counter
+typedef struct {
+    u64_t next;
+    u64_t step;
+} nonce_cursor_t;
+
+static inline int nonce_cursor_refill(void *arg, u64_t *start, u64_t *end) {
+    nonce_cursor_t *cursor = (nonce_cursor_t *)arg;  // called with the pool lock held
+    *start = cursor->next;
+    *end = cursor->next + cursor->step;
+    cursor->next = *end;
+    return 1;
+}
+
+//
+// gives thread tid its next chunk [*start,*end); returns 0 when all the work is done (or *stop)
+//
+static inline int nonce_scheduler_next(nonce_scheduler_t *s, int tid, u64_t *start, u64_t *end) {
+    nonce_slot_t *slot = &s->slots[tid];
+
+    nonce_slot_measure(slot);
+    for (;;) {
+        if (nonce_take_own(slot, start, end)) {
+            slot->last_size = *end - *start;
+            slot->last_time = nonce_now();
+            return 1;
+        }
+        if (nonce_take_pool(s, tid) || nonce_steal(s, tid)) {
+            continue;
+        }
+        if (s->exhausted || (s->stop != NULL && *s->stop)) {
+            slot->last_size = 0;
+            return 0;
+        }
+        // the pool is empty and only another thread may refill it: wait a little
+        struct timespec nap = {0, 200000L};
+        nanosleep(&nap, NULL);
+    }
+}
+
+#endif
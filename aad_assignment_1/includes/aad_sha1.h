@@ -105,40 +105,13 @@
   while(0)
 
 //
-// the CUSTOM_SHA1_CODE macro, for a little-endian processor
+// the 80 iterations of the SHA1 compression function (state in a,b,c,d,e, data in w[16])
 //
-// everything is loop unrolled to make sure all indices are static integers, so the compiler
-// has no excuse to produce sub-optimal code (the w[16] array can even become 16 separate
-// integer variables, the CUDA compiler actually does this)
+// shared by the single-block CUSTOM_SHA1_CODE macro and by the general SHA1_BLOCK_CODE macro
 //
-#define CUSTOM_SHA1_CODE()                                                                  \
+#define SHA1_ROUNDS()                                                                       \
   do                                                                                        \
   {                                                                                         \
-    /* local variables */                                                                   \
-    T a,b,c,d,e,w[16];                                                                      \
-    /* initial state */                                                                     \
-    a = C(0x67452301u);                                                                     \
-    b = C(0xEFCDAB89u);                                                                     \
-    c = C(0x98BADCFEu);                                                                     \
-    d = C(0x10325476u);                                                                     \
-    e = C(0xC3D2E1F0u);                                                                     \
-    /* copy data to the internal buffer */                                                  \
-    w[ 0] = DATA( 0);                                                                       \
-    w[ 1] = DATA( 1);                                                                       \
-    w[ 2] = DATA( 2);                                                                       \
-    w[ 3] = DATA( 3);                                                                       \
-    w[ 4] = DATA( 4);                                                                       \
-    w[ 5] = DATA( 5);                                                                       \
-    w[ 6] = DATA( 6);                                                                       \
-    w[ 7] = DATA( 7);                                                                       \
-    w[ 8] = DATA( 8);                                                                       \
-    w[ 9] = DATA( 9);                                                                       \
-    w[10] = DATA(10);                                                                       \
-    w[11] = DATA(11);                                                                       \
-    w[12] = DATA(12);                                                                       \
-    w[13] = DATA(13); /* WARNING: DATA(13) & 0xFF must be 0x80 (SHA1 padding) */            \
-    w[14] = C(0);                                                                           \
-    w[15] = C(440); /* the message has 55*8 bits */                                         \
     /* first group of 20 iterations (0 <= t <= 19) */                                       \
                 SHA1_S(SHA1_F1, 0,SHA1_K1);                                                 \
                 SHA1_S(SHA1_F1, 1,SHA1_K1);                                                 \
@@ -223,6 +196,45 @@
     SHA1_D(77); SHA1_S(SHA1_F4,77,SHA1_K4);                                                 \
     SHA1_D(78); SHA1_S(SHA1_F4,78,SHA1_K4);                                                 \
     SHA1_D(79); SHA1_S(SHA1_F4,79,SHA1_K4);                                                 \
+  }                                                                                         \
+  while(0)
+
+//
+// the CUSTOM_SHA1_CODE macro, for a little-endian processor
+//
+// everything is loop unrolled to make sure all indices are static integers, so the compiler
+// has no excuse to produce sub-optimal code (the w[16] array can even become 16 separate
+// integer variables, the CUDA compiler actually does this)
+//
+#define CUSTOM_SHA1_CODE()                                                                  \
+  do                                                                                        \
+  {                                                                                         \
+    /* local variables */                                                                   \
+    T a,b,c,d,e,w[16];                                                                      \
+    /* initial state */                                                                     \
+    a = C(0x67452301u);                                                                     \
+    b = C(0xEFCDAB89u);                                                                     \
+    c = C(0x98BADCFEu);                                                                     \
+    d = C(0x10325476u);                                                                     \
+    e = C(0xC3D2E1F0u);                                                                     \
+    /* copy data to the internal buffer */                                                  \
+    w[ 0] = DATA( 0);                                                                       \
+    w[ 1] = DATA( 1);                                                                       \
+    w[ 2] = DATA( 2);                                                                       \
+    w[ 3] = DATA( 3);                                                                       \
+    w[ 4] = DATA( 4);                                                                       \
+    w[ 5] = DATA( 5);                                                                       \
+    w[ 6] = DATA( 6);                                                                       \
+    w[ 7] = DATA( 7);                                                                       \
+    w[ 8] = DATA( 8);                                                                       \
+    w[ 9] = DATA( 9);                                                                       \
+    w[10] = DATA(10);                                                                       \
+    w[11] = DATA(11);                                                                       \
+    w[12] = DATA(12);                                                                       \
+    w[13] = DATA(13); /* WARNING: DATA(13) & 0xFF must be 0x80 (SHA1 padding) */            \
+    w[14] = C(0);                                                                           \
+    w[15] = C(440); /* the message has 55*8 bits */                                         \
+    SHA1_ROUNDS();                                                                          \
     /* update state (in this special case, finish) */                                       \
     HASH(0) = a + C(0x67452301u);                                                           \
     HASH(1) = b + C(0xEFCDAB89u);                                                           \
@@ -233,6 +245,53 @@
   while(0)
 
 
+//
+// the SHA1_BLOCK_CODE macro: one general compression step (a full 64-byte chunk)
+//
+// besides T, C(c) and ROTATE(x,n), it must be customized using the following macros:
+//   DATA(idx)  --- how to access the data at index idx, 0 <= idx <= 15 (already big-endian words)
+//   STATE(idx) --- how to access the chaining state at index idx, 0 <= idx <= 4 (read and updated)
+// the padding and the message length are the responsibility of the caller (see aad_sha1_stream.h)
+//
+#define SHA1_BLOCK_CODE()                                                                   \
+  do                                                                                        \
+  {                                                                                         \
+    /* local variables */                                                                   \
+    T a,b,c,d,e,w[16];                                                                      \
+    /* current state */                                                                     \
+    a = STATE(0);                                                                           \
+    b = STATE(1);                                                                           \
+    c = STATE(2);                                                                           \
+    d = STATE(3);                                                                           \
+    e = STATE(4);                                                                           \
+    /* copy data to the internal buffer */                                                  \
+    w[ 0] = DATA( 0);                                                                       \
+    w[ 1] = DATA( 1);                                                                       \
+    w[ 2] = DATA( 2);                                                                       \
+    w[ 3] = DATA( 3);                                                                       \
+    w[ 4] = DATA( 4);                                                                       \
+    w[ 5] = DATA( 5);                                                                       \
+    w[ 6] = DATA( 6);                                                                       \
+    w[ 7] = DATA( 7);                                                                       \
+    w[ 8] = DATA( 8);                                                                       \
+    w[ 9] = DATA( 9);                                                                       \
+    w[10] = DATA(10);                                                                       \
+    w[11] = DATA(11);                                                                       \
+    w[12] = DATA(12);                                                                       \
+    w[13] = DATA(13);                                                                       \
+    w[14] = DATA(14);                                                                       \
+    w[15] = DATA(15);                                                                       \
+    SHA1_ROUNDS();                                                                          \
+    /* update state */                                                                      \
+    STATE(0) = STATE(0) + a;                                                                \
+    STATE(1) = STATE(1) + b;                                                                \
+    STATE(2) = STATE(2) + c;                                                                \
+    STATE(3) = STATE(3) + d;                                                                \
+    STATE(4) = STATE(4) + e;                                                                \
+  }                                                                                         \
+  while(0)
+
+
 //
 // the end!
 //
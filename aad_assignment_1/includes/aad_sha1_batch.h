@@ -0,0 +1,447 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// batch SHA1 secure hash of many 55-byte messages (array of structures in, array of structures out)
+//
+// the messages are transposed into the interleaved (structure of arrays) layout used by the SIMD
+// implementations, hashed, and the secure hashes are transposed back; the widest kernel supported
+// by the processor is selected at run time, so the caller does not need to be compiled with any
+// particular -m flag:
+//   sha1_batch16_avx512f() --- 16 messages per call (requires avx512f)
+//   sha1_batch8_avx2()     ---  8 messages per call (requires avx2)
+//   sha1_batch4_sse2()     ---  4 messages per call (always available on x86-64)
+//   sha1()                 ---  1 message per call
+// the messages left over by a wide kernel are handled by the narrower ones
+//
+
+#ifndef AAD_SHA1_BATCH
+#define AAD_SHA1_BATCH
+
+#include <stddef.h>
+#include <pthread.h>
+#include "aad_data_types.h"
+#include "aad_sha1_cpu.h"
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
+#if defined(_OPENMP)
+# include <omp.h>
+#endif
+
+
+//
+// portable vector types (gcc vector extensions); unlike v4si/v8si/v16si they are always defined,
+// and unsigned, so that >> is a logical shift
+//
+
+typedef u32_t sha1_u32x4_t  __attribute__((vector_size(16)));
+typedef u32_t sha1_u32x8_t  __attribute__((vector_size(32)));
+typedef u32_t sha1_u32x16_t __attribute__((vector_size(64)));
+
+#define SHA1_BATCH_ROTATE(x,n)  (((x) << (n)) | ((x) >> (32 - (n))))
+
+typedef void (*sha1_batch_kernel_t)(const u32_t (*msgs)[14],u32_t (*out)[5]);
+
+
+#if defined(__x86_64__)
+
+//
+// 4x4 transpose of 32-bit words (sse2)
+//
+
+#define SHA1_BATCH_TRANSPOSE4(r0,r1,r2,r3)                                                   \
+  do                                                                                         \
+  {                                                                                          \
+    __m128i t0 = _mm_unpacklo_epi32(r0,r1),t1 = _mm_unpackhi_epi32(r0,r1);                   \
+    __m128i t2 = _mm_unpacklo_epi32(r2,r3),t3 = _mm_unpackhi_epi32(r2,r3);                   \
+    r0 = _mm_unpacklo_epi64(t0,t2);                                                          \
+    r1 = _mm_unpackhi_epi64(t0,t2);                                                          \
+    r2 = _mm_unpacklo_epi64(t1,t3);                                                          \
+    r3 = _mm_unpackhi_epi64(t1,t3);                                                          \
+  }                                                                                          \
+  while(0)
+
+__attribute__((unused))
+static void sha1_batch4_sse2(const u32_t (*msgs)[14],u32_t (*out)[5])
+{
+  sha1_u32x4_t data[16],hash[8];
+  __m128i r[4];
+  int m,g;
+
+  // words 0..11 in three 4x4 blocks, words 12..13 with 64-bit loads (do not read past msgs[3][13])
+  for(g = 0;g < 3;g++)
+  {
+    for(m = 0;m < 4;m++)
+      r[m] = _mm_loadu_si128((const __m128i *)&msgs[m][4 * g]);
+    SHA1_BATCH_TRANSPOSE4(r[0],r[1],r[2],r[3]);
+    for(m = 0;m < 4;m++)
+      data[4 * g + m] = (sha1_u32x4_t)r[m];
+  }
+  for(m = 0;m < 4;m++)
+    r[m] = _mm_loadl_epi64((const __m128i *)&msgs[m][12]);
+  SHA1_BATCH_TRANSPOSE4(r[0],r[1],r[2],r[3]);
+  data[12] = (sha1_u32x4_t)r[0];
+  data[13] = (sha1_u32x4_t)r[1];
+  // hash
+# define T            sha1_u32x4_t
+# define C(c)         ((sha1_u32x4_t){ 0 } + (u32_t)(c))
+# define ROTATE(x,n)  SHA1_BATCH_ROTATE(x,n)
+# define DATA(idx)    data[idx]
+# define HASH(idx)    hash[idx]
+  CUSTOM_SHA1_CODE();
+# undef T
+# undef C
+# undef ROTATE
+# undef DATA
+# undef HASH
+  // back to one hash per message (words 0..3 transposed, word 4 extracted)
+  for(m = 0;m < 4;m++)
+    r[m] = (__m128i)hash[m];
+  SHA1_BATCH_TRANSPOSE4(r[0],r[1],r[2],r[3]);
+  for(m = 0;m < 4;m++)
+  {
+    _mm_storeu_si128((__m128i *)&out[m][0],r[m]);
+    out[m][4] = hash[4][m];
+  }
+}
+
+
+//
+// 8x8 transpose of 32-bit words (avx2)
+//
+
+__attribute__((target("avx2"),unused))
+static inline void sha1_batch_transpose8(__m256i r[8])
+{
+  __m256i t[8],u[8];
+  int i;
+
+  for(i = 0;i < 8;i += 2)
+  {
+    t[i    ] = _mm256_unpacklo_epi32(r[i],r[i + 1]);
+    t[i + 1] = _mm256_unpackhi_epi32(r[i],r[i + 1]);
+  }
+  for(i = 0;i < 8;i += 4)
+  {
+    u[i    ] = _mm256_unpacklo_epi64(t[i    ],t[i + 2]);
+    u[i + 1] = _mm256_unpackhi_epi64(t[i    ],t[i + 2]);
+    u[i + 2] = _mm256_unpacklo_epi64(t[i + 1],t[i + 3]);
+    u[i + 3] = _mm256_unpackhi_epi64(t[i + 1],t[i + 3]);
+  }
+  for(i = 0;i < 4;i++)
+  {
+    r[i    ] = _mm256_permute2x128_si256(u[i],u[i + 4],0x20);
+    r[i + 4] = _mm256_permute2x128_si256(u[i],u[i + 4],0x31);
+  }
+}
+
+// loads words 0..13 of 8 messages into 14 interleaved vectors (words 8..13 with masked loads)
+__attribute__((target("avx2"),unused))
+static inline void sha1_batch_load8(const u32_t (*msgs)[14],__m256i data[16])
+{
+  const __m256i mask6 = _mm256_setr_epi32(-1,-1,-1,-1,-1,-1,0,0);
+  int m;
+
+  for(m = 0;m < 8;m++)
+  {
+    data[m    ] = _mm256_loadu_si256((const __m256i *)&msgs[m][0]);
+    data[m + 8] = _mm256_maskload_epi32((const int *)&msgs[m][8],mask6);
+  }
+  sha1_batch_transpose8(&data[0]);
+  sha1_batch_transpose8(&data[8]);
+}
+
+// stores 5 interleaved hash vectors as one 5-word hash per message
+__attribute__((target("avx2"),unused))
+static inline void sha1_batch_store8(__m256i hash[8],u32_t (*out)[5])
+{
+  const __m256i mask5 = _mm256_setr_epi32(-1,-1,-1,-1,-1,0,0,0);
+  int m;
+
+  hash[5] = hash[6] = hash[7] = _mm256_setzero_si256();
+  sha1_batch_transpose8(hash);
+  for(m = 0;m < 8;m++)
+    _mm256_maskstore_epi32((int *)&out[m][0],mask5,hash[m]);
+}
+
+__attribute__((target("avx2"),unused))
+static void sha1_batch8_avx2(const u32_t (*msgs)[14],u32_t (*out)[5])
+{
+  __m256i data[16],hash[8];
+  sha1_u32x8_t h[5];
+  int i;
+
+  sha1_batch_load8(msgs,data);
+# define T            sha1_u32x8_t
+# define C(c)         ((sha1_u32x8_t){ 0 } + (u32_t)(c))
+# define ROTATE(x,n)  SHA1_BATCH_ROTATE(x,n)
+# define DATA(idx)    ((sha1_u32x8_t)data[idx])
+# define HASH(idx)    h[idx]
+  CUSTOM_SHA1_CODE();
+# undef T
+# undef C
+# undef ROTATE
+# undef DATA
+# undef HASH
+  for(i = 0;i < 5;i++)
+    hash[i] = (__m256i)h[i];
+  sha1_batch_store8(hash,out);
+}
+
+
+//
+// avx512f: two 8x8 transposes per group of 8 words, the halves joined in one zmm register
+//
+
+__attribute__((target("avx512f"),unused))
+static void sha1_batch16_avx512f(const u32_t (*msgs)[14],u32_t (*out)[5])
+{
+  __m256i lo[16],hi[16],hash_lo[8],hash_hi[8];
+  sha1_u32x16_t data[14],h[5];
+  int i;
+
+  sha1_batch_load8(&msgs[0],lo);
+  sha1_batch_load8(&msgs[8],hi);
+  for(i = 0;i < 14;i++)
+    data[i] = (sha1_u32x16_t)_mm512_inserti64x4(_mm512_castsi256_si512(lo[i]),hi[i],1);
+# define T            sha1_u32x16_t
+# define C(c)         ((sha1_u32x16_t){ 0 } + (u32_t)(c))
+# define ROTATE(x,n)  SHA1_BATCH_ROTATE(x,n)
+# define DATA(idx)    data[idx]
+# define HASH(idx)    h[idx]
+  CUSTOM_SHA1_CODE();
+# undef T
+# undef C
+# undef ROTATE
+# undef DATA
+# undef HASH
+  for(i = 0;i < 5;i++)
+  {
+    hash_lo[i] = _mm512_castsi512_si256((__m512i)h[i]);
+    hash_hi[i] = _mm512_extracti64x4_epi64((__m512i)h[i],1);
+  }
+  sha1_batch_store8(hash_lo,&out[0]);
+  sha1_batch_store8(hash_hi,&out[8]);
+}
+
+#endif
+
+
+//
+// counter kernels: hash the SHA1_COUNTER_BLOCK coins that differ from tmpl only in the 64-bit counter
+// of words 3 (low) and 4 (high), counter, counter + 1, ..., and return the mask of the lanes whose
+// first hash word is first_word; counter must be a multiple of SHA1_COUNTER_BLOCK, so the low word
+// never carries inside a block and the template is broadcast with the lane index added to word 3
+//   sha1_counter16_avx512f() --- 16 lanes (requires avx512f)
+//   sha1_counter16_avx2()    ---  8 lanes, two rounds (requires avx2)
+//   sha1_counter16_avx()     ---  4 lanes (VEX encoded), four rounds (requires avx)
+//   sha1_counter16_sse2()    ---  4 lanes, four rounds (always available on x86-64)
+//   sha1_counter16_scalar()  ---  sha1(), sixteen rounds
+// used by the miner library (Library/deti_miner.c) and the MPI miner (MPI_ClientServer/aad_mpi_kernel.h)
+//
+
+#define SHA1_COUNTER_BLOCK  16
+
+typedef u32_t (*sha1_counter_kernel_t)(const u32_t tmpl[14],u64_t counter,u32_t first_word);
+
+__attribute__((unused))
+static u32_t sha1_counter16_scalar(const u32_t tmpl[14],u64_t counter,u32_t first_word)
+{
+  u32_t coin[14],hash[5],mask = 0u;
+  int i,lane;
+
+  for(i = 0;i < 14;i++)
+    coin[i] = tmpl[i];
+  coin[4] = (u32_t)(counter >> 32);
+  for(lane = 0;lane < SHA1_COUNTER_BLOCK;lane++)
+  {
+    coin[3] = (u32_t)counter + (u32_t)lane;
+    sha1(coin,hash);
+    if(hash[0] == first_word)
+      mask |= 1u << lane;
+  }
+  return mask;
+}
+
+#if defined(__x86_64__)
+
+// body of a vector counter kernel for the vector type T (LANES wide)
+#define SHA1_COUNTER_BODY(LANES)                                                             \
+  do                                                                                         \
+  {                                                                                          \
+    T data[14],hash[5],lanes;                                                                \
+    int i,lane,block;                                                                        \
+                                                                                             \
+    for(i = 0;i < 14;i++)                                                                    \
+      data[i] = C(tmpl[i]);                                                                  \
+    data[4] = C(counter >> 32);                                                              \
+    for(lane = 0;lane < LANES;lane++)                                                        \
+      lanes[lane] = (u32_t)lane;                                                             \
+    for(block = 0;block < SHA1_COUNTER_BLOCK;block += LANES)                                 \
+    {                                                                                        \
+      data[3] = lanes + ((u32_t)counter + (u32_t)block);                                     \
+      CUSTOM_SHA1_CODE();                                                                    \
+      for(lane = 0;lane < LANES;lane++)                                                      \
+        if(hash[0][lane] == first_word)                                                      \
+          mask |= 1u << (block + lane);                                                      \
+    }                                                                                        \
+  }                                                                                          \
+  while(0)
+
+# define C(c)         ((T){ 0 } + (u32_t)(c))
+# define ROTATE(x,n)  SHA1_BATCH_ROTATE(x,n)
+# define DATA(idx)    data[idx]
+# define HASH(idx)    hash[idx]
+
+__attribute__((target("sse2"),unused))
+static u32_t sha1_counter16_sse2(const u32_t tmpl[14],u64_t counter,u32_t first_word)
+{
+  u32_t mask = 0u;
+# define T sha1_u32x4_t
+  SHA1_COUNTER_BODY(4);
+# undef T
+  return mask;
+}
+
+__attribute__((target("avx"),unused))
+static u32_t sha1_counter16_avx(const u32_t tmpl[14],u64_t counter,u32_t first_word)
+{
+  u32_t mask = 0u;
+# define T sha1_u32x4_t
+  SHA1_COUNTER_BODY(4);
+# undef T
+  return mask;
+}
+
+__attribute__((target("avx2"),unused))
+static u32_t sha1_counter16_avx2(const u32_t tmpl[14],u64_t counter,u32_t first_word)
+{
+  u32_t mask = 0u;
+# define T sha1_u32x8_t
+  SHA1_COUNTER_BODY(8);
+# undef T
+  return mask;
+}
+
+__attribute__((target("avx512f"),unused))
+static u32_t sha1_counter16_avx512f(const u32_t tmpl[14],u64_t counter,u32_t first_word)
+{
+  u32_t mask = 0u;
+# define T sha1_u32x16_t
+  SHA1_COUNTER_BODY(16);
+# undef T
+  return mask;
+}
+
+# undef C
+# undef ROTATE
+# undef DATA
+# undef HASH
+# undef SHA1_COUNTER_BODY
+
+#endif
+
+
+//
+// kernel selection (done once, with pthread_once, so concurrent first callers do not race)
+//
+
+static sha1_batch_kernel_t sha1_batch_best_kernel = NULL;
+static size_t sha1_batch_best_lanes = 1;
+static pthread_once_t sha1_batch_select_once = PTHREAD_ONCE_INIT;
+
+__attribute__((unused))
+static void sha1_batch_select_kernel(void)
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f"))
+  {
+    sha1_batch_best_lanes = 16;
+    sha1_batch_best_kernel = sha1_batch16_avx512f;
+  }
+  else if(__builtin_cpu_supports("avx2"))
+  {
+    sha1_batch_best_lanes = 8;
+    sha1_batch_best_kernel = sha1_batch8_avx2;
+  }
+  else
+  {
+    sha1_batch_best_lanes = 4;
+    sha1_batch_best_kernel = sha1_batch4_sse2;
+  }
+#else
+  sha1_batch_best_lanes = 1;
+#endif
+}
+
+__attribute__((unused))
+static const char *sha1_batch_kernel_name(void)
+{
+  pthread_once(&sha1_batch_select_once,sha1_batch_select_kernel);
+  return (sha1_batch_best_lanes == 16) ? "avx512f" : (sha1_batch_best_lanes == 8) ? "avx2" : (sha1_batch_best_lanes == 4) ? "sse2" : "scalar";
+}
+
+
+//
+// hash n messages; any n (including 0) is fine
+//
+
+__attribute__((unused))
+static void sha1_batch(const u32_t (*msgs)[14],size_t n,u32_t (*out)[5])
+{
+  size_t i = 0;
+
+  pthread_once(&sha1_batch_select_once,sha1_batch_select_kernel);
+#if defined(__x86_64__)
+  if(sha1_batch_best_lanes == 16)
+    for(;i + 16 <= n;i += 16)
+      sha1_batch16_avx512f(&msgs[i],&out[i]);
+  if(sha1_batch_best_lanes >= 8)
+    for(;i + 8 <= n;i += 8)
+      sha1_batch8_avx2(&msgs[i],&out[i]);
+  for(;i + 4 <= n;i += 4)
+    sha1_batch4_sse2(&msgs[i],&out[i]);
+#endif
+  for(;i < n;i++)
+    sha1((u32_t *)&msgs[i][0],&out[i][0]);
+}
+
+
+//
+// the same, split among n_threads OpenMP threads (0 means the OpenMP default); each thread gets a
+// contiguous block whose size is a multiple of 16, so only the last block has a tail
+//
+
+__attribute__((unused))
+static void sha1_batch_threads(const u32_t (*msgs)[14],size_t n,u32_t (*out)[5],int n_threads)
+{
+#if defined(_OPENMP)
+  if(n_threads <= 0)
+    n_threads = omp_get_max_threads();
+  if(n_threads > 1 && n >= 1024)
+  {
+    size_t block = ((n + (size_t)n_threads - 1) / (size_t)n_threads + 15) & ~(size_t)15;
+
+    pthread_once(&sha1_batch_select_once,sha1_batch_select_kernel);
+#   pragma omp parallel for num_threads(n_threads) schedule(static,1)
+    for(int t = 0;t < n_threads;t++)
+    {
+      size_t first = (size_t)t * block;
+      if(first < n)
+        sha1_batch(&msgs[first],(first + block <= n) ? block : n - first,&out[first]);
+    }
+    return;
+  }
+#else
+  (void)n_threads;
+#endif
+  sha1_batch(msgs,n,out);
+}
+
+
+//
+// the end!
+//
+
+#endif
@@ -0,0 +1,344 @@
+//
+// Arquiteturas de Alto Desempenho 2025/2026
+//
+// SHA1 secure hash of messages of arbitrary length (RFC 3174)
+//
+// two interfaces, both built on the SHA1_BLOCK_CODE macro of aad_sha1.h:
+//   sha1_stream_init(), sha1_stream_update(), sha1_stream_final() --- one message, fed in pieces
+//   sha1_multi()                                                   --- many independent messages
+//
+// sha1_multi() hashes one message per SIMD lane (16 with avx512f, 8 with avx2, 4 with sse2, the
+// kernel is selected at run time as in aad_sha1_batch.h); the messages are sorted by size, so the
+// messages of each group need about the same number of chunks; a lane whose message has already
+// ended keeps on computing (on zeros), but its result is no longer stored
+//
+// unlike the 55-byte messages of CUSTOM_SHA1_CODE, these messages are plain byte arrays and the
+// secure hashes are returned as 20 bytes, most significant byte first (as printed by sha1sum)
+//
+
+#ifndef AAD_SHA1_STREAM
+#define AAD_SHA1_STREAM
+
+#include <stdlib.h>
+#include <string.h>
+#include "aad_data_types.h"
+#include "aad_sha1.h"
+#include "aad_sha1_batch.h"
+
+#define SHA1_MULTI_MAX_LANES  16
+
+typedef struct
+{
+  u32_t state[5];     // chaining state
+  u64_t size;         // number of bytes ingested so far
+  u08_t buffer[64];   // partial chunk
+  u32_t buffered;     // number of bytes in buffer[]
+}
+sha1_stream_t;
+
+typedef void (*sha1_multi_kernel_t)(u32_t *state,const u32_t *data);
+
+typedef struct
+{
+  size_t size;        // message size (sort key)
+  size_t index;       // message index
+}
+sha1_multi_entry_t;
+
+static inline u32_t sha1_load_be(const u08_t *p)
+{
+  return ((u32_t)p[0] << 24) | ((u32_t)p[1] << 16) | ((u32_t)p[2] << 8) | (u32_t)p[3];
+}
+
+static inline void sha1_store_be(u08_t *p,u32_t x)
+{
+  p[0] = (u08_t)(x >> 24);
+  p[1] = (u08_t)(x >> 16);
+  p[2] = (u08_t)(x >>  8);
+  p[3] = (u08_t)x;
+}
+
+
+//
+// one chunk, for 1, 4, 8 or 16 interleaved messages
+//   state[5 * lanes] --- state[k * lanes + lane] is word k of the state of lane
+//   data[16 * lanes] --- data[w * lanes + lane] is word w of the chunk of lane
+// the vector versions require 64-byte aligned arrays
+//
+
+__attribute__((unused))
+static void sha1_multi_block1(u32_t *state,const u32_t *data)
+{
+# define T            u32_t
+# define C(c)         (c)
+# define ROTATE(x,n)  (((x) << (n)) | ((x) >> (32 - (n))))
+# define DATA(idx)    data[idx]
+# define STATE(idx)   state[idx]
+  SHA1_BLOCK_CODE();
+# undef T
+# undef C
+# undef ROTATE
+# undef DATA
+# undef STATE
+}
+
+#if defined(__x86_64__)
+
+__attribute__((unused))
+static void sha1_multi_block4_sse2(u32_t *state,const u32_t *data)
+{
+  sha1_u32x4_t *vstate = (sha1_u32x4_t *)state;
+  const sha1_u32x4_t *vdata = (const sha1_u32x4_t *)data;
+
+# define T            sha1_u32x4_t
+# define C(c)         ((sha1_u32x4_t){ 0 } + (u32_t)(c))
+# define ROTATE(x,n)  SHA1_BATCH_ROTATE(x,n)
+# define DATA(idx)    vdata[idx]
+# define STATE(idx)   vstate[idx]
+  SHA1_BLOCK_CODE();
+# undef T
+# undef C
+# undef ROTATE
+# undef DATA
+# undef STATE
+}
+
+__attribute__((target("avx2"),unused))
+static void sha1_multi_block8_avx2(u32_t *state,const u32_t *data)
+{
+  sha1_u32x8_t *vstate = (sha1_u32x8_t *)state;
+  const sha1_u32x8_t *vdata = (const sha1_u32x8_t *)data;
+
+# define T            sha1_u32x8_t
+# define C(c)         ((sha1_u32x8_t){ 0 } + (u32_t)(c))
+# define ROTATE(x,n)  SHA1_BATCH_ROTATE(x,n)
+# define DATA(idx)    vdata[idx]
+# define STATE(idx)   vstate[idx]
+  SHA1_BLOCK_CODE();
+# undef T
+# undef C
+# undef ROTATE
+# undef DATA
+# undef STATE
+}
+
+__attribute__((target("avx512f"),unused))
+static void sha1_multi_block16_avx512f(u32_t *state,const u32_t *data)
+{
+  sha1_u32x16_t *vstate = (sha1_u32x16_t *)state;
+  const sha1_u32x16_t *vdata = (const sha1_u32x16_t *)data;
+
+# define T            sha1_u32x16_t
+# define C(c)         ((sha1_u32x16_t){ 0 } + (u32_t)(c))
+# define ROTATE(x,n)  SHA1_BATCH_ROTATE(x,n)
+# define DATA(idx)    vdata[idx]
+# define STATE(idx)   vstate[idx]
+  SHA1_BLOCK_CODE();
+# undef T
+# undef C
+# undef ROTATE
+# undef DATA
+# undef STATE
+}
+
+#endif
+
+
+//
+// streaming interface
+//
+
+__attribute__((unused))
+static void sha1_stream_init(sha1_stream_t *ctx)
+{
+  ctx->state[0] = 0x67452301u;
+  ctx->state[1] = 0xEFCDAB89u;
+  ctx->state[2] = 0x98BADCFEu;
+  ctx->state[3] = 0x10325476u;
+  ctx->state[4] = 0xC3D2E1F0u;
+  ctx->size = 0u;
+  ctx->buffered = 0u;
+}
+
+static inline void sha1_stream_chunk(sha1_stream_t *ctx,const u08_t *chunk)
+{
+  u32_t data[16];
+  int w;
+
+  for(w = 0;w < 16;w++)
+    data[w] = sha1_load_be(&chunk[4 * w]);
+  sha1_multi_block1(ctx->state,data);
+}
+
+__attribute__((unused))
+static void sha1_stream_update(sha1_stream_t *ctx,const void *message,size_t size)
+{
+  const u08_t *p = (const u08_t *)message;
+  size_t n;
+
+  ctx->size += (u64_t)size;
+  if(ctx->buffered > 0u)
+  { // complete the partial chunk first
+    n = 64u - ctx->buffered;
+    if(n > size)
+      n = size;
+    memcpy(&ctx->buffer[ctx->buffered],p,n);
+    ctx->buffered += (u32_t)n;
+    p += n;
+    size -= n;
+    if(ctx->buffered < 64u)
+      return;
+    sha1_stream_chunk(ctx,ctx->buffer);
+    ctx->buffered = 0u;
+  }
+  for(;size >= 64u;p += 64,size -= 64u) // whole chunks straight from the caller's memory
+    sha1_stream_chunk(ctx,p);
+  memcpy(ctx->buffer,p,size);
+  ctx->buffered = (u32_t)size;
+}
+
+__attribute__((unused))
+static void sha1_stream_final(sha1_stream_t *ctx,u08_t digest[20])
+{
+  u64_t bits = ctx->size * 8u;
+  int k;
+
+  ctx->buffer[ctx->buffered++] = 0x80;
+  if(ctx->buffered > 56u)
+  { // no room left for the message length
+    memset(&ctx->buffer[ctx->buffered],0,64u - ctx->buffered);
+    sha1_stream_chunk(ctx,ctx->buffer);
+    ctx->buffered = 0u;
+  }
+  memset(&ctx->buffer[ctx->buffered],0,56u - ctx->buffered);
+  sha1_store_be(&ctx->buffer[56],(u32_t)(bits >> 32));
+  sha1_store_be(&ctx->buffer[60],(u32_t)bits);
+  sha1_stream_chunk(ctx,ctx->buffer);
+  for(k = 0;k < 5;k++)
+    sha1_store_be(&digest[4 * k],ctx->state[k]);
+}
+
+__attribute__((unused))
+static void sha1_digest(const void *message,size_t size,u08_t digest[20])
+{
+  sha1_stream_t ctx;
+
+  sha1_stream_init(&ctx);
+  sha1_stream_update(&ctx,message,size);
+  sha1_stream_final(&ctx,digest);
+}
+
+
+//
+// multi-buffer interface
+//
+
+// number of 64-byte chunks of a padded message with size bytes
+static inline u64_t sha1_multi_chunks(u64_t size)
+{
+  return (size + 8u) / 64u + 1u;
+}
+
+// stores the 16 words of chunk number chunk of the (padded) message in data[w * lanes + lane]
+static inline void sha1_multi_fill(const u08_t *message,u64_t size,u64_t chunk,u32_t *data,int lanes,int lane)
+{
+  u64_t first = chunk * 64u;
+  const u08_t *p;
+  u08_t tail[64];
+  int w;
+
+  if(first + 64u <= size)
+    p = &message[first];
+  else
+  { // one of the last chunks: data, padding byte and/or message length
+    memset(tail,0,sizeof(tail));
+    if(first < size)
+      memcpy(tail,&message[first],(size_t)(size - first));
+    if(first <= size)
+      tail[size - first] = 0x80;
+    if(chunk == sha1_multi_chunks(size) - 1u)
+    {
+      sha1_store_be(&tail[56],(u32_t)((size * 8u) >> 32));
+      sha1_store_be(&tail[60],(u32_t)(size * 8u));
+    }
+    p = tail;
+  }
+  for(w = 0;w < 16;w++)
+    data[w * lanes + lane] = sha1_load_be(&p[4 * w]);
+}
+
+// hashes the n <= lanes messages of entries[]
+static inline void sha1_multi_group(sha1_multi_kernel_t kernel,int lanes,const u08_t *const *messages,
+                                    const sha1_multi_entry_t *entries,int n,u08_t (*digests)[20])
+{
+  static const u32_t initial_state[5] = { 0x67452301u,0xEFCDAB89u,0x98BADCFEu,0x10325476u,0xC3D2E1F0u };
+  u32_t state[5 * SHA1_MULTI_MAX_LANES] __attribute__((aligned(64)));
+  u32_t data[16 * SHA1_MULTI_MAX_LANES] __attribute__((aligned(64)));
+  u64_t chunk,n_chunks = 0u;
+  int lane,k;
+
+  for(lane = 0;lane < lanes;lane++)
+    for(k = 0;k < 5;k++)
+      state[k * lanes + lane] = initial_state[k];
+  for(lane = 0;lane < n;lane++)
+    if(sha1_multi_chunks(entries[lane].size) > n_chunks)
+      n_chunks = sha1_multi_chunks(entries[lane].size);
+  memset(data,0,sizeof(data));
+  for(chunk = 0u;chunk < n_chunks;chunk++)
+  {
+    for(lane = 0;lane < n;lane++)
+      if(chunk < sha1_multi_chunks(entries[lane].size))
+        sha1_multi_fill(messages[entries[lane].index],entries[lane].size,chunk,data,lanes,lane);
+    kernel(state,data);
+    for(lane = 0;lane < n;lane++)
+      if(chunk == sha1_multi_chunks(entries[lane].size) - 1u)
+        for(k = 0;k < 5;k++)
+          sha1_store_be(&digests[entries[lane].index][4 * k],state[k * lanes + lane]);
+  }
+}
+
+static int sha1_multi_compare(const void *a,const void *b)
+{
+  size_t sa = ((const sha1_multi_entry_t *)a)->size;
+  size_t sb = ((const sha1_multi_entry_t *)b)->size;
+
+  return (sa > sb) ? -1 : (sa < sb) ? 1 : 0;
+}
+
+__attribute__((unused))
+static void sha1_multi(const u08_t *const *messages,const size_t *sizes,size_t n,u08_t (*digests)[20])
+{
+  sha1_multi_kernel_t kernel = sha1_multi_block1;
+  int lanes = 1;
+  sha1_multi_entry_t *entries;
+  size_t i;
+
+  pthread_once(&sha1_batch_select_once,sha1_batch_select_kernel);
+#if defined(__x86_64__)
+  lanes = (int)sha1_batch_best_lanes;
+  kernel = (lanes == 16) ? sha1_multi_block16_avx512f : (lanes == 8) ? sha1_multi_block8_avx2 : (lanes == 4) ? sha1_multi_block4_sse2 : sha1_multi_block1;
+#endif
+  entries = (sha1_multi_entry_t *)malloc((n > 0) ? n * sizeof(sha1_multi_entry_t) : 1);
+  if(entries == NULL)
+  { // no memory for the sort, hash them one at a time
+    for(i = 0;i < n;i++)
+      sha1_digest(messages[i],sizes[i],digests[i]);
+    return;
+  }
+  for(i = 0;i < n;i++)
+  {
+    entries[i].size = sizes[i];
+    entries[i].index = i;
+  }
+  qsort(entries,n,sizeof(sha1_multi_entry_t),sha1_multi_compare);
+  for(i = 0;i < n;i += (size_t)lanes)
+    sha1_multi_group(kernel,lanes,messages,&entries[i],(n - i < (size_t)lanes) ? (int)(n - i) : lanes,digests);
+  free(entries);
+}
+
+
+//
+// the end!
+//
+
+#endif
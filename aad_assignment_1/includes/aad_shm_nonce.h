@@ -0,0 +1,262 @@
+#ifndef AAD_SHM_NONCE_H
+#define AAD_SHM_NONCE_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aad_data_types.h"
+#include "aad_coin_types.h"
+#include "aad_nonce_scheduler.h"
+
+//
+// nonce allocator shared by the miner processes of one host
+//
+// a small POSIX shared memory region (/dev/shm/deti_nonce) holds a registry of templates (DETI, or
+// one entry per custom text); each entry has a counter cursor that every attached process advances
+// with an atomic fetch-add, so several miner binaries mining the same template split the counter
+// space without overlap and without a coordinator process; the cursor survives the processes, so
+// a restarted miner also continues where the previous ones stopped
+//
+// the shared allocator is the refill callback of the nonce scheduler: each fetch-add hands a whole
+// NONCE_MAX_CHUNK range to the process, whose threads then split it as before; the single-thread
+// miners call it directly whenever they reach the end of their range
+//
+// the CUDA, MPI and WebAssembly miners and the library do not use it (see README.md)
+//
+// DETI_SHM turns it on: 1 (or yes/on) uses /deti_nonce, a value starting with '/' names another
+// region (one per group of cooperating miners); without it, or when the region cannot be used,
+// each process counts from 0 on its own (the previous behaviour)
+//
+// the region is created with mode 0600, so only miners of the same user share it; DETI_SHM_MODE
+// (octal, e.g. 0660 for a group) sets another mode when the region is created (fchmod, so the umask
+// does not narrow it); the owner of an existing region can change it with chmod /dev/shm/deti_nonce
+//
+// a creator that dies between shm_open(O_CREAT | O_EXCL) and the store of the magic number leaves
+// an empty or half initialized region behind; an attacher that still finds it so after waiting
+// SHM_NONCE_WAIT_POLLS ms finishes the initialization itself (all-zero templates are the initial
+// state, and several repairers write the same values); unlinking and recreating it instead could
+// put two repairing processes on two different regions, and their counters would overlap
+//
+
+#define SHM_NONCE_DEFAULT_NAME  "/deti_nonce"
+#define SHM_NONCE_MAGIC         0x314D485349544544ULL
+#define SHM_NONCE_VERSION       1u
+#define SHM_NONCE_TEMPLATES     64
+#define SHM_NONCE_TEXT_SIZE     36
+#define SHM_NONCE_WAIT_NS       1000000L    // attachers poll every 1 ms for the creator to finish
+#define SHM_NONCE_WAIT_POLLS    1000
+#define SHM_NONCE_MODE          0600        // default mode of a new region (DETI_SHM_MODE)
+
+typedef struct {
+    u64_t key;                      // 0 = free entry (claimed with a compare-and-swap)
+    u64_t next;                     // first counter not handed out yet (fetch-add)
+    u32_t attached;                 // processes attached now (stale after a crash)
+    s32_t last_pid;
+    char text[SHM_NONCE_TEXT_SIZE]; // "DETI" or the custom text (informational)
+} __attribute__((aligned(64))) shm_nonce_template_t;
+
+typedef struct {
+    u64_t magic;                    // written last by the creator
+    u32_t version;
+    u32_t n_templates;
+    shm_nonce_template_t templates[SHM_NONCE_TEMPLATES];
+} shm_nonce_region_t;
+
+typedef struct {
+    shm_nonce_region_t *region;     // NULL = not attached (local cursor only)
+    shm_nonce_template_t *entry;
+    char name[64];
+    nonce_cursor_t local;           // fallback cursor
+} shm_nonce_t;
+
+// FNV-1a of the template description; never 0 (0 marks a free entry)
+static inline u64_t shm_nonce_key(const char *text) {
+    u64_t h = 0xCBF29CE484222325ULL;
+
+    for (const u08_t *p = (const u08_t *)text; *p != 0; p++) {
+        h = (h ^ *p) * 0x100000001B3ULL;
+    }
+    return (h != 0) ? h : 1;
+}
+
+// DETI_SHM_MODE, or SHM_NONCE_MODE when it is not set or not an octal mode
+static inline mode_t shm_nonce_mode(void) {
+    const char *env = getenv("DETI_SHM_MODE");
+    char *end;
+
+    if (env != NULL && env[0] != '\0') {
+        long mode = strtol(env, &end, 8);
+        if (*end == '\0' && mode > 0 && mode <= 0777) {
+            return (mode_t)mode;
+        }
+        fprintf(stderr, "Warning: DETI_SHM_MODE \"%s\" is not an octal mode; using %04o\n", env, SHM_NONCE_MODE);
+    }
+    return SHM_NONCE_MODE;
+}
+
+// the creator's initialization (also used to repair a region whose creator died half way)
+static inline void shm_nonce_init_region(shm_nonce_region_t *region) {
+    region->version = SHM_NONCE_VERSION;
+    region->n_templates = SHM_NONCE_TEMPLATES;
+    __atomic_store_n(&region->magic, SHM_NONCE_MAGIC, __ATOMIC_RELEASE);
+}
+
+static inline shm_nonce_region_t *shm_nonce_map(const char *name) {
+    shm_nonce_region_t *region;
+    struct stat st;
+    int created = 1, empty = 0;
+    mode_t mode = shm_nonce_mode();
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+
+    if (fd < 0) {
+        created = 0;
+        if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+            return NULL;
+        }
+    } else if (fchmod(fd, mode) != 0 || ftruncate(fd, (off_t)sizeof(shm_nonce_region_t)) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    // an attacher may get here before the creator has sized the region; a creator that died before
+    // sizing it left it empty: the attacher sizes it (the new bytes are zeros)
+    for (int i = 0; !created; i++) {
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(shm_nonce_region_t)) {
+            break;
+        }
+        if (i == SHM_NONCE_WAIT_POLLS) {
+            if (ftruncate(fd, (off_t)sizeof(shm_nonce_region_t)) != 0) {
+                close(fd);
+                return NULL;
+            }
+            empty = 1;
+            break;
+        }
+        struct timespec nap = {0, SHM_NONCE_WAIT_NS};
+        nanosleep(&nap, NULL);
+    }
+    region = (shm_nonce_region_t *)mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    if (created) {
+        shm_nonce_init_region(region);
+        return region;
+    }
+    for (int i = 0; ; i++) {
+        u64_t magic = __atomic_load_n(&region->magic, __ATOMIC_ACQUIRE);
+        if (magic == SHM_NONCE_MAGIC) {
+            if (region->version == SHM_NONCE_VERSION && region->n_templates == SHM_NONCE_TEMPLATES) {
+                return region;
+            }
+            break;
+        }
+        if (magic != 0) {
+            break;  // not a nonce region
+        }
+        if (empty || i == SHM_NONCE_WAIT_POLLS) {
+            fprintf(stderr, "Warning: the shared nonce region %s was left %s by its creator; initializing it\n", name,
+                    empty ? "empty" : "half initialized");
+            shm_nonce_init_region(region);
+            return region;
+        }
+        struct timespec nap = {0, SHM_NONCE_WAIT_NS};
+        nanosleep(&nap, NULL);
+    }
+    munmap(region, sizeof(*region));
+    return NULL;
+}
+
+// finds the entry of a template, claiming a free one if needed
+static inline shm_nonce_template_t *shm_nonce_entry(shm_nonce_region_t *region, const char *text) {
+    u64_t key = shm_nonce_key(text);
+
+    for (int i = 0; i < SHM_NONCE_TEMPLATES; i++) {
+        shm_nonce_template_t *entry = &region->templates[(key + (u64_t)i) % SHM_NONCE_TEMPLATES];
+        u64_t found = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+        if (found == 0) {
+            u64_t expected = 0;
+            if (__atomic_compare_exchange_n(&entry->key, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                snprintf(entry->text, sizeof(entry->text), "%s", text);
+                return entry;
+            }
+            found = expected;   // another process claimed it first
+        }
+        if (found == key) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// attaches to the shared allocator when DETI_SHM asks for it; returns 1 when attached
+static inline int shm_nonce_attach(shm_nonce_t *shm, const coin_config_t *config) {
+    const char *env = getenv("DETI_SHM");
+    char text[SHM_NONCE_TEXT_SIZE];
+
+    memset(shm, 0, sizeof(*shm));
+    shm->local.next = 0;
+    shm->local.step = NONCE_MAX_CHUNK;
+    if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0 || strcmp(env, "off") == 0) {
+        return 0;
+    }
+    snprintf(shm->name, sizeof(shm->name), "%s", (env[0] == '/') ? env : SHM_NONCE_DEFAULT_NAME);
+    if (config->type == COIN_TYPE_CUSTOM && config->custom_text != NULL) {
+        snprintf(text, sizeof(text), "CUSTOM:%s", config->custom_text);
+    } else {
+        snprintf(text, sizeof(text), "DETI");
+    }
+
+    if ((shm->region = shm_nonce_map(shm->name)) == NULL) {
+        fprintf(stderr, "Warning: cannot use the shared nonce region %s; counting locally\n", shm->name);
+        return 0;
+    }
+    if ((shm->entry = shm_nonce_entry(shm->region, text)) == NULL) {
+        fprintf(stderr, "Warning: the shared nonce region %s has no free template entry; counting locally\n", shm->name);
+        munmap(shm->region, sizeof(*shm->region));
+        shm->region = NULL;
+        return 0;
+    }
+    __atomic_add_fetch(&shm->entry->attached, 1u, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->entry->last_pid, (s32_t)getpid(), __ATOMIC_RELAXED);
+    return 1;
+}
+
+static inline void shm_nonce_detach(shm_nonce_t *shm) {
+    if (shm->region == NULL) {
+        return;
+    }
+    __atomic_sub_fetch(&shm->entry->attached, 1u, __ATOMIC_RELAXED);
+    munmap(shm->region, sizeof(*shm->region));
+    shm->region = NULL;
+    shm->entry = NULL;
+}
+
+// nonce scheduler refill callback (arg is the shm_nonce_t)
+static inline int shm_nonce_refill(void *arg, u64_t *start, u64_t *end) {
+    shm_nonce_t *shm = (shm_nonce_t *)arg;
+
+    if (shm->entry == NULL) {
+        return nonce_cursor_refill(&shm->local, start, end);
+    }
+    *start = __atomic_fetch_add(&shm->entry->next, NONCE_MAX_CHUNK, __ATOMIC_RELAXED);
+    *end = *start + NONCE_MAX_CHUNK;
+    return 1;
+}
+
+static inline void shm_nonce_print(const shm_nonce_t *shm) {
+    if (shm->region == NULL) {
+        return;
+    }
+    printf("   Shared nonces: %s, template \"%s\", %u process(es), next counter 0x%016lx\n", shm->name,
+           shm->entry->text, __atomic_load_n(&shm->entry->attached, __ATOMIC_RELAXED),
+           __atomic_load_n(&shm->entry->next, __ATOMIC_RELAXED));
+}
+
+#endif
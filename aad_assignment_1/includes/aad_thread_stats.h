@@ -0,0 +1,300 @@
+#ifndef AAD_THREAD_STATS_H
+#define AAD_THREAD_STATS_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "aad_data_types.h"
+#include "aad_cgroup.h"
+#include "aad_background.h"
+#include "aad_energy.h"
+
+//
+// per-thread mining statistics and a reporter thread
+//
+// every mining thread owns one cache line of counters and is the only writer of it, so updates are
+// plain relaxed stores (no lock prefix, no line shared between cores); the reporter thread reads all
+// lines with relaxed loads on a fixed CLOCK_MONOTONIC cadence and prints the progress line, so no
+// mining thread ever calls time() or printf() in its hash loop
+//
+// counters:
+//   hashes --- SHA1 secure hashes computed (published in batches by the owner)
+//   coins  --- coins saved
+//   shares --- hashes that matched the DETI coin signature (coins plus rejected ones)
+//
+// when a cgroup is watched, the reporter also re-reads its CPU limits every interval, parks the
+// threads above the current limit (thread_stats_park) and adds the throttled periods to the line
+//
+// when the package energy counters (RAPL) are readable, every line also shows the power and the
+// hashes per joule of the interval
+//
+// in background mode the reporter also drives the duty cycle (background_control) every second
+//
+
+#define THREAD_STATS_CACHE_LINE     64
+#define THREAD_STATS_INTERVAL       5.0   // seconds between progress lines
+#define THREAD_STATS_POLL_NS        100000000L  // the reporter checks for stop every 100 ms
+#define THREAD_STATS_PARK_NS        100000000L  // parked threads check their state every 100 ms
+
+typedef struct {
+    u64_t hashes;
+    u64_t coins;
+    u64_t shares;
+    u08_t pad[THREAD_STATS_CACHE_LINE - 3 * sizeof(u64_t)];
+} __attribute__((aligned(THREAD_STATS_CACHE_LINE))) thread_counters_t;
+
+typedef struct {
+    u64_t hashes;
+    u64_t coins;
+    u64_t shares;
+} thread_totals_t;
+
+typedef struct {
+    thread_counters_t *threads;
+    int n_threads;
+    struct timespec start;
+    double interval;
+    volatile int stop;
+    int reporter_running;
+    pthread_t reporter;
+    int watch_cgroup;                   // re-check the cgroup limits in the reporter
+    cgroup_cpu_t cgroup;
+    cgroup_cpu_stat_t throttle_prev;    // cpu.stat at the previous line
+    cgroup_cpu_stat_t throttle_last;    // throttling during the latest interval
+    volatile int active_threads;        // threads with id >= active_threads are parked
+    background_t *background;           // background mode controller (NULL = off)
+    u64_t control_hashes;               // hashes at the previous duty update
+    double control_time;
+    energy_meter_t energy;              // package energy (no zones = not available)
+    double energy_prev;                 // joules at the previous line
+    double energy_last;                 // joules used during the latest interval
+} thread_stats_t;
+
+static inline double thread_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static inline double thread_stats_elapsed(const thread_stats_t *stats) {
+    return thread_stats_now() - ((double)stats->start.tv_sec + 1e-9 * (double)stats->start.tv_nsec);
+}
+
+static inline int thread_stats_init(thread_stats_t *stats, int n_threads) {
+    memset(stats, 0, sizeof(*stats));
+    stats->threads = (thread_counters_t *)aligned_alloc(THREAD_STATS_CACHE_LINE, (size_t)n_threads * sizeof(thread_counters_t));
+    if (stats->threads == NULL) {
+        return -1;
+    }
+    memset(stats->threads, 0, (size_t)n_threads * sizeof(thread_counters_t));
+    stats->n_threads = n_threads;
+    stats->interval = THREAD_STATS_INTERVAL;
+    stats->active_threads = n_threads;
+    energy_meter_init(&stats->energy);
+    clock_gettime(CLOCK_MONOTONIC, &stats->start);
+    return 0;
+}
+
+static inline void thread_stats_free(thread_stats_t *stats) {
+    free(stats->threads);
+    stats->threads = NULL;
+}
+
+// lets the reporter re-check the limits of a cgroup (already read by cgroup_cpu_init)
+static inline void thread_stats_watch_cgroup(thread_stats_t *stats, const cgroup_cpu_t *cgroup) {
+    stats->cgroup = *cgroup;
+    stats->watch_cgroup = (cgroup->version != 0);
+    cgroup_cpu_sample(&stats->cgroup, &stats->throttle_prev);
+}
+
+static inline void thread_stats_watch_background(thread_stats_t *stats, background_t *background) {
+    stats->background = background->enabled ? background : NULL;
+}
+
+//
+// owner-side updates (only the owning thread may call these for its counters)
+//
+
+static inline void thread_stats_set_hashes(thread_counters_t *c, u64_t hashes) {
+    __atomic_store_n(&c->hashes, hashes, __ATOMIC_RELAXED);
+}
+
+static inline void thread_stats_add_coin(thread_counters_t *c) {
+    __atomic_store_n(&c->coins, c->coins + 1, __ATOMIC_RELAXED);
+}
+
+static inline void thread_stats_add_share(thread_counters_t *c) {
+    __atomic_store_n(&c->shares, c->shares + 1, __ATOMIC_RELAXED);
+}
+
+// called by a mining thread between chunks: sleeps while the cgroup limit leaves no CPU for it
+static inline void thread_stats_park(const thread_stats_t *stats, int thread_id, const volatile int *stop) {
+    while (thread_id >= __atomic_load_n(&stats->active_threads, __ATOMIC_RELAXED) && !*stop) {
+        struct timespec nap = {0, THREAD_STATS_PARK_NS};
+        nanosleep(&nap, NULL);
+    }
+}
+
+//
+// reader side
+//
+
+static inline void thread_stats_totals(const thread_stats_t *stats, thread_totals_t *t) {
+    memset(t, 0, sizeof(*t));
+    for (int i = 0; i < stats->n_threads; i++) {
+        t->hashes += __atomic_load_n(&stats->threads[i].hashes, __ATOMIC_RELAXED);
+        t->coins += __atomic_load_n(&stats->threads[i].coins, __ATOMIC_RELAXED);
+        t->shares += __atomic_load_n(&stats->threads[i].shares, __ATOMIC_RELAXED);
+    }
+}
+
+static inline u64_t thread_stats_total_coins(const thread_stats_t *stats) {
+    u64_t coins = 0;
+    for (int i = 0; i < stats->n_threads; i++) {
+        coins += __atomic_load_n(&stats->threads[i].coins, __ATOMIC_RELAXED);
+    }
+    return coins;
+}
+
+// re-reads the cgroup limits, resizes the active thread count and measures the throttling since
+// the previous call (reporter thread only)
+static inline void thread_stats_check_cgroup(thread_stats_t *stats) {
+    cgroup_cpu_stat_t now;
+
+    if (!stats->watch_cgroup) {
+        return;
+    }
+    cgroup_cpu_refresh(&stats->cgroup);
+    __atomic_store_n(&stats->active_threads, cgroup_cpu_size_threads(&stats->cgroup, stats->n_threads), __ATOMIC_RELAXED);
+    cgroup_cpu_sample(&stats->cgroup, &now);
+    // a new limiting cgroup (or counters that went backwards) restarts the deltas
+    if (now.periods < stats->throttle_prev.periods || now.throttled < stats->throttle_prev.throttled ||
+        now.throttled_usec < stats->throttle_prev.throttled_usec) {
+        stats->throttle_prev = now;
+    }
+    stats->throttle_last.periods = now.periods - stats->throttle_prev.periods;
+    stats->throttle_last.throttled = now.throttled - stats->throttle_prev.throttled;
+    stats->throttle_last.throttled_usec = now.throttled_usec - stats->throttle_prev.throttled_usec;
+    stats->throttle_prev = now;
+}
+
+// prints the progress line and returns the hash count it used
+static inline u64_t thread_stats_print_line(const thread_stats_t *stats, double elapsed, u64_t prev_hashes, double prev_elapsed) {
+    thread_totals_t t;
+
+    thread_stats_totals(stats, &t);
+    printf("[%ds] %lu M @ %.2f M/s (last %.2f M/s) | Coins: %lu | Shares: %lu | Threads: ",
+           (int)elapsed,
+           t.hashes / 1000000UL,
+           (elapsed > 0.0) ? (double)t.hashes / elapsed / 1e6 : 0.0,
+           (elapsed > prev_elapsed) ? (double)(t.hashes - prev_hashes) / (elapsed - prev_elapsed) / 1e6 : 0.0,
+           t.coins,
+           t.shares);
+    if (stats->active_threads < stats->n_threads) {
+        printf("%d/%d", stats->active_threads, stats->n_threads);
+    } else {
+        printf("%d", stats->n_threads);
+    }
+    if (stats->watch_cgroup && stats->cgroup.quota_cpus > 0.0) {
+        printf(" | Throttled: %lu/%lu periods (%.2f s)",
+               stats->throttle_last.throttled,
+               stats->throttle_last.periods,
+               1e-6 * (double)stats->throttle_last.throttled_usec);
+    }
+    if (stats->energy.n_zones > 0 && stats->energy_last > 0.0 && elapsed > prev_elapsed) {
+        printf(" | %.1f W, %.2f MH/J",
+               stats->energy_last / (elapsed - prev_elapsed),
+               (double)(t.hashes - prev_hashes) / stats->energy_last / 1e6);
+    }
+    if (stats->background != NULL) {
+        printf(" | Duty: %.0f%% (%s)", 100.0 * stats->background->duty, stats->background->reason);
+    }
+    printf("\n");
+    fflush(stdout);
+    return t.hashes;
+}
+
+// energy summary for the final report ("J, MH/J, W"); returns 0 when no meter is available
+// (call after thread_stats_stop_reporter)
+static inline int thread_stats_energy_text(thread_stats_t *stats, u64_t hashes, double elapsed, char *text, size_t size) {
+    if (stats->energy.n_zones == 0) {
+        return 0;
+    }
+    double joules = energy_meter_sample(&stats->energy);
+    if (joules <= 0.0 || elapsed <= 0.0) {
+        return 0;
+    }
+    snprintf(text, size, "%.1f J, %.3f MH/J, %.1f W", joules, (double)hashes / joules / 1e6, joules / elapsed);
+    return 1;
+}
+
+static void *thread_stats_reporter(void *arg) {
+    thread_stats_t *stats = (thread_stats_t *)arg;
+    double next = stats->interval, prev_elapsed = 0.0;
+    u64_t prev_hashes = 0;
+
+    while (!__atomic_load_n(&stats->stop, __ATOMIC_ACQUIRE)) {
+        struct timespec nap = {0, THREAD_STATS_POLL_NS};
+        nanosleep(&nap, NULL);
+        double elapsed = thread_stats_elapsed(stats);
+        if (stats->background != NULL && elapsed - stats->control_time >= BACKGROUND_CONTROL_PERIOD) {
+            thread_totals_t t;
+            thread_stats_totals(stats, &t);
+            background_control(stats->background, (double)(t.hashes - stats->control_hashes) / (elapsed - stats->control_time),
+                               stats->active_threads);
+            stats->control_hashes = t.hashes;
+            stats->control_time = elapsed;
+        }
+        if (elapsed < next) {
+            continue;
+        }
+        thread_stats_check_cgroup(stats);
+        if (stats->energy.n_zones > 0) {
+            double joules = energy_meter_sample(&stats->energy);
+            stats->energy_last = joules - stats->energy_prev;
+            stats->energy_prev = joules;
+        }
+        prev_hashes = thread_stats_print_line(stats, elapsed, prev_hashes, prev_elapsed);
+        prev_elapsed = elapsed;
+        while (next <= elapsed) {
+            next += stats->interval;
+        }
+    }
+    return NULL;
+}
+
+// starts the reporter with the lowest scheduling priority available (SCHED_IDLE on Linux), so it
+// never takes a core away from a mining thread
+static inline int thread_stats_start_reporter(thread_stats_t *stats) {
+    pthread_attr_t attr;
+    int result;
+
+    pthread_attr_init(&attr);
+#ifdef SCHED_IDLE
+    struct sched_param param = {0};
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_IDLE);
+    pthread_attr_setschedparam(&attr, &param);
+#endif
+    result = pthread_create(&stats->reporter, &attr, thread_stats_reporter, stats);
+    if (result != 0) {
+        // explicit scheduling may be refused (e.g. by a seccomp profile); use the default one
+        result = pthread_create(&stats->reporter, NULL, thread_stats_reporter, stats);
+    }
+    pthread_attr_destroy(&attr);
+    stats->reporter_running = (result == 0);
+    return (result == 0) ? 0 : -1;
+}
+
+static inline void thread_stats_stop_reporter(thread_stats_t *stats) {
+    __atomic_store_n(&stats->stop, 1, __ATOMIC_RELEASE);
+    if (stats->reporter_running) {
+        pthread_join(stats->reporter, NULL);
+        stats->reporter_running = 0;
+    }
+}
+
+#endif
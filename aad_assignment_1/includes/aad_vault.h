@@ -9,6 +9,8 @@
 #ifndef AAD_VAULT
 #define AAD_VAULT
 
+#include "aad_vault_dedup.h"
+
 static void save_coin(u32_t coin[14])
 {
 # define VAULT_FILE_NAME  "deti_coins_v2_vault.txt"
@@ -33,6 +35,8 @@ static void save_coin(u32_t coin[14])
     [55u] = (u08_t)0x80
   };
   static int error_tolerance_count = 4; // number of errors to tolerate before bailing out
+  static vault_dedup_set_t saved_fingerprints; // coins already in the vault (loaded on first use)
+  static int saved_fingerprints_loaded = 0;
   u32_t idx,n,hash[5];
   char *reason;
   u08_t *s;
@@ -126,6 +130,19 @@ error:
      if((hash[1u + n / 32u] >> (31u - n % 32u)) % 2u != 0u)
        break;
   //
+  // skip coins that are already in the vault (overlapping nonce ranges, restarts, ...)
+  //
+  if(saved_fingerprints_loaded == 0)
+  {
+    (void)vault_dedup_load_file(&saved_fingerprints,VAULT_FILE_NAME,NULL); // a missing vault is fine
+    saved_fingerprints_loaded = 1;
+  }
+  if(vault_dedup_insert(&saved_fingerprints,vault_coin_fingerprint(coin)) == 0)
+  {
+    fprintf(stderr,"save_coin(): duplicate DETI coin ignored\n");
+    return;
+  }
+  //
   // save the coin in the buffer
   // format of each line: "Vuv:" "coin_data" where u and v are ascii digits that encode, in base 10, the reported power of the coin
   //
@@ -0,0 +1,291 @@
+#ifndef AAD_VAULT_DEDUP_H
+#define AAD_VAULT_DEDUP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aad_data_types.h"
+
+//
+// vault records and coin deduplication
+//
+// each vault record is "Vuv:" followed by the 55 bytes of the coin; the last coin byte is always
+// '\n' and the template forbids '\n' in bytes 12..53, so a record is exactly one 59-byte line
+//
+// duplicates are detected with an open-addressing (linear probing) set of 64-bit fingerprints
+// of the coin bytes; a fingerprint of 0 marks an empty slot, so each stored coin costs 8 bytes
+// of table at a load factor of at most 3/4
+//
+
+#define VAULT_RECORD_SIZE      (4 + 55)
+#define VAULT_READER_BUF_SIZE  (1u << 20)
+
+typedef struct {
+    u64_t *slots;
+    u64_t mask;      // capacity - 1 (capacity is a power of two)
+    u64_t count;
+} vault_dedup_set_t;
+
+typedef struct {
+    u64_t records;   // well-formed records read
+    u64_t unique;    // records inserted in the set
+    u64_t duplicates;
+    u64_t malformed; // lines that are not 59-byte records (blank lines are ignored)
+} vault_dedup_stats_t;
+
+// buffered line reader (coins may contain '\0', so fgets() cannot be used)
+typedef struct {
+    FILE *fp;
+    u08_t *buf;
+    size_t pos, len;
+    int eof;
+} vault_reader_t;
+
+// 64-bit FNV-1a of the 55 coin bytes followed by a splitmix64 finalizer
+static inline u64_t vault_bytes_fingerprint(const u08_t msg[55]) {
+    u64_t h = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < 55; i++) {
+        h ^= msg[i];
+        h *= 0x100000001B3ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return h ? h : 1;
+}
+
+static inline u64_t vault_coin_fingerprint(const u32_t coin[14]) {
+    u08_t msg[55];
+    for (int i = 0; i < 55; i++) {
+        msg[i] = ((const u08_t *)coin)[i ^ 3];
+    }
+    return vault_bytes_fingerprint(msg);
+}
+
+// checks the "Vuv:" prefix and the trailing '\n' of a record
+static inline int vault_record_is_valid(const u08_t *line, size_t len) {
+    return len == VAULT_RECORD_SIZE && line[0] == 'V' &&
+           line[1] >= '0' && line[1] <= '9' && line[2] >= '0' && line[2] <= '9' &&
+           line[3] == ':' && line[VAULT_RECORD_SIZE - 1] == '\n';
+}
+
+static inline int vault_record_power(const u08_t *line) {
+    return 10 * (line[1] - '0') + (line[2] - '0');
+}
+
+// rebuilds the u32_t[14] representation used by sha1() (including the 0x80 padding byte)
+static inline void vault_record_to_coin(const u08_t *line, u32_t coin[14]) {
+    for (int i = 0; i < 55; i++) {
+        ((u08_t *)coin)[i ^ 3] = line[4 + i];
+    }
+    ((u08_t *)coin)[55 ^ 3] = 0x80;
+}
+
+// the miners store the custom text (if any) from coin byte 20 on, then a 32-bit time(NULL) word
+// (most significant byte first), then zeros up to byte 51; the last non-zero word of 5..12 is
+// therefore the time stamp and the bytes before it are the custom text (empty for DETI coins)
+static inline u32_t vault_record_word(const u08_t *line, int word) {
+    const u08_t *b = line + 4 + 4 * word;
+    return ((u32_t)b[0] << 24) | ((u32_t)b[1] << 16) | ((u32_t)b[2] << 8) | (u32_t)b[3];
+}
+
+static inline u32_t vault_record_timestamp(const u08_t *line) {
+    for (int w = 12; w >= 5; w--) {
+        u32_t t = vault_record_word(line, w);
+        if (t != 0u) {
+            return t;
+        }
+    }
+    return 0u;
+}
+
+// copies the custom text (at most 28 bytes plus '\0'); returns its length, or -1 if the bytes in
+// front of the time stamp are not printable (coins made by miners that use another layout)
+static inline int vault_record_custom_text(const u08_t *line, char text[29]) {
+    int w = 12;
+    while (w >= 5 && vault_record_word(line, w) == 0u) {
+        w--;
+    }
+    int len = (w > 5) ? 4 * (w - 5) : 0;
+    while (len > 0 && line[4 + 20 + len - 1] == 0) {
+        len--;
+    }
+    for (int i = 0; i < len; i++) {
+        u08_t c = line[4 + 20 + i];
+        if (c < 32 || c > 126) {
+            text[0] = '\0';
+            return -1;
+        }
+        text[i] = (char)c;
+    }
+    text[len] = '\0';
+    return len;
+}
+
+static inline int vault_dedup_init(vault_dedup_set_t *set, u64_t expected) {
+    u64_t capacity = 1024;
+    while (capacity < expected + expected / 3) {
+        capacity <<= 1;
+    }
+    set->slots = (u64_t *)calloc(capacity, sizeof(u64_t));
+    set->mask = capacity - 1;
+    set->count = 0;
+    return set->slots != NULL ? 0 : -1;
+}
+
+static inline void vault_dedup_free(vault_dedup_set_t *set) {
+    free(set->slots);
+    set->slots = NULL;
+    set->mask = 0;
+    set->count = 0;
+}
+
+static inline void vault_dedup_place(u64_t *slots, u64_t mask, u64_t fp) {
+    u64_t idx = fp & mask;
+    while (slots[idx] != 0) {
+        idx = (idx + 1) & mask;
+    }
+    slots[idx] = fp;
+}
+
+static inline int vault_dedup_grow(vault_dedup_set_t *set) {
+    u64_t new_mask = 2 * set->mask + 1;
+    u64_t *new_slots = (u64_t *)calloc(new_mask + 1, sizeof(u64_t));
+    if (new_slots == NULL) {
+        return -1;
+    }
+    for (u64_t i = 0; i <= set->mask; i++) {
+        if (set->slots[i] != 0) {
+            vault_dedup_place(new_slots, new_mask, set->slots[i]);
+        }
+    }
+    free(set->slots);
+    set->slots = new_slots;
+    set->mask = new_mask;
+    return 0;
+}
+
+static inline int vault_dedup_contains(const vault_dedup_set_t *set, u64_t fp) {
+    if (set->slots == NULL) {
+        return 0;
+    }
+    for (u64_t idx = fp & set->mask; set->slots[idx] != 0; idx = (idx + 1) & set->mask) {
+        if (set->slots[idx] == fp) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// returns 1 if fp was inserted, 0 if it was already present, -1 on allocation failure
+static inline int vault_dedup_insert(vault_dedup_set_t *set, u64_t fp) {
+    if (set->slots == NULL && vault_dedup_init(set, 0) != 0) {
+        return -1;
+    }
+    u64_t idx = fp & set->mask;
+    while (set->slots[idx] != 0) {
+        if (set->slots[idx] == fp) {
+            return 0;
+        }
+        idx = (idx + 1) & set->mask;
+    }
+    set->slots[idx] = fp;
+    set->count++;
+    if (4 * set->count > 3 * (set->mask + 1) && vault_dedup_grow(set) != 0) {
+        return -1;
+    }
+    return 1;
+}
+
+static inline int vault_reader_open(vault_reader_t *r, const char *path) {
+    r->buf = NULL;
+    r->fp = fopen(path, "rb");
+    if (r->fp == NULL) {
+        return -1;
+    }
+    r->buf = (u08_t *)malloc(VAULT_READER_BUF_SIZE);
+    if (r->buf == NULL) {
+        fclose(r->fp);
+        return -1;
+    }
+    r->pos = r->len = 0;
+    r->eof = 0;
+    return 0;
+}
+
+static inline void vault_reader_close(vault_reader_t *r) {
+    if (r->fp != NULL) {
+        fclose(r->fp);
+    }
+    free(r->buf);
+    r->fp = NULL;
+    r->buf = NULL;
+}
+
+// returns a pointer to the next line (including its '\n', if any) and its length, or NULL at
+// the end of the file; lines longer than the buffer are returned in pieces (and are malformed)
+static inline const u08_t *vault_reader_next(vault_reader_t *r, size_t *len) {
+    for (;;) {
+        u08_t *start = r->buf + r->pos;
+        u08_t *nl = (u08_t *)memchr(start, '\n', r->len - r->pos);
+        if (nl != NULL) {
+            *len = (size_t)(nl - start) + 1;
+            r->pos += *len;
+            return start;
+        }
+        if (r->eof || (r->pos == 0 && r->len == VAULT_READER_BUF_SIZE)) {
+            if (r->pos == r->len) {
+                return NULL;
+            }
+            *len = r->len - r->pos;
+            r->pos = r->len;
+            return start;
+        }
+        memmove(r->buf, start, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        size_t n = fread(r->buf + r->len, 1, VAULT_READER_BUF_SIZE - r->len, r->fp);
+        if (n == 0) {
+            r->eof = 1;
+        }
+        r->len += n;
+    }
+}
+
+// inserts every record of a vault file in the set; returns -1 if the file cannot be opened
+static inline int vault_dedup_load_file(vault_dedup_set_t *set, const char *path, vault_dedup_stats_t *stats) {
+    vault_reader_t r;
+    const u08_t *line;
+    size_t len;
+
+    if (vault_reader_open(&r, path) != 0) {
+        return -1;
+    }
+    while ((line = vault_reader_next(&r, &len)) != NULL) {
+        if (!vault_record_is_valid(line, len)) {
+            if (stats != NULL && !(len == 1 && line[0] == '\n')) {
+                stats->malformed++;
+            }
+            continue;
+        }
+        int inserted = vault_dedup_insert(set, vault_bytes_fingerprint(line + 4));
+        if (inserted < 0) {
+            vault_reader_close(&r);
+            return -1;
+        }
+        if (stats != NULL) {
+            stats->records++;
+            if (inserted) {
+                stats->unique++;
+            } else {
+                stats->duplicates++;
+            }
+        }
+    }
+    vault_reader_close(&r);
+    return 0;
+}
+
+#endif